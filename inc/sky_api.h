@@ -0,0 +1,44 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_API_H
+#define SKY_API_H
+
+#include "sky_protocol.h"
+
+// The api server format (xml or json) is selected per partner by
+// creq->key.api_format, see enum SKY_API_FORMAT.
+
+// returns the http Content-Type of the api server format
+const char * sky_api_content_type(uint8_t api_format);
+
+// encodes location_rq_t into the api server format, result is in buff
+// returns str len or -1 if it fails
+int32_t sky_encode_req_api(char *buff, int32_t buff_len, const struct location_rq_t *creq);
+
+// request stage before sky_encode_req_api: drops the invalid and duplicate
+// access point MACs, and keeps the max_aps strongest in request order, with
+// the connected access point always kept; max_aps is creq->key.max_aps of
+// the partner, 0 keeps all the valid access points; the access points beyond
+// MAX_APS are dropped
+// returns the # of access points dropped
+uint32_t sky_select_aps(struct location_rq_t *creq, uint32_t max_aps);
+
+// decodes the api server response into location_rsp_t, with the request id of creq
+// Return code: same as sky_decode_resp_xml
+int32_t sky_decode_resp_api(char *buff, int32_t buff_len, int32_t data_len,
+        const struct location_rq_t *creq, struct location_rsp_t *cresp);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
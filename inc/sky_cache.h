@@ -0,0 +1,121 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_CACHE_H
+#define SKY_CACHE_H
+
+#include "sky_protocol.h"
+
+// Location result cache of the gateway, keyed by the fingerprint of the scan.
+// The cache is split into shards with a lock each; a shard is an array of
+// SKY_CACHE_WAYS way set associative sets with CLOCK eviction within the set.
+// A negative cache is a separate instance with its own capacity and a short ttl,
+// which answers the repeated scans of LOCATION_UNABLE_TO_DETERMINE locally.
+//
+// For warm restarts the cache is written to a snapshot file periodically by a
+// background thread, which locks one shard at a time. The snapshot loaded at
+// startup is mapped, and its results are copied into the cache on lookup misses;
+// its records never looked up are kept by the next snapshots until they expire.
+
+#define SKY_CACHE_WAYS              8
+#define SKY_CACHE_TTL_DEFAULT       300 // seconds
+#define SKY_CACHE_NEGATIVE_TTL      30  // seconds, default ttl of a negative cache
+#define SKY_CACHE_SNAPSHOT_INTERVAL 60  // seconds
+#define SKY_CACHE_RSSI_BUCKET       10  // dBm
+
+#define SKY_ADDR_FIELDS             11  // street_num ... country_code
+
+struct sky_cache_t;
+
+// a length and string field of location_ext_t
+struct sky_addr_ref_t {
+    uint16_t *len;
+    char **str;
+};
+
+struct sky_cache_config_t {
+    uint32_t capacity;    // max # of entries, rounded up to a power of 2
+    uint32_t shards;      // # of locks, rounded up to a power of 2
+    uint32_t ttl;         // seconds an entry is valid
+    uint8_t rssi_bucket;  // dBm width of the rssi buckets in the fingerprint
+    uint8_t negative;     // stores LOCATION_UNABLE_TO_DETERMINE results only
+};
+
+struct sky_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;   // valid entries replaced
+    uint64_t expired;     // lookups of expired entries
+    uint64_t entries;     // current # of valid entries
+    uint64_t restored;    // entries copied from the snapshot
+};
+
+// sets refs to the address fields of ext in the order of their data types
+void sky_addr_refs(struct location_ext_t *ext, struct sky_addr_ref_t *refs);
+
+// bytes of the packed address fields of ext
+uint32_t sky_addr_packed_len(const struct location_ext_t *ext);
+
+// packs the address fields of ext into addr, sky_addr_packed_len bytes
+void sky_addr_pack(const struct location_ext_t *ext, uint8_t *addr);
+
+// sets the address fields of ext from the packed fields, the strings are copied into buff
+// addr_len 0 clears the fields
+void sky_addr_unpack(struct location_ext_t *ext, const uint8_t *addr, uint32_t addr_len, char *buff);
+
+// returns the cache, or NULL if it fails
+struct sky_cache_t * sky_cache_create(const struct sky_cache_config_t *config);
+
+void sky_cache_destroy(struct sky_cache_t *cache);
+
+// fingerprint of the canonical scan: sorted AP MACs with bucketed rssi, cell ids,
+// gps position rounded to about 10 m, payload type and partner id
+// all the access points of a scan above MAX_APS are hashed without sorting
+// never returns 0
+uint64_t sky_cache_fingerprint(const struct sky_cache_t *cache, const struct location_rq_t *creq);
+
+// on hit, sets the payload type, location and the address fields of cresp;
+// the address strings are copied into buff
+// returns 1 on hit, 0 on miss
+int32_t sky_cache_get(struct sky_cache_t *cache, uint64_t fingerprint,
+        struct location_rsp_t *cresp, char *buff, uint32_t buff_len);
+
+// stores the result of a LOCATION_RQ_SUCCESS or LOCATION_RQ_ADDR_SUCCESS response,
+// or of a LOCATION_UNABLE_TO_DETERMINE response in a negative cache
+// returns 0 or -1 when fails
+int32_t sky_cache_put(struct sky_cache_t *cache, uint64_t fingerprint,
+        const struct location_rsp_t *cresp);
+
+// writes the valid entries, and the valid records of the loaded snapshot not in
+// the cache, to the snapshot file, replacing it atomically
+// returns the # of entries written, or -1 if it fails
+int32_t sky_cache_save(struct sky_cache_t *cache, const char *path);
+
+// maps the snapshot file, call it before the cache is shared by threads
+// returns the # of entries of the snapshot, or -1 if it is missing or corrupt
+int32_t sky_cache_load(struct sky_cache_t *cache, const char *path);
+
+// starts the thread writing the snapshot every interval seconds
+// returns 0 or -1 when fails
+int32_t sky_cache_snapshot_start(struct sky_cache_t *cache, const char *path, uint32_t interval);
+
+// stops the thread and writes a last snapshot, called by sky_cache_destroy
+// returns 0 or -1 when fails
+int32_t sky_cache_snapshot_stop(struct sky_cache_t *cache);
+
+void sky_cache_get_stats(struct sky_cache_t *cache, struct sky_cache_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
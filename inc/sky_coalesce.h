@@ -0,0 +1,84 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_COALESCE_H
+#define SKY_COALESCE_H
+
+#include "sky_protocol.h"
+
+// In flight request table of the gateway, keyed by the sky_cache fingerprint.
+// The first request of a scan is the leader and is sent upstream; identical
+// scans arriving before its response are followers, their continuations are
+// called with the response of the leader by sky_coalesce_complete.
+// A leader not completed within the timeout is replaced by the next request
+// of the scan, which answers the followers already waiting, or failed by
+// sky_coalesce_expire if no such request arrives.
+
+#define SKY_COALESCE_LEADER         0
+#define SKY_COALESCE_FOLLOWER       1
+
+#define SKY_COALESCE_TIMEOUT        5000 // ms
+#define SKY_COALESCE_MAX_WAITERS    1024 // followers per scan
+
+struct sky_coalesce_t;
+
+// continuation of a follower, cresp is NULL if the upstream request failed;
+// cresp and its address strings are valid during the call only
+typedef void (*sky_coalesce_cb_t)(void *arg, const struct location_rsp_t *cresp);
+
+struct sky_coalesce_config_t {
+    uint32_t capacity;    // # of hash buckets, rounded up to a power of 2
+    uint32_t shards;      // # of locks, rounded up to a power of 2
+    uint32_t timeout;     // ms a leader is waited for
+    uint32_t max_waiters; // followers per scan
+};
+
+struct sky_coalesce_stats_t {
+    uint64_t leaders;
+    uint64_t followers;
+    uint64_t takeovers;   // leaders replaced after the timeout
+    uint64_t overflows;   // requests not coalesced, too many followers
+    uint64_t expired;     // scans of a lost leader removed by sky_coalesce_expire
+    uint64_t inflight;    // current # of scans in flight
+};
+
+// returns the table, or NULL if it fails
+struct sky_coalesce_t * sky_coalesce_create(const struct sky_coalesce_config_t *config);
+
+// the scans in flight are completed with a NULL response
+void sky_coalesce_destroy(struct sky_coalesce_t *table);
+
+// joins the scan of the fingerprint
+// returns SKY_COALESCE_LEADER if the request has to be sent upstream and completed,
+// SKY_COALESCE_FOLLOWER if cb will be called, or -1 if it is not coalesced
+int32_t sky_coalesce_join(struct sky_coalesce_t *table, uint64_t fingerprint,
+        sky_coalesce_cb_t cb, void *arg);
+
+// calls the continuations of the followers with the response of the leader,
+// NULL if the upstream request failed
+// returns the # of followers answered
+int32_t sky_coalesce_complete(struct sky_coalesce_t *table, uint64_t fingerprint,
+        const struct location_rsp_t *cresp);
+
+// removes the scans whose leader is not completed within the timeout and calls
+// the continuations of their followers with a NULL response, a late
+// sky_coalesce_complete of the lost leader answers nobody; to be called
+// periodically, e.g. every timeout ms
+// returns the # of followers answered
+int32_t sky_coalesce_expire(struct sky_coalesce_t *table);
+
+void sky_coalesce_get_stats(struct sky_coalesce_t *table, struct sky_coalesce_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
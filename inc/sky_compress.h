@@ -0,0 +1,59 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_COMPRESS_H
+#define SKY_COMPRESS_H
+
+#include "sky_protocol.h"
+
+// Note: compression is only available if the library is built with
+//       -DSKY_ZLIB and linked with -lz; otherwise all the functions
+//       below fail for any content encoding but identity.
+
+#define SKY_COMPRESS_LEVEL_DEFAULT  (-1) // zlib default, currently 6
+
+// http content codings of the xml request and response bodies
+enum SKY_CONTENT_ENCODING {
+    CONTENT_ENCODING_IDENTITY = 0, // not compressed
+    CONTENT_ENCODING_DEFLATE,      // zlib format (RFC 1950)
+    CONTENT_ENCODING_GZIP,         // gzip format (RFC 1952)
+};
+
+// returns the value of the http Content-Encoding header of the content encoding,
+// or NULL for identity
+const char * sky_content_encoding_name(uint8_t encoding);
+
+// parses the Content-Encoding header in the http response header
+// returns the content encoding or -1 if it is not supported
+int32_t sky_get_content_encoding(const char *http_header, int32_t header_len);
+
+// compresses data into buff with compression level 0 - 9 (or SKY_COMPRESS_LEVEL_DEFAULT)
+// returns the compressed len or -1 if it fails
+int32_t sky_compress(uint8_t *buff, int32_t buff_len, const uint8_t *data, int32_t data_len,
+        uint8_t encoding, int32_t level);
+
+// decompresses data into buff and terminates it with \0, so that it can be passed
+// to sky_decode_resp_xml
+// returns the decompressed len (without \0) or -1 if it fails
+int32_t sky_decompress(char *buff, int32_t buff_len, const uint8_t *data, int32_t data_len,
+        uint8_t encoding);
+
+// encodes location_rq_t into xml in xml_buff, and compresses it into buff
+// returns the compressed len or -1 if it fails
+int32_t sky_encode_req_xml_compressed(uint8_t *buff, int32_t buff_len,
+        char *xml_buff, int32_t xml_buff_len, const struct location_rq_t *creq,
+        uint8_t encoding, int32_t level);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -27,6 +27,20 @@ int32_t sky_aes_decrypt(uint8_t *data, uint32_t data_len, uint8_t *key,
 
 uint16_t fletcher16(uint8_t const *buff, int32_t buff_len);
 
+/* generate a unique 12 byte nonce for AES-GCM */
+// returns 0, or -1 if there is no entropy to seed the nonces
+int32_t sky_gen_nonce(uint8_t *nonce);
+
+/* AES-128-GCM encrypt data in place and authenticate it and aad */
+// key is 16, nonce is 12 and tag is 16 byte long
+int32_t sky_gcm_seal(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, uint32_t aad_len,
+        uint8_t *data, uint32_t data_len, uint8_t *tag);
+
+/* AES-128-GCM verify the tag and decrypt data in place */
+// returns -1 and clears data if the tag is invalid
+int32_t sky_gcm_open(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, uint32_t aad_len,
+        uint8_t *data, uint32_t data_len, const uint8_t *tag);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,108 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_GATEWAY_H
+#define SKY_GATEWAY_H
+
+#include "sky_protocol.h"
+
+// Gateway transaction: the device packet is decrypted and decoded in place in
+// the wire buffer, the request to the api server is encoded into the scratch
+// arena, the api server response is received into the scratch arena and
+// decoded in place, and the response packet is encoded and encrypted in place
+// in the wire buffer. The context and both buffers are taken from sky_pool
+// and reused by the next transactions.
+//
+//   wire = sky_gateway_rx(gw, &len);              receive the device packet
+//   key = lookup(sky_get_partner_id_from_rq_header(wire, n));
+//   down = sky_gateway_probe(gw, n, key, &len);   send len bytes to the device, or if NULL:
+//   up = sky_gateway_upstream(gw, n, key, &len);  send len bytes to the api server
+//   scratch = sky_gateway_upstream_rx(gw, &len);  receive its response
+//   down = sky_gateway_downstream(gw, m, &len);   send len bytes to the device
+//
+// A LOCATION_RQ_BATCH is decrypted and decoded once, and fanned out to the api
+// server a scan at a time by the caller:
+//
+//   n = sky_gateway_batch(gw, n, key, scans, max);   decode the scans
+//   sky_encode_req_api(...scans[i]...); sky_decode_resp_api(...scans[i], &cresps[i]);
+//   down = sky_gateway_batch_downstream(gw, cresps, n, &len);   send len bytes to the device
+//
+// With a session table, delta scans are reconstructed by sky_gateway_upstream;
+// if the base scan is unknown it returns NULL, and sky_gateway_downstream(gw, -1, &len)
+// answers LOCATION_RQ_BASE_UNKNOWN so the device resends the full scan.
+//
+// Note: legacy (CBC) packets are decrypted through a stack copy by sky_aes_decrypt,
+//       SKY_PROTOCOL_VERSION_AEAD packets are opened and sealed in place.
+
+#define SKY_GATEWAY_SCRATCH_LEN     16384 // bytes of the api server request and response
+
+struct sky_gateway_t;
+struct sky_session_t;
+
+// returns the context, or NULL if it fails; scratch_len is 0 for SKY_GATEWAY_SCRATCH_LEN
+struct sky_gateway_t * sky_gateway_create(uint32_t scratch_len);
+
+void sky_gateway_destroy(struct sky_gateway_t *gw);
+
+// sets the session table of the delta scans, which can be shared by the gateways;
+// without one, delta scans are answered LOCATION_RQ_BASE_UNKNOWN
+void sky_gateway_set_session(struct sky_gateway_t *gw, struct sky_session_t *session);
+
+// buffer the device packet is received into, buff_len is set to its size
+uint8_t * sky_gateway_rx(struct sky_gateway_t *gw, uint32_t *buff_len);
+
+// decrypts and decodes the data_len bytes of the device packet, selects the
+// access points of the key and encodes the api server request
+// key has to be valid until sky_gateway_downstream returns
+// returns the request in the scratch arena and sets len, or NULL if it fails
+// or the packet is a PROBE_REQUEST, which is answered by sky_gateway_probe
+char * sky_gateway_upstream(struct sky_gateway_t *gw, uint32_t data_len,
+        const struct sky_key_t *key, int32_t *len);
+
+// answers a PROBE_REQUEST from its template, without the api server
+// returns the response in the wire buffer and sets len, or NULL if the packet
+// is not a probe, which is left as received
+uint8_t * sky_gateway_probe(struct sky_gateway_t *gw, uint32_t data_len,
+        const struct sky_key_t *key, int32_t *len);
+
+// buffer the api server response is received into, buff_len is set to its size;
+// the api server request is overwritten
+char * sky_gateway_upstream_rx(struct sky_gateway_t *gw, uint32_t *buff_len);
+
+// decodes the data_len bytes of the api server response, data_len is -1 if
+// the api server was not reached or sky_gateway_upstream failed, and encodes and encrypts the response packet
+// with the key given to sky_gateway_upstream
+// returns the packet in the wire buffer and sets len, or NULL if it fails or
+// there was no device packet
+uint8_t * sky_gateway_downstream(struct sky_gateway_t *gw, int32_t data_len, int32_t *len);
+
+// decrypts and decodes the data_len bytes of a LOCATION_RQ_BATCH into up to
+// max_scans scans, with the key and the access points selected as by
+// sky_gateway_upstream; the scans point into the wire buffer
+// returns the # of scans or -1 if it fails
+int32_t sky_gateway_batch(struct sky_gateway_t *gw, uint32_t data_len, const struct sky_key_t *key,
+        struct location_rq_t *scans, uint32_t max_scans);
+
+// encodes and encrypts the responses to the count scans of the batch; the
+// address strings of the responses have to be valid until it returns
+// returns the packet in the wire buffer and sets len, or NULL if it fails
+uint8_t * sky_gateway_batch_downstream(struct sky_gateway_t *gw, struct location_rsp_t *scans,
+        uint32_t count, int32_t *len);
+
+// the decoded request and response of the transaction
+const struct location_rq_t * sky_gateway_request(const struct sky_gateway_t *gw);
+const struct location_rsp_t * sky_gateway_response(const struct sky_gateway_t *gw);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
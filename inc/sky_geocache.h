@@ -0,0 +1,70 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_GEOCACHE_H
+#define SKY_GEOCACHE_H
+
+#include "sky_protocol.h"
+
+// Reverse geocode cache of the gateway, keyed by the lat/lon grid tile.
+// It keeps the area fields of the address (city, state, state_code, metro1,
+// metro2, postal_code, county, country and country_code), which are the same
+// within a tile; street_num and address are not cached. The strings are
+// interned and reference counted, so the tiles of a city share them.
+//
+// A LOCATION_RQ_ADDR request can be sent upstream as LOCATION_RQ, and the
+// address of the result filled by sky_geocache_get; only on a miss the full
+// address is requested, and stored by sky_geocache_put.
+
+#define SKY_GEOCACHE_WAYS           8
+#define SKY_GEOCACHE_TILE_DEG       0.0025  // about 280 m of latitude
+#define SKY_GEOCACHE_MAX_BYTES      (16 * 1024 * 1024)
+
+struct sky_geocache_t;
+
+struct sky_geocache_config_t {
+    uint32_t capacity;    // max # of tiles, rounded up to a power of 2
+    uint32_t max_bytes;   // max bytes of the interned strings
+    double tile_deg;      // tile size in degrees of lat and lon
+};
+
+struct sky_geocache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;   // tiles evicted by CLOCK or the memory bound
+    uint64_t tiles;       // current # of tiles
+    uint64_t strings;     // current # of interned strings
+    uint64_t bytes;       // current bytes of the interned strings
+};
+
+// returns the cache, or NULL if it fails
+struct sky_geocache_t * sky_geocache_create(const struct sky_geocache_config_t *config);
+
+void sky_geocache_destroy(struct sky_geocache_t *cache);
+
+// on hit, sets the area fields of ext, the strings are copied into buff
+// returns 1 on hit, 0 on miss
+int32_t sky_geocache_get(struct sky_geocache_t *cache, double lat, double lon,
+        struct location_ext_t *ext, char *buff, uint32_t buff_len);
+
+// stores the area fields of ext for the tile of lat/lon
+// returns 0, or -1 if ext has no area field or it fails
+int32_t sky_geocache_put(struct sky_geocache_t *cache, double lat, double lon,
+        const struct location_ext_t *ext);
+
+void sky_geocache_get_stats(struct sky_geocache_t *cache, struct sky_geocache_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
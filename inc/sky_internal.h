@@ -0,0 +1,121 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_INTERNAL_H
+#define SKY_INTERNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "sky_protocol.h"
+
+// Helpers shared by the sources of the library, not part of the API.
+// The sharded tables (cache, session, coalesce) are an array of shards
+// aligned to the cache line; the lock is the first field of a shard and its
+// stats are uint64_t counters only, summed over the shards.
+
+static inline
+uint32_t sky_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+// seconds since epoch, for the expiry of the entries
+static inline
+uint32_t sky_now_sec() {
+    return (uint32_t)time(NULL);
+}
+
+// ms of the monotonic clock, for the timeouts
+static inline
+uint64_t sky_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline
+uint64_t sky_mix64(uint64_t h, uint64_t v) {
+    h ^= v;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+// sort access points by MAC
+static inline
+int32_t sky_cmp_ap_mac(const void * a, const void * b) {
+    return memcmp(((const struct ap_t *)a)->MAC, ((const struct ap_t *)b)->MAC, MAC_SIZE);
+}
+
+// rounds *shards and capacity up to a power of 2
+// returns the # of sets of ways slots of a shard, at least 1
+static inline
+uint32_t sky_shard_sets(uint32_t *shards, uint32_t capacity, uint32_t ways) {
+    *shards = sky_pow2(*shards > 0 ? *shards : 1);
+    uint32_t sets = sky_pow2(capacity > 0 ? capacity : 1) / *shards / ways;
+    return (sets > 0) ? sets : 1;
+}
+
+// returns count zeroed shards of size bytes with their lock initialized,
+// or NULL if it fails
+static inline
+void * sky_shards_alloc(uint32_t count, size_t size) {
+    void *shards;
+    uint32_t i;
+
+    if (posix_memalign(&shards, 64, count * size) != 0) {
+        perror("posix_memalign failed");
+        return NULL;
+    }
+    memset(shards, 0, count * size);
+    for (i = 0; i < count; i++)
+        pthread_mutex_init((pthread_mutex_t *)((uint8_t *)shards + i * size), NULL);
+    return shards;
+}
+
+static inline
+void sky_shards_free(void *shards, uint32_t count, size_t size) {
+    uint32_t i;
+
+    if (shards == NULL)
+        return;
+    for (i = 0; i < count; i++)
+        pthread_mutex_destroy((pthread_mutex_t *)((uint8_t *)shards + i * size));
+    free(shards);
+}
+
+// sums the stats at offset of each shard into stats of stats_size bytes
+static inline
+void sky_shards_stats(void *shards, uint32_t count, size_t size, size_t offset,
+        void *stats, size_t stats_size) {
+    uint64_t *sum = (uint64_t *)stats;
+    uint32_t i, j;
+
+    memset(stats, 0, stats_size);
+    for (i = 0; i < count; i++) {
+        uint8_t *shard = (uint8_t *)shards + i * size;
+        const uint64_t *counters = (const uint64_t *)(shard + offset);
+        pthread_mutex_lock((pthread_mutex_t *)shard);
+        for (j = 0; j < stats_size / sizeof(uint64_t); j++)
+            sum[j] += counters[j];
+        pthread_mutex_unlock((pthread_mutex_t *)shard);
+    }
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
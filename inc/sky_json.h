@@ -0,0 +1,63 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_JSON_H
+#define SKY_JSON_H
+
+#include "sky_protocol.h"
+
+/***********************************************
+ JSON LOCATION REQUEST FORMAT
+ ************************************************
+ {"version":"2.24","addr":"none"|"full","key":"<keyid>","user":"<device MAC>",
+  "aps":[{"mac":"AABBCCDDEEFF","rssi":-50}],
+  "bles":[{"mac":"...","major":1,"minor":2,"uuid":"<32 hex>","rssi":-50}],
+  "gsms":[{"mcc":310,"mnc":410,"lac":1,"ci":2,"rssi":-80,"age":0}],
+  "cdmas":[{"sid":1,"nid":2,"bsid":3,"lat":42.1,"lon":-71.2,"rssi":-80,"age":0}],
+  "umtss":[{"mcc":310,"mnc":410,"lac":1,"ci":2,"rssi":-80,"age":0}],
+  "ltes":[{"mcc":310,"mnc":410,"eucid":1,"rssi":-80,"age":0}],
+  "gps":[{"fix":1,"nsat":5,"hdop":1.0,"lat":42.1,"lon":-71.2,"hpe":10,
+          "alt":20.5,"speed":1.5,"age":0}]}
+ empty arrays and invalid gps attributes are omitted.
+ *************************************************/
+
+/***********************************************
+ JSON LOCATION RESPONSE FORMAT
+ ************************************************
+ {"location":{"lat":42.1,"lon":-71.2,"hpe":30,"distance":12.5,
+   "address":{"street_num":"...","address":"...","city":"...","state":"...",
+              "state_code":"...","metro1":"...","metro2":"...",
+              "postal_code":"...","county":"...","country":"...",
+              "country_code":"..."}}}
+ or
+ {"error":"Unable to determine location"}
+ *************************************************/
+
+// encodes location_rq_t into json, result is in buff
+// returns str len or -1 if it fails
+int32_t sky_encode_req_json(char *buff, int32_t buff_len, const struct location_rq_t *creq);
+
+// decodes json into location_rsp_t; the address strings point into buff
+// Return code: same as sky_decode_resp_xml
+int32_t sky_decode_resp_json(char *buff, int32_t buff_len, int32_t data_len,
+        const struct location_rq_t *creq, struct location_rsp_t *cresp);
+
+// decodes json into location_rq_t
+// the arrays are allocated, free them as after sky_decode_req_xml
+// returns 0 or the negative count of errors
+int32_t sky_decode_req_json(char *buff, int32_t buff_len, int32_t data_len,
+        struct location_rq_t *creq);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,73 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_MINHASH_H
+#define SKY_MINHASH_H
+
+#include "sky_protocol.h"
+
+// Near duplicate scan index: MinHash signatures of the AP MAC sets, with
+// locality sensitive hashing over SKY_MINHASH_BANDS bands of the signature.
+// A lookup returns the sky_cache fingerprint of a recent scan whose estimated
+// Jaccard similarity is at least the threshold, and has the same payload type
+// and partner id.
+
+#define SKY_MINHASH_K               16  // 32-bit hashes per signature
+#define SKY_MINHASH_BANDS           4   // SKY_MINHASH_K / SKY_MINHASH_BANDS rows per band
+#define SKY_MINHASH_THRESHOLD       0.75f
+#define SKY_MINHASH_MIN_APS         4
+
+struct sky_minhash_t;
+
+struct sky_minhash_config_t {
+    uint32_t capacity;    // max # of scans, rounded up to a power of 2
+    float threshold;      // min estimated Jaccard similarity, 0 - 1
+    uint8_t min_aps;      // scans with fewer access points are not indexed
+};
+
+struct sky_minhash_stats_t {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t candidates;  // scans compared by lookups
+    uint64_t inserts;
+};
+
+// returns the index, or NULL if it fails
+struct sky_minhash_t * sky_minhash_create(const struct sky_minhash_config_t *config);
+
+void sky_minhash_destroy(struct sky_minhash_t *index);
+
+// computes the signature of the AP MAC set of the request
+void sky_minhash_signature(const struct location_rq_t *creq, uint32_t *signature);
+
+// estimated Jaccard similarity of two signatures
+float sky_minhash_similarity(const uint32_t *a, const uint32_t *b);
+
+// finds the most similar scan of the request
+// returns 1 and sets fingerprint if found, 0 otherwise
+int32_t sky_minhash_lookup(struct sky_minhash_t *index, const struct location_rq_t *creq,
+        uint64_t *fingerprint);
+
+// adds the scan of the request with its sky_cache fingerprint, replacing the oldest scan
+// returns 0, or -1 if the scan has too few access points
+int32_t sky_minhash_put(struct sky_minhash_t *index, const struct location_rq_t *creq,
+        uint64_t fingerprint);
+
+void sky_minhash_set_threshold(struct sky_minhash_t *index, float threshold);
+
+void sky_minhash_get_stats(struct sky_minhash_t *index, struct sky_minhash_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,64 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_POOL_H
+#define SKY_POOL_H
+
+#include <inttypes.h>
+
+// Buffer pool of the protocol, xml and response buffers, in the size classes
+// of sky_buff_class. Each thread has free lists of its own; a buffer freed by
+// another thread is pushed to the lock free remote queue of the thread that
+// allocated it, which takes it back when its free list is empty. Free lists
+// over cache_max buffers are moved to a shared depot.
+// Buffers are carved from slabs mapped and faulted in by the allocating
+// thread, so their pages are local to its NUMA node by the first touch
+// policy, optionally backed by huge pages. The slabs are not unmapped.
+// Buffers are 64 byte aligned.
+
+#define SKY_POOL_CLASSES            9       // 256 bytes to 64 KB
+#define SKY_POOL_SLAB_SIZE          (2 * 1024 * 1024)
+#define SKY_POOL_CACHE_MAX          64      // buffers per class of a thread
+
+struct sky_pool_config_t {
+    uint32_t slab_size;   // bytes, rounded up to 2 MB if huge_pages
+    uint32_t cache_max;   // buffers per class of a thread
+    uint8_t huge_pages;   // 1 to map the slabs with MAP_HUGETLB, else transparent huge pages
+};
+
+struct sky_pool_stats_t {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t remote_frees; // freed by another thread
+    uint64_t oversize;    // larger than the largest class, allocated by malloc
+    uint64_t slabs;
+    uint64_t slab_bytes;
+};
+
+// sets the config, call it before the first sky_pool_alloc, the defaults are used otherwise
+void sky_pool_configure(const struct sky_pool_config_t *config);
+
+// returns a 64 byte aligned buffer of at least len bytes, or NULL if it fails
+void * sky_pool_alloc(uint32_t len);
+
+// returns the buffer to the pool, from any thread
+void sky_pool_free(void *buff);
+
+// usable bytes of the buffer
+uint32_t sky_pool_size(const void *buff);
+
+void sky_pool_get_stats(struct sky_pool_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,11 @@ extern "C" {
 #include <byteswap.h>     // remove if not existing
 
 #define SKY_PROTOCOL_VERSION    1
+#define SKY_PROTOCOL_VERSION_COMPACT 2 // compact request data entries
+#define SKY_PROTOCOL_VERSION_AEAD    3 // compact request data entries, AES-128-GCM
+
+#define SKY_AEAD_NONCE_SIZE     12
+#define SKY_AEAD_TAG_SIZE       16
 
 #define URL_SIZE                512
 #define AUTH_SIZE               512
@@ -30,24 +35,45 @@ extern "C" {
 #define MAX_MACS                2   // max # of mac addresses
 #define MAX_IPS                 2   // max # of ip addresses
 
-#define MAX_APS                 100 // max # of access points
+#ifndef MAX_APS
+#define MAX_APS                 100 // max # of access points, up to SKY_ENTRY_COUNT_MAX
+#endif
 #define MAX_GPSS                2   // max # of gps
 #define MAX_CELLS               7   // max # of cells
 #define MAX_BLES                5   // max # of blue tooth
 
+// The MAX_ counts are the compile time maximums, which size the fixed arrays;
+// the limits of a gateway are set at startup by sky_set_limits, up to them.
+// Buffers can be sized for the request by sky_rq_bin_len and sky_resp_bin_len,
+// rounded up to a size class by sky_buff_class, instead of SKY_PROT_BUFF_LEN.
+struct sky_limits_t {
+    uint8_t max_macs;
+    uint8_t max_ips;
+    uint16_t max_aps;
+    uint8_t max_gpss;
+    uint8_t max_cells;
+    uint8_t max_bles;
+};
+
+#define SKY_BUFF_CLASS_MIN      256 // bytes of the smallest buffer size class
+
 // max # of bytes for request buffer
 #define SKY_PROT_RQ_BUFF_LEN                                                 \
-    sizeof(sky_rq_header_t) + sizeof(sky_payload_t) + sizeof(sky_checksum_t) \
+    sizeof(sky_rq_header_t) + sizeof(sky_payload_t) + SKY_AEAD_TAG_SIZE      \
+    + (sizeof(sky_entry_t) + SKY_RQ_ID_SIZE)                                 \
+    + (sizeof(sky_entry_t) + SKY_RQ_ID_SIZE) /* base request id */           \
+    + SKY_ENTRY_LEN(MAX_APS) /* removed access points, in place of APs */    \
     + (sizeof(sky_entry_t) + MAX_MACS * MAC_SIZE)                            \
     + (sizeof(sky_entry_t) + MAX_IPS * IPV6_SIZE)                            \
-    + (sizeof(sky_entry_t) + MAX_APS * sizeof(struct ap_t))                  \
+    + (SKY_ENTRY_LEN(MAX_APS) + MAX_APS * sizeof(struct ap_t))               \
     + (sizeof(sky_entry_t) + MAX_GPSS * sizeof(struct gps_t))                \
     + (sizeof(sky_entry_t) + MAX_CELLS * sizeof(union cell_t))               \
     + (sizeof(sky_entry_t) + MAX_BLES * sizeof(struct ble_t))
 
 // max # of bytes for response buffer
 #define SKY_PROT_RSP_BUFF_LEN                                                 \
-    sizeof(sky_rsp_header_t) + sizeof(sky_payload_t) + sizeof(sky_checksum_t) \
+    sizeof(sky_rsp_header_t) + sizeof(sky_payload_t) + SKY_AEAD_TAG_SIZE       \
+    + (sizeof(sky_entry_t) + SKY_RQ_ID_SIZE)                                  \
     + sizeof(struct location_t) + sizeof(struct location_ext_t)               \
     + 1024 // the char array of full address
 
@@ -56,6 +82,10 @@ extern "C" {
                             ((SKY_PROT_RQ_BUFF_LEN > SKY_PROT_RSP_BUFF_LEN) ? \
                             SKY_PROT_RQ_BUFF_LEN : SKY_PROT_RSP_BUFF_LEN)
 
+// max # of bytes for a buffer to decode a compact request in place
+// Note: the decoded data entries are expanded into the buffer after the packet.
+#define SKY_PROT_COMPACT_BUFF_LEN   (3 * (SKY_PROT_BUFF_LEN))
+
 #ifndef ENOBUFS
     #define ENOBUFS (ENOMEM)
 #endif
@@ -139,6 +169,10 @@ enum SKY_DATA_TYPE {
     DATA_TYPE_IPV4,         // ipv4 address
     DATA_TYPE_IPV6,         // ipv6 address
     DATA_TYPE_MAC,          // device MAC address
+    DATA_TYPE_RQ_ID,        // request id, echoed in the response
+    DATA_TYPE_SCAN,         // payload of a scan of a batch, its data entries follow
+    DATA_TYPE_DELTA,        // request id of the base scan of a delta scan
+    DATA_TYPE_AP_REMOVED,   // MACs of the access points removed from the base scan
 };
 
 // request payload types
@@ -148,6 +182,7 @@ enum SKY_RQ_PAYLOAD_TYPE {
     LOCATION_RQ,                // location request
     LOCATION_RQ_ADDR,           // location request full
     PROBE_REQUEST,              // probe test
+    LOCATION_RQ_BATCH,          // location requests of buffered scans
 };
 
 // response payload types
@@ -158,6 +193,7 @@ enum SKY_RSP_PAYLOAD_TYPE {
     LOCATION_RQ_SUCCESS,        // lat+lon success
     LOCATION_RQ_ADDR_SUCCESS,   // full address success
     PROBE_REQUEST_SUCCESS,      // probe success
+    LOCATION_RQ_BATCH_SUCCESS,  // responses to the scans of a batch
 
     // error codes
     LOCATION_RQ_ERROR = 10,      // client domain errors
@@ -168,6 +204,8 @@ enum SKY_RSP_PAYLOAD_TYPE {
     // detailed client domain error codes
     LOCATION_UNABLE_TO_DETERMINE = 20,// api-server is unable to determine the client
                                       // location by the given client data.
+    LOCATION_RQ_BASE_UNKNOWN,         // the gateway has no base scan of the delta scan,
+                                      // the client resends the full scan.
 };
 
 // internal error codes
@@ -235,6 +273,33 @@ typedef struct {
     uint8_t data_type_count;   // data type count
 } sky_entry_t;
 
+// An entry of more than 255 items has SKY_ENTRY_EXT set in data_type, and the
+// high byte of the count after data_type_count, the low byte.
+#define SKY_ENTRY_EXT           0x80
+#define SKY_ENTRY_COUNT_MAX     UINT16_MAX
+#define SKY_ENTRY_LEN(count)    (sizeof(sky_entry_t) + ((count) > UINT8_MAX))
+
+// A request with a nonzero rq_id has a DATA_TYPE_RQ_ID entry of SKY_RQ_ID_SIZE
+// bytes, the first after the payload, and its response has the same entry, so
+// the responses to the requests in flight on a socket can be matched in any order.
+#define SKY_RQ_ID_SIZE          sizeof(uint32_t)
+
+// A LOCATION_RQ_BATCH carries the scans buffered by a device in one packet:
+// the data entries of the device (request id, MAC and IP), then for each scan
+// a DATA_TYPE_SCAN entry of its sky_payload_t (timestamp and LOCATION_RQ or
+// LOCATION_RQ_ADDR) followed by its data entries. The scans without a MAC or
+// IP have the ones of the device. The LOCATION_RQ_BATCH_SUCCESS response has
+// the same layout, a DATA_TYPE_SCAN entry of the response to each scan in order.
+
+// A delta scan has a DATA_TYPE_DELTA entry of the request id of its base scan,
+// a previous request of the device (the first DATA_TYPE_MAC), and of the base
+// access points only the added and changed ones in the DATA_TYPE_AP entry and
+// the removed MACs in the DATA_TYPE_AP_REMOVED entry; the other data entries
+// are complete. The gateway keeps the access points of the last request of
+// each device in a session table (sky_session.h) to reconstruct the scan, and
+// answers LOCATION_RQ_BASE_UNKNOWN if the base is not the last request or has
+// expired. Delta scans are not allowed in a batch.
+
 // read and write in place in buffer
 typedef struct {
     sky_entry_t * entry;       // entry without data
@@ -392,37 +457,37 @@ struct location_ext_t {
     uint8_t ip_type;  // DATA_TYPE_IPV4 or DATA_TYPE_IPV6
     uint8_t *ip_addr; // ipv4 (4 bytes) or ipv6 (16 bytes)
 
-    uint8_t street_num_len;
+    uint16_t street_num_len;
     char *street_num;
 
-    uint8_t address_len;
+    uint16_t address_len;
     char *address;
 
-    uint8_t city_len;
+    uint16_t city_len;
     char *city;
 
-    uint8_t state_len;
+    uint16_t state_len;
     char *state;
 
-    uint8_t state_code_len;
+    uint16_t state_code_len;
     char *state_code;
 
-    uint8_t metro1_len;
+    uint16_t metro1_len;
     char *metro1;
 
-    uint8_t metro2_len;
+    uint16_t metro2_len;
     char *metro2;
 
-    uint8_t postal_code_len;
+    uint16_t postal_code_len;
     char *postal_code;
 
-    uint8_t county_len;
+    uint16_t county_len;
     char *county;
 
-    uint8_t country_len;
+    uint16_t country_len;
     char *country;
 
-    uint8_t country_code_len;
+    uint16_t country_code_len;
     char *country_code;
 };
 
@@ -441,14 +506,36 @@ struct sky_relay_t {
     uint8_t valid;
 };
 
+// api server request and response formats
+enum SKY_API_FORMAT {
+    API_FORMAT_XML = 0,        // default
+    API_FORMAT_JSON,
+};
+
+struct sky_rq_prefix_t; // defined in sky_xml.h
+
 // stores keys in a binary tree
 struct sky_key_t {
     uint32_t partner_id;
     uint8_t aes_key[16];  // 128 bit aes key
     char keyid[128];      // api key
     struct sky_relay_t relay; // relay responses
+    struct sky_rq_prefix_t *rq_prefix; // pre-rendered xml request prefix, NULL if none
+    uint8_t api_format;   // api server format, enum SKY_API_FORMAT
+    uint16_t max_aps;     // strongest access points sent upstream, 0 if all
 };
 
+// Built with SKY_KEY_BY_REF, the requests and responses hold a pointer to the
+// immutable key store entry instead of a copy of the key; the caller sets it
+// before encoding or after decoding the header, sky_decode_req_bin only sets
+// header.user_id. Use SKY_KEY to access the key in both builds.
+#ifdef SKY_KEY_BY_REF
+#define SKY_KEY(r)  (*(r)->key)
+#else
+#define SKY_KEY(r)  ((r)->key)
+#endif
+
+// the header, payload and counts are in the first cache line
 struct location_rq_t {
 
     //
@@ -458,57 +545,55 @@ struct location_rq_t {
     sky_rq_header_t header;
     sky_payload_ext_t payload_ext;
 
-    uint8_t mac_count; // count of MAC address
-    uint8_t *mac;      // client device MAC identifier
-
-    uint8_t ip_count; // count of IP address
+    uint16_t ap_count;  // wifi access points
+    uint8_t mac_count;  // count of MAC address
+    uint8_t ip_count;   // count of IP address
     uint8_t ip_type;
-    uint8_t *ip_addr; // ipv4 or ipv6
+    uint8_t ble_count;  // blue tooth
+    uint8_t cell_count; // deprecated, use gsm, cdma, lte and umts instead
+    uint8_t cell_type;  // deprecated, use gsm, cdma, lte and umts instead
+    uint8_t gsm_count;
+    uint8_t cdma_count;
+    uint8_t lte_count;
+    uint8_t umts_count;
+    uint8_t gps_count;
+    uint16_t removed_count; // access points removed from the base scan
+    uint32_t rq_id;     // request id, 0 if none
+    uint32_t base_id;   // request id of the base scan of a delta scan, 0 if none
 
-    // wifi access points
-    uint8_t ap_count;
-    struct ap_t *aps;
+#ifdef SKY_KEY_BY_REF
+    const struct sky_key_t *key; // user key, in the key store
+#endif
 
-    // blue tooth
-    uint8_t ble_count;
+    uint8_t *mac;      // client device MAC identifier
+    uint8_t *ip_addr;  // ipv4 or ipv6
+    struct ap_t *aps;
+    uint8_t *removed;  // MACs of the access points removed from the base scan
     struct ble_t *bles;
 
     // cell
     // note: *DEPRECATED*, please use gsm, cdma, lte, and umts which are defined below.
-    uint8_t cell_count; // deprecated, use gsm, cdma, lte and umts instead
-    uint8_t cell_type;  // deprecated, use gsm, cdma, lte and umts instead
     union cell_t *cell; // deprecated, use gsm, cdma, lte and umts instead
 
-    // gsm
-    uint8_t gsm_count;
     struct gsm_t *gsms;
-
-    // cdma
-    uint8_t cdma_count;
     struct cdma_t *cdmas;
-
-    // lte
-    uint8_t lte_count;
     struct lte_t *ltes;
-
-    // umts
-    uint8_t umts_count;
     struct umts_t *umtss;
-
-    // gps
-    uint8_t gps_count;
     struct gps_t *gps;
 
     //
     // additional attributes
     //
 
-    struct sky_key_t key; // user key
     char *api_version; // api server version number (string 2.34)
 
     // http server settings
     char *http_url;
     char *http_uri;
+
+#ifndef SKY_KEY_BY_REF
+    struct sky_key_t key; // user key
+#endif
 };
 
 struct location_rsp_t {
@@ -519,16 +604,23 @@ struct location_rsp_t {
 
     sky_rsp_header_t header;
     sky_payload_ext_t payload_ext;
+    uint32_t rq_id; // request id of the request, 0 if none
 
     //
     // additional attributes
     //
 
-    struct sky_key_t key; // user key
+#ifdef SKY_KEY_BY_REF
+    const struct sky_key_t *key; // user key, in the key store
+#endif
 
     struct location_t location; // location result: lat and lon
 
     struct location_ext_t location_ext; // ext location result: full address, etc.
+
+#ifndef SKY_KEY_BY_REF
+    struct sky_key_t key; // user key
+#endif
 };
 
 /***********************************************
@@ -576,6 +668,45 @@ struct location_rsp_t {
  n - 1 verify 1 fletcher 16
  *************************************************/
 
+/***********************************************
+ COMPACT BINARY REQUEST PROTOCOL FORMAT
+ ************************************************
+ header version is SKY_PROTOCOL_VERSION_COMPACT; header, payload, padding and
+ checksum are the same as above, but the data of the entries is packed:
+ varint  - unsigned LEB128, 1 - 5 bytes
+ svarint - zigzag encoded signed varint
+ deg     - svarint of degrees * 10^7
+
+ MAC, IPV4, IPV6 - unchanged
+ AP   - per access point, sorted by MAC:
+        1 byte: bits 0-3 flag, bits 4-7 # of leading MAC bytes shared with
+                the previous access point (0 - 6)
+        (6 - shared) bytes: rest of MAC
+        1 byte: rssi
+ GSM, UMTS - varint ci, varint age, varint mcc, varint mnc, varint lac, 1 byte rssi
+ CDMA - deg lat, deg lon, varint age, varint sid, varint nid, varint bsid, 1 byte rssi
+ LTE  - varint age, varint eucid, varint mcc, varint mnc, 1 byte rssi
+ GPS  - 1 byte: bit 0 lat and lon, bit 1 hdop, bit 2 hpe, bit 3 alt,
+                bit 4 speed, bit 5 age; only valid attributes are present
+        1 byte nsat, 1 byte fix, [deg lat, deg lon], [varint hdop * 10],
+        [varint hpe], [svarint alt * 10], [varint speed * 10], [varint age]
+ BLE  - 2 bytes major, 2 bytes minor, 6 bytes MAC, 16 bytes uuid, 1 byte rssi
+ *************************************************/
+
+/***********************************************
+ AEAD PROTOCOL FORMAT
+ ************************************************
+ header version is SKY_PROTOCOL_VERSION_AEAD, for requests and responses;
+ requests have compact data entries, responses have the data entries above.
+ There are no padding bytes, and the checksum is replaced by the tag:
+ header (iv: 12 byte nonce, 4 zero bytes) - authenticated, not encrypted
+ payload                                  - AES-128-GCM encrypted
+ 16 byte authentication tag
+ sky_encode_*_bin leave the tag empty, sky_seal_packet sets the nonce,
+ encrypts the payload and sets the tag; sky_open_packet verifies and
+ decrypts it before sky_decode_*_bin.
+ *************************************************/
+
 /***********************************************
  BINARY RESPONSE PROTOCOL FORMAT
  ************************************************
@@ -634,8 +765,36 @@ void sky_init_gps_attrib(struct gps_t * gps);
 //int sky_set_key(void *key_root, struct location_head_t *head);
 uint32_t sky_get_partner_id_from_rq_header(uint8_t *buff, uint32_t buff_len);
 
+// sets the scan limits, each clamped to its MAX_ count
+// Note: not thread safe, call it before the requests are processed
+void sky_set_limits(const struct sky_limits_t * limits);
+
+void sky_get_limits(struct sky_limits_t * limits);
+
+// max # of bytes of a request buffer for the limits, sky_rq_buff_len of the
+// MAX_ counts is SKY_PROT_RQ_BUFF_LEN plus the padding
+uint32_t sky_rq_buff_len(const struct sky_limits_t * limits);
+
+// exact # of bytes sky_encode_req_bin writes for the request version
+// returns -1 if the request can not be encoded
+int32_t sky_rq_bin_len(const struct location_rq_t *creq);
+
+// exact # of bytes sky_encode_resp_bin writes for the response version
+uint32_t sky_resp_bin_len(const struct location_rsp_t *cresp);
+
+// size class of a buffer of len bytes: the power of 2 at least len and SKY_BUFF_CLASS_MIN
+uint32_t sky_buff_class(uint32_t len);
+
+// received by the server from the client
+// returns true if the packet is an authentic PROBE_REQUEST, the packet is not
+// decrypted in place; key is the aes key of the partner
+bool sky_is_probe_rq(const uint8_t *buff, uint32_t data_len, const uint8_t *key);
+
 // received by the server from the client
 // decode binary data from client, result is in the location_req_t struct
+// the packet is read from the data_len bytes received only
+// Note: compact requests are expanded into buff after data_len, so buff_len needs
+//       to be SKY_PROT_COMPACT_BUFF_LEN to decode them.
 int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
         struct location_rq_t *creq);
 
@@ -645,8 +804,33 @@ int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
 int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rsp_t *cresp);
 
+// sent by the server to the client
+// encodes a response without data entries, an error or PROBE_REQUEST_SUCCESS,
+// from a pre-encoded template; only the iv, timestamp, request id and checksum are set
+// rq_id is the request id of the request, 0 if none
+// returns the packet len or -1 when fails
+int32_t sky_encode_resp_status(uint8_t *buff, uint32_t buff_len, uint8_t version, uint8_t type,
+        uint32_t rq_id);
+
+// received by the server from the client
+// decodes a LOCATION_RQ_BATCH into batch, the device data entries, and up to
+// max_scans scans, each with the header of the batch; compact batches are
+// expanded into buff after data_len as by sky_decode_req_bin
+// returns the # of scans or -1 when fails
+int32_t sky_decode_req_batch(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rq_t *batch, struct location_rq_t *scans, uint32_t max_scans);
+
+// sent by the server to the client
+// encodes the responses to the count scans of a batch as a LOCATION_RQ_BATCH_SUCCESS,
+// with the header, sw version, timestamp and request id of batch
+// returns the packet len or -1 when fails
+int32_t sky_encode_resp_batch(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *batch,
+        struct location_rsp_t *scans, uint32_t count);
+
 // sent by the client to the server
 /* encodes the request struct into binary formatted packet */
+// the data entries are packed if creq->header.version is SKY_PROTOCOL_VERSION_COMPACT
+// or SKY_PROTOCOL_VERSION_AEAD
 // returns the packet len or -1 when fails
 int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rq_t *creq);
@@ -656,6 +840,49 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len,
 int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
         struct location_rsp_t *cresp);
 
+// access points of the last scan of a device known to the gateway, sorted by MAC
+struct sky_delta_t {
+    uint32_t base_id;  // request id of the scan, 0 if none
+    uint16_t ap_count;
+    struct ap_t aps[MAX_APS];
+};
+
+// sent by the client to the server
+// encodes the request as a delta scan of base if it is shorter, or as the full
+// scan if base is NULL or empty, or the request has no request id or device MAC
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_delta(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        const struct sky_delta_t *base);
+
+// received by the client from the server
+// the request of the response of type rsp_type is the base of the next delta
+// scan, or base is cleared if the gateway may not have it
+void sky_delta_update(struct sky_delta_t *base, const struct location_rq_t *creq, uint8_t rsp_type);
+
+// sent by the client to the server
+// encodes the count scans as a LOCATION_RQ_BATCH, with the header, sw version,
+// timestamp, key and device data entries of batch
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_batch(uint8_t *buff, uint32_t buff_len, struct location_rq_t *batch,
+        struct location_rq_t *scans, uint32_t count);
+
+// received by the client from the server
+// decodes a LOCATION_RQ_BATCH_SUCCESS into batch and the responses to up to max_scans scans
+// returns the # of scans or -1 when fails
+int32_t sky_decode_resp_batch(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rsp_t *batch, struct location_rsp_t *scans, uint32_t max_scans);
+
+// encrypts and authenticates a SKY_PROTOCOL_VERSION_AEAD packet in place
+// header_len is sizeof(sky_rq_header_t) or sizeof(sky_rsp_header_t)
+// returns the packet len or -1 when fails
+int32_t sky_seal_packet(uint8_t *buff, uint32_t buff_len, uint32_t header_len,
+        const uint8_t *key);
+
+// verifies and decrypts a SKY_PROTOCOL_VERSION_AEAD packet in place
+// returns the packet len or -1 if it is not authentic
+int32_t sky_open_packet(uint8_t *buff, uint32_t data_len, uint32_t header_len,
+        const uint8_t *key);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,68 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_SESSION_H
+#define SKY_SESSION_H
+
+#include "sky_protocol.h"
+
+// Session table of the gateway for the delta scans, keyed by the partner id
+// and the device MAC. An entry holds the request id and the access points of
+// the last request of the device, sorted by MAC, and expires ttl seconds after
+// it. The table is split into shards with a lock each; a shard is an array of
+// SKY_SESSION_WAYS way set associative sets, the entry expiring first in the
+// set is evicted. The size of the table is fixed at creation, about
+// capacity * MAX_APS * sizeof(struct ap_t) bytes.
+
+#define SKY_SESSION_WAYS            4
+#define SKY_SESSION_TTL_DEFAULT     600 // seconds
+
+struct sky_session_t;
+
+struct sky_session_config_t {
+    uint32_t capacity;    // max # of devices, rounded up to a power of 2
+    uint32_t shards;      // # of locks, rounded up to a power of 2
+    uint32_t ttl;         // seconds an entry is valid
+};
+
+struct sky_session_stats_t {
+    uint64_t hits;        // delta scans reconstructed
+    uint64_t misses;      // delta scans of an unknown or expired base
+    uint64_t inserts;
+    uint64_t evictions;   // valid entries of an other device replaced
+    uint64_t entries;     // current # of entries
+};
+
+// returns the table, or NULL if it fails
+struct sky_session_t * sky_session_create(const struct sky_session_config_t *config);
+
+void sky_session_destroy(struct sky_session_t *session);
+
+// reconstructs the access points of the delta scan creq into aps, up to max_aps:
+// the base access points without the removed ones, with the ones of creq added
+// or replacing the ones of the same MAC; creq->aps is set to aps, the access
+// points of creq are sorted and its base_id and removed_count are cleared
+// returns 0, 1 if creq is not a delta scan, or -1 if the base is unknown
+int32_t sky_session_apply(struct sky_session_t *session, struct location_rq_t *creq,
+        struct ap_t *aps, uint32_t max_aps);
+
+// stores the access points of the full or reconstructed scan creq as the
+// base of the next delta scan of the device
+// returns 0 or -1 if creq has no request id or device MAC
+int32_t sky_session_put(struct sky_session_t *session, const struct location_rq_t *creq);
+
+void sky_session_get_stats(struct sky_session_t *session, struct sky_session_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
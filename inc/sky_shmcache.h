@@ -0,0 +1,80 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_SHMCACHE_H
+#define SKY_SHMCACHE_H
+
+#include "sky_protocol.h"
+
+// Location result cache shared by the gateway processes of a host, in a POSIX
+// shared memory segment. The segment is an array of SKY_SHMCACHE_WAYS way
+// set associative sets of fixed size slots, keyed by the sky_cache fingerprint.
+// Readers are lock free, a slot is read under its sequence number and read
+// again if a writer changed it; a writer claims a slot by compare and swap
+// of the sequence number, and skips the insert if another writer has it.
+// The pid of the writer is kept with the sequence number, a slot left odd by
+// a writer that died is reclaimed by the next writer or emptied by a reader.
+// The slot of the same fingerprint, an empty or expired slot, or else the
+// slot expiring first is replaced.
+
+#define SKY_SHMCACHE_WAYS           4
+#define SKY_SHMCACHE_SLOT_SIZE      256
+#define SKY_SHMCACHE_ADDR_MAX       208 // bytes of the packed address fields of a slot
+#define SKY_SHMCACHE_TTL_DEFAULT    300 // seconds
+
+struct sky_shmcache_t;
+
+struct sky_shmcache_config_t {
+    uint32_t capacity;    // # of slots, rounded up to a power of 2
+    uint32_t ttl;         // seconds an entry is valid
+};
+
+// stats of the process
+struct sky_shmcache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;   // valid entries replaced
+    uint64_t contended;   // inserts skipped, the slot was being written
+    uint64_t retries;     // reads repeated, the slot was being written
+    uint64_t reclaimed;   // slots left being written by a writer that died
+};
+
+// opens the segment of name, e.g. "/sky_cache", and creates it with config if missing;
+// the capacity and ttl of an existing segment are kept
+// returns the cache, or NULL if it fails
+struct sky_shmcache_t * sky_shmcache_open(const char *name, const struct sky_shmcache_config_t *config);
+
+// unmaps the segment, it stays for the other processes
+void sky_shmcache_close(struct sky_shmcache_t *cache);
+
+// removes the segment of name
+// returns 0 or -1 when fails
+int32_t sky_shmcache_unlink(const char *name);
+
+// on hit, sets the payload type, location and the address fields of cresp;
+// the address strings are copied into buff
+// returns 1 on hit, 0 on miss
+int32_t sky_shmcache_get(struct sky_shmcache_t *cache, uint64_t fingerprint,
+        struct location_rsp_t *cresp, char *buff, uint32_t buff_len);
+
+// stores the result of a LOCATION_RQ_SUCCESS or LOCATION_RQ_ADDR_SUCCESS response
+// returns 0, or -1 if it is not stored
+int32_t sky_shmcache_put(struct sky_shmcache_t *cache, uint64_t fingerprint,
+        const struct location_rsp_t *cresp);
+
+void sky_shmcache_get_stats(struct sky_shmcache_t *cache, struct sky_shmcache_stats_t *stats);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
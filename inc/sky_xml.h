@@ -10,7 +10,7 @@ extern "C" {
 #endif
 
 #ifndef SKY_XML_H
-#define SKY__XML_H
+#define SKY_XML_H
 
 #include "sky_protocol.h"
 
@@ -85,13 +85,54 @@ extern "C" {
 #define XML_TAG_MINOR "<minor>"
 #define XML_TAG_MINORS "<minor>%d</minor>"
 
+// bit mask of the location_ext_t address fields to be decoded from xml
+enum SKY_ADDR_FIELD {
+    ADDR_FIELD_NONE = 0,
+    ADDR_FIELD_STREET_NUM = 1 << 0,
+    ADDR_FIELD_ADDRESS = 1 << 1,
+    ADDR_FIELD_CITY = 1 << 2,
+    ADDR_FIELD_STATE = 1 << 3,
+    ADDR_FIELD_STATE_CODE = 1 << 4,
+    ADDR_FIELD_METRO1 = 1 << 5,
+    ADDR_FIELD_METRO2 = 1 << 6,
+    ADDR_FIELD_POSTAL_CODE = 1 << 7,
+    ADDR_FIELD_COUNTY = 1 << 8,
+    ADDR_FIELD_COUNTRY = 1 << 9,
+    ADDR_FIELD_COUNTRY_CODE = 1 << 10,
+
+    ADDR_FIELD_ALL = (1 << 11) - 1,
+};
+
+#define SKY_RQ_PREFIX_SIZE 1024
+
+// Pre-rendered leading bytes of the xml location request of a key, i.e. the xml
+// declaration, the LocationRQ element and the authentication element up to the
+// username. It is immutable once initialized, so it can be shared by all the
+// copies of the key and by all threads.
+struct sky_rq_prefix_t {
+    char api_version[16];              // api version the prefix is rendered for
+    uint16_t len[2];                   // [0]: lat and lon, [1]: full address
+    char data[2][SKY_RQ_PREFIX_SIZE];  // not \0 terminated
+};
+
+// pre-render the request prefixes of a key for the api version
+// returns 0 or -1 if it fails
+int32_t sky_init_rq_prefix(struct sky_rq_prefix_t *prefix, const struct sky_key_t *key,
+        const char *api_version);
+
 // encodes location_req_t into xml result is in buff
+// Note: the prefix in creq->key.rq_prefix is copied if it matches creq->api_version.
 int32_t sky_encode_req_xml(char *buff, int32_t bufflen, const struct location_rq_t *creq);
 
 // decodes xml into location_resp_t
 int32_t sky_decode_resp_xml(char *buff, int32_t buff_len, int32_t data_len,
         const struct location_rq_t * creq, struct location_rsp_t *cresp);
 
+// decodes xml into location_resp_t, but only the address fields in the
+// bit mask "fields" (see enum SKY_ADDR_FIELD); the others are left empty.
+int32_t sky_decode_resp_xml_fields(char *buff, int32_t buff_len, int32_t data_len,
+        const struct location_rq_t * creq, struct location_rsp_t *cresp, uint32_t fields);
+
 int32_t sky_decode_req_xml(char *buff, int32_t buff_len, int32_t data_len,
         struct location_rq_t *req);
 
@@ -0,0 +1,768 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sky_internal.h"
+#include "sky_cache.h"
+
+#define SKY_SNAPSHOT_MAGIC          0x43594B53 // "SKYC"
+#define SKY_SNAPSHOT_VERSION        2
+
+struct sky_cache_entry_t {
+    uint64_t fingerprint;      // 0 if empty
+    struct location_t location;
+    uint32_t expires;          // seconds since epoch
+    uint16_t addr_len;         // bytes of addr
+    uint8_t type;              // response payload type
+    uint8_t ref;               // CLOCK reference bit
+    uint8_t *addr;             // packed address fields, NULL if none
+};
+
+struct sky_cache_shard_t {
+    pthread_mutex_t lock;
+    struct sky_cache_entry_t *entries; // sets * SKY_CACHE_WAYS
+    uint8_t *hands;            // CLOCK hand of each set
+    struct sky_cache_stats_t stats;
+} __attribute__((aligned(64)));
+
+// snapshot file: the header, the records sorted by fingerprint, and the
+// packed address fields, each stored once and shared by the records
+struct sky_snapshot_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;            // # of records
+    uint32_t addr_bytes;       // bytes of the packed address fields
+    uint32_t created;          // seconds since epoch
+    uint32_t check;            // of the header fields above
+};
+
+struct sky_snapshot_record_t {
+    uint64_t fingerprint;
+    struct location_t location;
+    uint32_t expires;          // seconds since epoch
+    uint32_t addr_off;         // offset of the packed address fields
+    uint16_t addr_len;         // 0 if none
+    uint8_t type;
+    uint8_t unused;
+    uint32_t check;            // of the record and its address fields
+};
+
+// packed address fields of a snapshot being written
+struct sky_snapshot_addr_t {
+    uint8_t *buff;
+    uint32_t len;
+    uint32_t size;
+    struct {
+        uint32_t off;          // offset + 1, 0 if empty
+        uint32_t len;
+    } *table;                  // open addressing by the hash of the fields
+    uint32_t mask;
+};
+
+struct sky_cache_t {
+    struct sky_cache_config_t config;
+    uint32_t shard_mask;
+    uint32_t set_mask;
+    struct sky_cache_shard_t *shards;
+
+    // snapshot mapped by sky_cache_load, read only
+    void *snapshot;            // NULL if none
+    size_t snapshot_len;
+    const struct sky_snapshot_record_t *records;
+    uint32_t record_count;
+    const uint8_t *record_addr;
+    uint32_t record_addr_bytes;
+
+    // background snapshot writer
+    pthread_t writer;
+    pthread_mutex_t writer_lock;
+    pthread_cond_t writer_cond;
+    uint8_t writer_running;
+    uint8_t writer_stop;       // guarded by writer_lock
+    uint32_t interval;         // seconds between snapshots
+    char *path;
+};
+
+// mix the ids of a cell, but not its rssi and age
+static uint64_t sky_hash_cell(uint64_t h, uint8_t type, const void *cell) {
+    h = sky_mix64(h, type);
+    switch (type) {
+    case DATA_TYPE_GSM: {
+        const struct gsm_t *c = (const struct gsm_t *)cell;
+        h = sky_mix64(h, (uint64_t)c->mcc << 48 | (uint64_t)c->mnc << 32 | c->lac);
+        return sky_mix64(h, c->ci);
+    }
+    case DATA_TYPE_UMTS: {
+        const struct umts_t *c = (const struct umts_t *)cell;
+        h = sky_mix64(h, (uint64_t)c->mcc << 48 | (uint64_t)c->mnc << 32 | c->lac);
+        return sky_mix64(h, c->ci);
+    }
+    case DATA_TYPE_LTE: {
+        const struct lte_t *c = (const struct lte_t *)cell;
+        h = sky_mix64(h, (uint64_t)c->mcc << 48 | (uint64_t)c->mnc << 32);
+        return sky_mix64(h, c->eucid);
+    }
+    case DATA_TYPE_CDMA: {
+        const struct cdma_t *c = (const struct cdma_t *)cell;
+        return sky_mix64(h, (uint64_t)c->sid << 32 | (uint64_t)c->nid << 16 | c->bsid);
+    }
+    default:
+        return h;
+    }
+}
+
+static int32_t sky_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void sky_addr_refs(struct location_ext_t *ext, struct sky_addr_ref_t *refs) {
+    refs[0].len = &ext->street_num_len;     refs[0].str = &ext->street_num;
+    refs[1].len = &ext->address_len;        refs[1].str = &ext->address;
+    refs[2].len = &ext->city_len;           refs[2].str = &ext->city;
+    refs[3].len = &ext->state_len;          refs[3].str = &ext->state;
+    refs[4].len = &ext->state_code_len;     refs[4].str = &ext->state_code;
+    refs[5].len = &ext->metro1_len;         refs[5].str = &ext->metro1;
+    refs[6].len = &ext->metro2_len;         refs[6].str = &ext->metro2;
+    refs[7].len = &ext->postal_code_len;    refs[7].str = &ext->postal_code;
+    refs[8].len = &ext->county_len;         refs[8].str = &ext->county;
+    refs[9].len = &ext->country_len;        refs[9].str = &ext->country;
+    refs[10].len = &ext->country_code_len;  refs[10].str = &ext->country_code;
+}
+
+uint32_t sky_addr_packed_len(const struct location_ext_t *ext) {
+    struct sky_addr_ref_t refs[SKY_ADDR_FIELDS];
+    uint32_t i, len = 0;
+
+    sky_addr_refs((struct location_ext_t *)ext, refs);
+    for (i = 0; i < SKY_ADDR_FIELDS; i++)
+        len += 2 + *refs[i].len;
+    return len;
+}
+
+// length, 2 bytes little endian, and string of each field
+void sky_addr_pack(const struct location_ext_t *ext, uint8_t *addr) {
+    struct sky_addr_ref_t refs[SKY_ADDR_FIELDS];
+    uint32_t i;
+
+    sky_addr_refs((struct location_ext_t *)ext, refs);
+    for (i = 0; i < SKY_ADDR_FIELDS; i++) {
+        *addr++ = (uint8_t)*refs[i].len;
+        *addr++ = (uint8_t)(*refs[i].len >> 8);
+        if (*refs[i].len > 0)
+            memcpy(addr, *refs[i].str, *refs[i].len);
+        addr += *refs[i].len;
+    }
+}
+
+void sky_addr_unpack(struct location_ext_t *ext, const uint8_t *addr, uint32_t addr_len, char *buff) {
+    struct sky_addr_ref_t refs[SKY_ADDR_FIELDS];
+    const uint8_t *p = (const uint8_t *)buff;
+    uint32_t i;
+
+    sky_addr_refs(ext, refs);
+    if (addr_len > 0)
+        memcpy(buff, addr, addr_len);
+    for (i = 0; i < SKY_ADDR_FIELDS; i++) {
+        *refs[i].len = (addr_len > 0) ? (uint16_t)(p[0] | p[1] << 8) : 0;
+        p += (addr_len > 0) ? 2 : 0;
+        *refs[i].str = (*refs[i].len > 0) ? (char *)p : NULL;
+        p += *refs[i].len;
+    }
+}
+
+struct sky_cache_t * sky_cache_create(const struct sky_cache_config_t *config) {
+    struct sky_cache_t *cache = calloc(1, sizeof(struct sky_cache_t));
+    uint32_t i;
+
+    if (cache == NULL) {
+        perror("calloc failed");
+        return NULL;
+    }
+    cache->config = *config;
+    pthread_mutex_init(&cache->writer_lock, NULL);
+    pthread_cond_init(&cache->writer_cond, NULL);
+    if (cache->config.ttl == 0)
+        cache->config.ttl = cache->config.negative ? SKY_CACHE_NEGATIVE_TTL : SKY_CACHE_TTL_DEFAULT;
+    if (cache->config.rssi_bucket == 0)
+        cache->config.rssi_bucket = SKY_CACHE_RSSI_BUCKET;
+
+    uint32_t shards = config->shards;
+    uint32_t sets = sky_shard_sets(&shards, config->capacity, SKY_CACHE_WAYS);
+    cache->config.shards = shards;
+    cache->config.capacity = sets * shards * SKY_CACHE_WAYS;
+    cache->shard_mask = shards - 1;
+    cache->set_mask = sets - 1;
+
+    if ((cache->shards = sky_shards_alloc(shards, sizeof(struct sky_cache_shard_t))) == NULL) {
+        free(cache);
+        return NULL;
+    }
+    for (i = 0; i < shards; i++) {
+        struct sky_cache_shard_t *shard = &cache->shards[i];
+        shard->entries = calloc(sets * SKY_CACHE_WAYS, sizeof(struct sky_cache_entry_t));
+        shard->hands = calloc(sets, sizeof(uint8_t));
+        if (shard->entries == NULL || shard->hands == NULL) {
+            perror("calloc failed");
+            sky_cache_destroy(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void sky_cache_destroy(struct sky_cache_t *cache) {
+    uint32_t i, j;
+
+    if (cache == NULL)
+        return;
+    sky_cache_snapshot_stop(cache);
+    pthread_mutex_destroy(&cache->writer_lock);
+    pthread_cond_destroy(&cache->writer_cond);
+    if (cache->snapshot != NULL)
+        munmap(cache->snapshot, cache->snapshot_len);
+    for (i = 0; i < cache->config.shards; i++) {
+        struct sky_cache_shard_t *shard = &cache->shards[i];
+        if (shard->entries != NULL)
+            for (j = 0; j < (cache->set_mask + 1) * SKY_CACHE_WAYS; j++)
+                free(shard->entries[j].addr);
+        free(shard->entries);
+        free(shard->hands);
+    }
+    sky_shards_free(cache->shards, cache->config.shards, sizeof(struct sky_cache_shard_t));
+    free(cache);
+}
+
+uint64_t sky_cache_fingerprint(const struct sky_cache_t *cache, const struct location_rq_t *creq) {
+    uint64_t keys[MAX_APS];
+    uint64_t h = 0xCBF29CE484222325ULL, sum = 0;
+    int32_t bucket = cache->config.rssi_bucket;
+    uint32_t i, j;
+
+    h = sky_mix64(h, creq->payload_ext.payload.type);
+    h = sky_mix64(h, SKY_KEY(creq).partner_id);
+
+    // access points in MAC order, with the rssi bucket in the low byte; above
+    // MAX_APS, not accepted by the decoders, the sum of their mixed keys which
+    // does not depend on their order either
+    for (i = 0; i < creq->ap_count; i++) {
+        uint64_t mac = 0;
+        for (j = 0; j < MAC_SIZE; j++)
+            mac = (mac << 8) | creq->aps[i].MAC[j];
+        uint64_t key = (mac << 8) | (uint8_t)((creq->aps[i].rssi - INT8_MIN) / bucket);
+        if (creq->ap_count > MAX_APS)
+            sum += sky_mix64(DATA_TYPE_AP, key);
+        else
+            keys[i] = key;
+    }
+    h = sky_mix64(h, DATA_TYPE_AP);
+    if (creq->ap_count > MAX_APS) {
+        h = sky_mix64(h, sum);
+    } else {
+        qsort(keys, creq->ap_count, sizeof(uint64_t), sky_cmp_u64);
+        for (i = 0; i < creq->ap_count; i++)
+            h = sky_mix64(h, keys[i]);
+    }
+
+    // cell ids in request order, serving cell first
+    for (i = 0; i < creq->gsm_count; i++)
+        h = sky_hash_cell(h, DATA_TYPE_GSM, &creq->gsms[i]);
+    for (i = 0; i < creq->umts_count; i++)
+        h = sky_hash_cell(h, DATA_TYPE_UMTS, &creq->umtss[i]);
+    for (i = 0; i < creq->lte_count; i++)
+        h = sky_hash_cell(h, DATA_TYPE_LTE, &creq->ltes[i]);
+    for (i = 0; i < creq->cdma_count; i++)
+        h = sky_hash_cell(h, DATA_TYPE_CDMA, &creq->cdmas[i]);
+    for (i = 0; i < creq->cell_count; i++)
+        h = sky_hash_cell(h, creq->cell_type, &creq->cell[i]);
+
+    // gps position rounded to 10^-4 degrees
+    for (i = 0; i < creq->gps_count; i++) {
+        const struct gps_t *g = &creq->gps[i];
+        if (g->lat == DBL_MAX || g->lon == DBL_MAX)
+            continue;
+        h = sky_mix64(h, DATA_TYPE_GPS);
+        h = sky_mix64(h, (uint64_t)(int64_t)(g->lat * 1E4) << 32 ^ (uint32_t)(int32_t)(g->lon * 1E4));
+    }
+
+    return (h == 0) ? 1 : h;
+}
+
+static struct sky_cache_shard_t * sky_cache_shard(struct sky_cache_t *cache, uint64_t fingerprint) {
+    return &cache->shards[(fingerprint >> 32) & cache->shard_mask];
+}
+
+// check value of a snapshot header or record
+static uint32_t sky_snapshot_check(uint64_t h, const uint8_t *data, uint32_t len) {
+    uint64_t v;
+    while (len >= sizeof(v)) {
+        memcpy(&v, data, sizeof(v));
+        h = sky_mix64(h, v);
+        data += sizeof(v);
+        len -= sizeof(v);
+    }
+    v = 0;
+    if (len > 0)
+        memcpy(&v, data, len);
+    h = sky_mix64(h, v ^ (uint64_t)len << 56);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t sky_snapshot_record_check(const struct sky_snapshot_record_t *r, const uint8_t *addr) {
+    uint32_t h = sky_snapshot_check(SKY_SNAPSHOT_MAGIC, (const uint8_t *)r,
+            offsetof(struct sky_snapshot_record_t, check));
+    return sky_snapshot_check(h, addr + r->addr_off, r->addr_len);
+}
+
+// returns 1 if the record of the loaded snapshot is unexpired and not corrupt
+static int32_t sky_snapshot_valid(const struct sky_cache_t *cache, const struct sky_snapshot_record_t *r,
+        uint32_t now) {
+    if (r->expires <= now)
+        return 0;
+    if ((uint64_t)r->addr_off + r->addr_len > cache->record_addr_bytes
+            || r->check != sky_snapshot_record_check(r, cache->record_addr)) {
+        fprintf(stderr, "snapshot record corrupt\n");
+        return 0;
+    }
+    return 1;
+}
+
+// the valid, unexpired record of the fingerprint in the loaded snapshot, or NULL
+static const struct sky_snapshot_record_t * sky_snapshot_find(const struct sky_cache_t *cache,
+        uint64_t fingerprint, uint32_t now) {
+    uint32_t lo = 0, hi = cache->record_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct sky_snapshot_record_t *r = &cache->records[mid];
+        if (r->fingerprint < fingerprint) {
+            lo = mid + 1;
+        } else if (r->fingerprint > fingerprint) {
+            hi = mid;
+        } else {
+            return sky_snapshot_valid(cache, r, now) ? r : NULL;
+        }
+    }
+    return NULL;
+}
+
+// chooses the way of the fingerprint in the set and stores the result, with the shard locked
+// the entry takes the ownership of addr
+static struct sky_cache_entry_t * sky_cache_insert(struct sky_cache_shard_t *shard,
+        uint32_t set, uint64_t fingerprint, uint8_t type,
+        const struct location_t *location, uint8_t *addr, uint32_t addr_len, uint32_t expires,
+        uint32_t now) {
+    struct sky_cache_entry_t *ways = &shard->entries[set * SKY_CACHE_WAYS];
+    struct sky_cache_entry_t *e = NULL;
+    uint32_t i;
+
+    // the same fingerprint, then an empty or expired way, then CLOCK
+    for (i = 0; i < SKY_CACHE_WAYS && e == NULL; i++)
+        if (ways[i].fingerprint == fingerprint)
+            e = &ways[i];
+    for (i = 0; i < SKY_CACHE_WAYS && e == NULL; i++)
+        if (ways[i].fingerprint == 0 || ways[i].expires <= now)
+            e = &ways[i];
+    while (e == NULL) {
+        uint8_t hand = shard->hands[set];
+        shard->hands[set] = (hand + 1) % SKY_CACHE_WAYS;
+        if (ways[hand].ref)
+            ways[hand].ref = 0; // second chance
+        else
+            e = &ways[hand];
+    }
+
+    if (e->fingerprint == 0)
+        shard->stats.entries++;
+    else if (e->fingerprint != fingerprint && e->expires > now)
+        shard->stats.evictions++;
+    free(e->addr);
+
+    e->fingerprint = fingerprint;
+    e->location = *location;
+    e->expires = expires;
+    e->type = type;
+    e->ref = 0;
+    e->addr = addr;
+    e->addr_len = (uint16_t)addr_len;
+    return e;
+}
+
+// copies the result of the snapshot into the cache, with the shard locked
+static struct sky_cache_entry_t * sky_cache_restore(struct sky_cache_t *cache,
+        struct sky_cache_shard_t *shard, uint32_t set, uint64_t fingerprint, uint32_t now) {
+    const struct sky_snapshot_record_t *r = sky_snapshot_find(cache, fingerprint, now);
+    uint8_t *addr = NULL;
+
+    if (r == NULL)
+        return NULL;
+    if (r->addr_len > 0) {
+        if ((addr = malloc(r->addr_len)) == NULL) {
+            perror("malloc failed");
+            return NULL;
+        }
+        memcpy(addr, cache->record_addr + r->addr_off, r->addr_len);
+    }
+    shard->stats.restored++;
+    return sky_cache_insert(shard, set, fingerprint, r->type, &r->location,
+            addr, r->addr_len, r->expires, now);
+}
+
+int32_t sky_cache_get(struct sky_cache_t *cache, uint64_t fingerprint,
+        struct location_rsp_t *cresp, char *buff, uint32_t buff_len) {
+    struct sky_cache_shard_t *shard = sky_cache_shard(cache, fingerprint);
+    uint32_t set = (uint32_t)fingerprint & cache->set_mask;
+    uint32_t now = sky_now_sec();
+    struct sky_cache_entry_t *e = NULL;
+    int32_t rc = 0;
+    uint32_t i;
+
+    pthread_mutex_lock(&shard->lock);
+    struct sky_cache_entry_t *ways = &shard->entries[set * SKY_CACHE_WAYS];
+    for (i = 0; i < SKY_CACHE_WAYS; i++) {
+        if (ways[i].fingerprint != fingerprint)
+            continue;
+        if (ways[i].expires <= now) {
+            // free the way
+            free(ways[i].addr);
+            memset(&ways[i], 0, sizeof(ways[i]));
+            shard->stats.expired++;
+            shard->stats.entries--;
+        } else {
+            e = &ways[i];
+        }
+        break;
+    }
+    // warm restart, the pages of the snapshot are faulted in on demand
+    if (e == NULL && cache->snapshot != NULL)
+        e = sky_cache_restore(cache, shard, set, fingerprint, now);
+
+    if (e != NULL && e->addr_len > buff_len) {
+        perror("buffer too small");
+    } else if (e != NULL) {
+        cresp->payload_ext.payload.type = e->type;
+        cresp->location = e->location;
+
+        sky_addr_unpack(&cresp->location_ext, e->addr, e->addr_len, buff);
+        e->ref = 1;
+        rc = 1;
+    }
+    if (rc == 1)
+        shard->stats.hits++;
+    else
+        shard->stats.misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return rc;
+}
+
+int32_t sky_cache_put(struct sky_cache_t *cache, uint64_t fingerprint,
+        const struct location_rsp_t *cresp) {
+    uint8_t type = cresp->payload_ext.payload.type;
+    struct location_t location;
+    uint8_t *addr = NULL;
+    uint32_t addr_len = 0;
+
+    if (cache->config.negative) {
+        if (type != LOCATION_UNABLE_TO_DETERMINE)
+            return -1;
+    } else if (type != LOCATION_RQ_SUCCESS && type != LOCATION_RQ_ADDR_SUCCESS) {
+        return -1;
+    }
+
+    if (type == LOCATION_RQ_ADDR_SUCCESS) {
+        addr_len = sky_addr_packed_len(&cresp->location_ext);
+        if (addr_len > UINT16_MAX)
+            return -1; // does not fit an entry
+        if ((addr = malloc(addr_len)) == NULL) {
+            perror("malloc failed");
+            return -1;
+        }
+        sky_addr_pack(&cresp->location_ext, addr);
+    }
+
+    if (cache->config.negative)
+        memset(&location, 0, sizeof(location));
+    else
+        location = cresp->location;
+
+    struct sky_cache_shard_t *shard = sky_cache_shard(cache, fingerprint);
+    uint32_t set = (uint32_t)fingerprint & cache->set_mask;
+    uint32_t now = sky_now_sec();
+
+    pthread_mutex_lock(&shard->lock);
+    sky_cache_insert(shard, set, fingerprint, type, &location, addr, addr_len,
+            now + cache->config.ttl, now);
+    shard->stats.inserts++;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// adds the packed address fields to the snapshot, once for equal fields
+// returns the offset, or -1 if it fails
+static int64_t sky_snapshot_intern(struct sky_snapshot_addr_t *a, const uint8_t *addr, uint32_t len) {
+    uint32_t i = sky_snapshot_check(0, addr, len) & a->mask;
+
+    while (a->table[i].off != 0) {
+        if (a->table[i].len == len && memcmp(a->buff + a->table[i].off - 1, addr, len) == 0)
+            return a->table[i].off - 1;
+        i = (i + 1) & a->mask;
+    }
+    if (a->len + len > a->size) {
+        uint32_t size = (a->size > 0) ? a->size : 4096;
+        while (size < a->len + len)
+            size <<= 1;
+        uint8_t *buff = realloc(a->buff, size);
+        if (buff == NULL) {
+            perror("realloc failed");
+            return -1;
+        }
+        a->buff = buff;
+        a->size = size;
+    }
+    memcpy(a->buff + a->len, addr, len);
+    a->table[i].off = a->len + 1;
+    a->table[i].len = len;
+    a->len += len;
+    return a->table[i].off - 1;
+}
+
+int32_t sky_cache_save(struct sky_cache_t *cache, const char *path) {
+    struct sky_snapshot_header_t header;
+    struct sky_snapshot_record_t *records;
+    struct sky_snapshot_addr_t addr;
+    uint32_t count = 0, now = sky_now_sec();
+    // the entries of the cache, and the records of the loaded snapshot never looked up
+    uint32_t max_count = cache->config.capacity + cache->record_count;
+    int32_t rc = -1;
+    uint32_t i, j;
+    char tmp[PATH_MAX];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.mask = sky_pow2(2 * max_count) - 1;
+    records = malloc(max_count * sizeof(struct sky_snapshot_record_t));
+    addr.table = calloc(addr.mask + 1, sizeof(*addr.table));
+    if (records == NULL || addr.table == NULL) {
+        perror("malloc failed");
+        goto out;
+    }
+
+    // copy the valid entries, one shard locked at a time
+    for (i = 0; i < cache->config.shards; i++) {
+        struct sky_cache_shard_t *shard = &cache->shards[i];
+        int64_t off = 0;
+        pthread_mutex_lock(&shard->lock);
+        for (j = 0; j < (cache->set_mask + 1) * SKY_CACHE_WAYS && off >= 0; j++) {
+            const struct sky_cache_entry_t *e = &shard->entries[j];
+            if (e->fingerprint == 0 || e->expires <= now)
+                continue;
+            if (e->addr != NULL && (off = sky_snapshot_intern(&addr, e->addr, e->addr_len)) < 0)
+                break;
+            struct sky_snapshot_record_t *r = &records[count++];
+            memset(r, 0, sizeof(*r));
+            r->fingerprint = e->fingerprint;
+            r->location = e->location;
+            r->expires = e->expires;
+            r->addr_off = (e->addr != NULL) ? (uint32_t)off : 0;
+            r->addr_len = (e->addr != NULL) ? e->addr_len : 0;
+            r->type = e->type;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (off < 0)
+            goto out;
+    }
+
+    // the fingerprint is the first field of the record
+    qsort(records, count, sizeof(struct sky_snapshot_record_t), sky_cmp_u64);
+
+    // keep the valid records of the loaded snapshot missing from the cache,
+    // they are lost by the rename otherwise
+    uint32_t cache_count = count;
+    for (i = 0; i < cache->record_count; i++) {
+        const struct sky_snapshot_record_t *s = &cache->records[i];
+        int64_t off = 0;
+        if (bsearch(&s->fingerprint, records, cache_count, sizeof(struct sky_snapshot_record_t), sky_cmp_u64)
+                || !sky_snapshot_valid(cache, s, now))
+            continue;
+        if (s->addr_len > 0 && (off = sky_snapshot_intern(&addr, cache->record_addr + s->addr_off, s->addr_len)) < 0)
+            goto out;
+        struct sky_snapshot_record_t *r = &records[count++];
+        *r = *s;
+        r->addr_off = (uint32_t)off;
+    }
+    if (count > cache_count)
+        qsort(records, count, sizeof(struct sky_snapshot_record_t), sky_cmp_u64);
+    for (i = 0; i < count; i++)
+        records[i].check = sky_snapshot_record_check(&records[i], addr.buff);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SKY_SNAPSHOT_MAGIC;
+    header.version = SKY_SNAPSHOT_VERSION;
+    header.count = count;
+    header.addr_bytes = addr.len;
+    header.created = now;
+    header.check = sky_snapshot_check(SKY_SNAPSHOT_MAGIC, (const uint8_t *)&header,
+            offsetof(struct sky_snapshot_header_t, check));
+
+    // write a temporary file and rename it, a reader never sees a partial snapshot
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "snapshot path too long\n");
+        goto out;
+    }
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror("fopen failed");
+        goto out;
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1
+            || fwrite(records, sizeof(struct sky_snapshot_record_t), count, f) != count
+            || fwrite(addr.buff, 1, addr.len, f) != addr.len
+            || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror("snapshot write failed");
+        fclose(f);
+        unlink(tmp);
+        goto out;
+    }
+    fclose(f);
+    if (rename(tmp, path) != 0) {
+        perror("rename failed");
+        unlink(tmp);
+        goto out;
+    }
+    rc = (int32_t)count;
+
+out:
+    free(records);
+    free(addr.table);
+    free(addr.buff);
+    return rc;
+}
+
+int32_t sky_cache_load(struct sky_cache_t *cache, const char *path) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        perror("open failed");
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat failed");
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct sky_snapshot_header_t)) {
+        fprintf(stderr, "snapshot too short\n");
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap failed");
+        return -1;
+    }
+
+    // only the header is read here, the records are checked when found
+    const struct sky_snapshot_header_t *header = base;
+    if (header->magic != SKY_SNAPSHOT_MAGIC || header->version != SKY_SNAPSHOT_VERSION
+            || header->check != sky_snapshot_check(SKY_SNAPSHOT_MAGIC, (const uint8_t *)header,
+                    offsetof(struct sky_snapshot_header_t, check))
+            || (uint64_t)st.st_size != sizeof(struct sky_snapshot_header_t)
+                    + (uint64_t)header->count * sizeof(struct sky_snapshot_record_t)
+                    + header->addr_bytes) {
+        fprintf(stderr, "snapshot corrupt\n");
+        munmap(base, st.st_size);
+        return -1;
+    }
+    madvise(base, st.st_size, MADV_RANDOM);
+
+    if (cache->snapshot != NULL)
+        munmap(cache->snapshot, cache->snapshot_len);
+    cache->snapshot = base;
+    cache->snapshot_len = st.st_size;
+    cache->records = (const struct sky_snapshot_record_t *)(header + 1);
+    cache->record_count = header->count;
+    cache->record_addr = (const uint8_t *)(cache->records + header->count);
+    cache->record_addr_bytes = header->addr_bytes;
+    return (int32_t)header->count;
+}
+
+static void * sky_cache_writer(void *arg) {
+    struct sky_cache_t *cache = arg;
+
+    pthread_mutex_lock(&cache->writer_lock);
+    while (!cache->writer_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += cache->interval;
+        while (!cache->writer_stop
+                && pthread_cond_timedwait(&cache->writer_cond, &cache->writer_lock, &deadline) != ETIMEDOUT)
+            ;
+        if (cache->writer_stop)
+            break;
+        pthread_mutex_unlock(&cache->writer_lock);
+        sky_cache_save(cache, cache->path);
+        pthread_mutex_lock(&cache->writer_lock);
+    }
+    pthread_mutex_unlock(&cache->writer_lock);
+    return NULL;
+}
+
+int32_t sky_cache_snapshot_start(struct sky_cache_t *cache, const char *path, uint32_t interval) {
+    if (cache->writer_running) {
+        fprintf(stderr, "snapshot writer already running\n");
+        return -1;
+    }
+    if ((cache->path = strdup(path)) == NULL) {
+        perror("strdup failed");
+        return -1;
+    }
+    cache->interval = (interval > 0) ? interval : SKY_CACHE_SNAPSHOT_INTERVAL;
+    cache->writer_stop = 0;
+    if (pthread_create(&cache->writer, NULL, sky_cache_writer, cache) != 0) {
+        perror("pthread_create failed");
+        free(cache->path);
+        cache->path = NULL;
+        return -1;
+    }
+    cache->writer_running = 1;
+    return 0;
+}
+
+int32_t sky_cache_snapshot_stop(struct sky_cache_t *cache) {
+    int32_t rc;
+
+    if (!cache->writer_running)
+        return 0;
+    pthread_mutex_lock(&cache->writer_lock);
+    cache->writer_stop = 1;
+    pthread_cond_signal(&cache->writer_cond);
+    pthread_mutex_unlock(&cache->writer_lock);
+    pthread_join(cache->writer, NULL);
+    cache->writer_running = 0;
+
+    rc = sky_cache_save(cache, cache->path);
+    free(cache->path);
+    cache->path = NULL;
+    return (rc < 0) ? -1 : 0;
+}
+
+void sky_cache_get_stats(struct sky_cache_t *cache, struct sky_cache_stats_t *stats) {
+    sky_shards_stats(cache->shards, cache->config.shards, sizeof(struct sky_cache_shard_t),
+            offsetof(struct sky_cache_shard_t, stats), stats, sizeof(*stats));
+}
@@ -0,0 +1,232 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "sky_internal.h"
+#include "sky_coalesce.h"
+
+struct sky_waiter_t {
+    struct sky_waiter_t *next;
+    sky_coalesce_cb_t cb;
+    void *arg;
+};
+
+struct sky_inflight_t {
+    struct sky_inflight_t *next; // hash chain
+    uint64_t fingerprint;
+    uint64_t started;          // ms, of the current leader
+    uint32_t count;            // # of waiters
+    struct sky_waiter_t *waiters;
+};
+
+struct sky_coalesce_shard_t {
+    pthread_mutex_t lock;
+    struct sky_inflight_t **buckets;
+    struct sky_coalesce_stats_t stats;
+} __attribute__((aligned(64)));
+
+struct sky_coalesce_t {
+    struct sky_coalesce_config_t config;
+    uint32_t shard_mask;
+    uint32_t bucket_mask;
+    struct sky_coalesce_shard_t *shards;
+};
+
+static struct sky_coalesce_shard_t * sky_coalesce_shard(struct sky_coalesce_t *table, uint64_t fingerprint) {
+    return &table->shards[(fingerprint >> 32) & table->shard_mask];
+}
+
+// calls the continuations and frees the waiters, without the lock
+static int32_t sky_coalesce_answer(struct sky_waiter_t *w, const struct location_rsp_t *cresp) {
+    int32_t n = 0;
+    while (w != NULL) {
+        struct sky_waiter_t *next = w->next;
+        w->cb(w->arg, cresp);
+        free(w);
+        w = next;
+        n++;
+    }
+    return n;
+}
+
+struct sky_coalesce_t * sky_coalesce_create(const struct sky_coalesce_config_t *config) {
+    struct sky_coalesce_t *table = calloc(1, sizeof(struct sky_coalesce_t));
+    uint32_t i;
+
+    if (table == NULL) {
+        perror("calloc failed");
+        return NULL;
+    }
+    table->config = *config;
+    if (table->config.timeout == 0)
+        table->config.timeout = SKY_COALESCE_TIMEOUT;
+    if (table->config.max_waiters == 0)
+        table->config.max_waiters = SKY_COALESCE_MAX_WAITERS;
+
+    uint32_t shards = config->shards;
+    uint32_t buckets = sky_shard_sets(&shards, config->capacity, 1);
+    table->config.shards = shards;
+    table->config.capacity = buckets * shards;
+    table->shard_mask = shards - 1;
+    table->bucket_mask = buckets - 1;
+
+    if ((table->shards = sky_shards_alloc(shards, sizeof(struct sky_coalesce_shard_t))) == NULL) {
+        free(table);
+        return NULL;
+    }
+    for (i = 0; i < shards; i++) {
+        struct sky_coalesce_shard_t *shard = &table->shards[i];
+        if ((shard->buckets = calloc(buckets, sizeof(struct sky_inflight_t *))) == NULL) {
+            perror("calloc failed");
+            sky_coalesce_destroy(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+void sky_coalesce_destroy(struct sky_coalesce_t *table) {
+    uint32_t i, j;
+
+    if (table == NULL)
+        return;
+    for (i = 0; i < table->config.shards; i++) {
+        struct sky_coalesce_shard_t *shard = &table->shards[i];
+        if (shard->buckets != NULL) {
+            for (j = 0; j <= table->bucket_mask; j++) {
+                while (shard->buckets[j] != NULL) {
+                    struct sky_inflight_t *f = shard->buckets[j];
+                    shard->buckets[j] = f->next;
+                    sky_coalesce_answer(f->waiters, NULL);
+                    free(f);
+                }
+            }
+        }
+        free(shard->buckets);
+    }
+    sky_shards_free(table->shards, table->config.shards, sizeof(struct sky_coalesce_shard_t));
+    free(table);
+}
+
+int32_t sky_coalesce_join(struct sky_coalesce_t *table, uint64_t fingerprint,
+        sky_coalesce_cb_t cb, void *arg) {
+    struct sky_coalesce_shard_t *shard = sky_coalesce_shard(table, fingerprint);
+    struct sky_inflight_t **bucket = &shard->buckets[(uint32_t)fingerprint & table->bucket_mask];
+    struct sky_inflight_t *f;
+    uint64_t now = sky_now_ms();
+    int32_t rc;
+
+    pthread_mutex_lock(&shard->lock);
+    for (f = *bucket; f != NULL; f = f->next)
+        if (f->fingerprint == fingerprint)
+            break;
+
+    if (f == NULL) {
+        if ((f = calloc(1, sizeof(struct sky_inflight_t))) == NULL) {
+            perror("calloc failed");
+            rc = -1;
+        } else {
+            f->fingerprint = fingerprint;
+            f->started = now;
+            f->next = *bucket;
+            *bucket = f;
+            shard->stats.leaders++;
+            shard->stats.inflight++;
+            rc = SKY_COALESCE_LEADER;
+        }
+    } else if (now - f->started >= table->config.timeout) {
+        // the leader is lost, this request answers the followers
+        f->started = now;
+        shard->stats.takeovers++;
+        rc = SKY_COALESCE_LEADER;
+    } else if (f->count >= table->config.max_waiters) {
+        shard->stats.overflows++;
+        rc = -1;
+    } else {
+        struct sky_waiter_t *w = malloc(sizeof(struct sky_waiter_t));
+        if (w == NULL) {
+            perror("malloc failed");
+            rc = -1;
+        } else {
+            w->cb = cb;
+            w->arg = arg;
+            w->next = f->waiters;
+            f->waiters = w;
+            f->count++;
+            shard->stats.followers++;
+            rc = SKY_COALESCE_FOLLOWER;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return rc;
+}
+
+int32_t sky_coalesce_complete(struct sky_coalesce_t *table, uint64_t fingerprint,
+        const struct location_rsp_t *cresp) {
+    struct sky_coalesce_shard_t *shard = sky_coalesce_shard(table, fingerprint);
+    struct sky_inflight_t **p = &shard->buckets[(uint32_t)fingerprint & table->bucket_mask];
+    struct sky_inflight_t *f;
+
+    pthread_mutex_lock(&shard->lock);
+    while ((f = *p) != NULL && f->fingerprint != fingerprint)
+        p = &f->next;
+    if (f != NULL) {
+        *p = f->next;
+        shard->stats.inflight--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // completed by the other leader of a takeover
+    if (f == NULL)
+        return 0;
+
+    int32_t n = sky_coalesce_answer(f->waiters, cresp);
+    free(f);
+    return n;
+}
+
+int32_t sky_coalesce_expire(struct sky_coalesce_t *table) {
+    struct sky_waiter_t *waiters = NULL;
+    uint64_t now = sky_now_ms();
+    uint32_t i, j;
+
+    for (i = 0; i < table->config.shards; i++) {
+        struct sky_coalesce_shard_t *shard = &table->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (j = 0; j <= table->bucket_mask; j++) {
+            struct sky_inflight_t **p = &shard->buckets[j];
+            struct sky_inflight_t *f;
+            while ((f = *p) != NULL) {
+                if (now - f->started < table->config.timeout) {
+                    p = &f->next;
+                    continue;
+                }
+                *p = f->next;
+                // prepend the waiters of the lost leader
+                while (f->waiters != NULL) {
+                    struct sky_waiter_t *w = f->waiters;
+                    f->waiters = w->next;
+                    w->next = waiters;
+                    waiters = w;
+                }
+                free(f);
+                shard->stats.expired++;
+                shard->stats.inflight--;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return sky_coalesce_answer(waiters, NULL);
+}
+
+void sky_coalesce_get_stats(struct sky_coalesce_t *table, struct sky_coalesce_stats_t *stats) {
+    sky_shards_stats(table->shards, table->config.shards, sizeof(struct sky_coalesce_shard_t),
+            offsetof(struct sky_coalesce_shard_t, stats), stats, sizeof(*stats));
+}
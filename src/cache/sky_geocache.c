@@ -0,0 +1,275 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "sky_cache.h"
+#include "sky_geocache.h"
+
+#define SKY_AREA_FIRST  2   // city, the first area field of sky_addr_refs
+#define SKY_AREA_FIELDS (SKY_ADDR_FIELDS - SKY_AREA_FIRST)
+
+// interned string
+struct sky_intern_t {
+    struct sky_intern_t *next; // hash chain
+    uint32_t hash;
+    uint32_t refs;
+    uint16_t len;
+    char str[];
+};
+
+struct sky_tile_t {
+    uint64_t key;
+    uint8_t used;
+    uint8_t ref;               // CLOCK reference bit
+    struct sky_intern_t *fields[SKY_AREA_FIELDS];
+};
+
+struct sky_geocache_t {
+    pthread_mutex_t lock;
+    struct sky_geocache_config_t config;
+    uint32_t set_mask;
+    uint8_t *hands;            // CLOCK hand of each set
+    uint32_t hand;             // CLOCK hand over all tiles, for the memory bound
+    struct sky_tile_t *tiles;  // sets * SKY_GEOCACHE_WAYS
+    struct sky_intern_t **strings; // hash buckets of the interned strings
+    uint32_t string_mask;
+    struct sky_geocache_stats_t stats;
+};
+
+static uint64_t sky_tile_key(const struct sky_geocache_t *cache, double lat, double lon) {
+    int32_t y = (int32_t)floor(lat / cache->config.tile_deg);
+    int32_t x = (int32_t)floor(lon / cache->config.tile_deg);
+    return (uint64_t)(uint32_t)y << 32 | (uint32_t)x;
+}
+
+static uint32_t sky_tile_set(const struct sky_geocache_t *cache, uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(key >> 32) & cache->set_mask;
+}
+
+// FNV-1a
+static uint32_t sky_str_hash(const char *str, uint16_t len) {
+    uint32_t h = 0x811C9DC5;
+    uint32_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)str[i]) * 0x01000193;
+    return h;
+}
+
+static struct sky_intern_t * sky_intern(struct sky_geocache_t *cache, const char *str, uint16_t len) {
+    uint32_t hash = sky_str_hash(str, len);
+    struct sky_intern_t **bucket = &cache->strings[hash & cache->string_mask];
+    struct sky_intern_t *s;
+
+    for (s = *bucket; s != NULL; s = s->next) {
+        if (s->hash == hash && s->len == len && memcmp(s->str, str, len) == 0) {
+            s->refs++;
+            return s;
+        }
+    }
+    if ((s = malloc(sizeof(struct sky_intern_t) + len)) == NULL) {
+        perror("malloc failed");
+        return NULL;
+    }
+    s->hash = hash;
+    s->refs = 1;
+    s->len = len;
+    memcpy(s->str, str, len);
+    s->next = *bucket;
+    *bucket = s;
+    cache->stats.strings++;
+    cache->stats.bytes += sizeof(struct sky_intern_t) + len;
+    return s;
+}
+
+static void sky_release(struct sky_geocache_t *cache, struct sky_intern_t *s) {
+    if (s == NULL || --s->refs > 0)
+        return;
+    struct sky_intern_t **p = &cache->strings[s->hash & cache->string_mask];
+    while (*p != s)
+        p = &(*p)->next;
+    *p = s->next;
+    cache->stats.strings--;
+    cache->stats.bytes -= sizeof(struct sky_intern_t) + s->len;
+    free(s);
+}
+
+static void sky_tile_clear(struct sky_geocache_t *cache, struct sky_tile_t *tile) {
+    uint32_t i;
+    for (i = 0; i < SKY_AREA_FIELDS; i++)
+        sky_release(cache, tile->fields[i]);
+    memset(tile, 0, sizeof(*tile));
+    cache->stats.tiles--;
+}
+
+struct sky_geocache_t * sky_geocache_create(const struct sky_geocache_config_t *config) {
+    struct sky_geocache_t *cache = calloc(1, sizeof(struct sky_geocache_t));
+    uint32_t capacity = SKY_GEOCACHE_WAYS;
+
+    if (cache == NULL) {
+        perror("calloc failed");
+        return NULL;
+    }
+    cache->config = *config;
+    if (cache->config.tile_deg <= 0)
+        cache->config.tile_deg = SKY_GEOCACHE_TILE_DEG;
+    if (cache->config.max_bytes == 0)
+        cache->config.max_bytes = SKY_GEOCACHE_MAX_BYTES;
+    while (capacity < config->capacity)
+        capacity <<= 1;
+    cache->config.capacity = capacity;
+    cache->set_mask = capacity / SKY_GEOCACHE_WAYS - 1;
+    cache->string_mask = capacity - 1;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    cache->tiles = calloc(capacity, sizeof(struct sky_tile_t));
+    cache->hands = calloc(capacity / SKY_GEOCACHE_WAYS, sizeof(uint8_t));
+    cache->strings = calloc(capacity, sizeof(struct sky_intern_t *));
+    if (cache->tiles == NULL || cache->hands == NULL || cache->strings == NULL) {
+        perror("calloc failed");
+        sky_geocache_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void sky_geocache_destroy(struct sky_geocache_t *cache) {
+    uint32_t i;
+
+    if (cache == NULL)
+        return;
+    if (cache->tiles != NULL && cache->strings != NULL)
+        for (i = 0; i < cache->config.capacity; i++)
+            if (cache->tiles[i].used)
+                sky_tile_clear(cache, &cache->tiles[i]);
+    free(cache->tiles);
+    free(cache->hands);
+    free(cache->strings);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+int32_t sky_geocache_get(struct sky_geocache_t *cache, double lat, double lon,
+        struct location_ext_t *ext, char *buff, uint32_t buff_len) {
+    uint64_t key = sky_tile_key(cache, lat, lon);
+    struct sky_addr_ref_t refs[SKY_ADDR_FIELDS];
+    int32_t rc = 0;
+    uint32_t i, j;
+
+    pthread_mutex_lock(&cache->lock);
+    struct sky_tile_t *tile = &cache->tiles[sky_tile_set(cache, key) * SKY_GEOCACHE_WAYS];
+    for (i = 0; i < SKY_GEOCACHE_WAYS; i++, tile++) {
+        if (!tile->used || tile->key != key)
+            continue;
+
+        uint32_t len = 0;
+        for (j = 0; j < SKY_AREA_FIELDS; j++)
+            len += (tile->fields[j] != NULL) ? tile->fields[j]->len : 0;
+        if (len > buff_len) {
+            perror("buffer too small");
+            break;
+        }
+
+        // copy out, the strings may be released after unlock
+        sky_addr_refs(ext, refs);
+        for (j = 0; j < SKY_AREA_FIELDS; j++) {
+            struct sky_intern_t *s = tile->fields[j];
+            *refs[SKY_AREA_FIRST + j].len = (s != NULL) ? s->len : 0;
+            *refs[SKY_AREA_FIRST + j].str = (s != NULL) ? buff : NULL;
+            if (s != NULL) {
+                memcpy(buff, s->str, s->len);
+                buff += s->len;
+            }
+        }
+        tile->ref = 1;
+        rc = 1;
+        break;
+    }
+    if (rc == 1)
+        cache->stats.hits++;
+    else
+        cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return rc;
+}
+
+int32_t sky_geocache_put(struct sky_geocache_t *cache, double lat, double lon,
+        const struct location_ext_t *ext) {
+    uint64_t key = sky_tile_key(cache, lat, lon);
+    struct sky_addr_ref_t refs[SKY_ADDR_FIELDS];
+    uint32_t i, n = 0;
+
+    sky_addr_refs((struct location_ext_t *)ext, refs);
+    for (i = SKY_AREA_FIRST; i < SKY_ADDR_FIELDS; i++)
+        n += *refs[i].len;
+    if (n == 0)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    uint32_t set = sky_tile_set(cache, key);
+    struct sky_tile_t *ways = &cache->tiles[set * SKY_GEOCACHE_WAYS];
+    struct sky_tile_t *tile = NULL;
+
+    // the same tile, then an empty way, then CLOCK
+    for (i = 0; i < SKY_GEOCACHE_WAYS && tile == NULL; i++)
+        if (ways[i].used && ways[i].key == key)
+            tile = &ways[i];
+    for (i = 0; i < SKY_GEOCACHE_WAYS && tile == NULL; i++)
+        if (!ways[i].used)
+            tile = &ways[i];
+    while (tile == NULL) {
+        uint8_t hand = cache->hands[set];
+        cache->hands[set] = (hand + 1) % SKY_GEOCACHE_WAYS;
+        if (ways[hand].ref) {
+            ways[hand].ref = 0; // second chance
+        } else {
+            tile = &ways[hand];
+            cache->stats.evictions++;
+        }
+    }
+
+    // intern the new strings before releasing the old ones, which are likely the same
+    struct sky_intern_t *fields[SKY_AREA_FIELDS];
+    for (i = 0; i < SKY_AREA_FIELDS; i++) {
+        uint16_t len = *refs[SKY_AREA_FIRST + i].len;
+        fields[i] = (len > 0) ? sky_intern(cache, *refs[SKY_AREA_FIRST + i].str, len) : NULL;
+    }
+    if (tile->used)
+        sky_tile_clear(cache, tile);
+    tile->key = key;
+    tile->used = 1;
+    memcpy(tile->fields, fields, sizeof(fields));
+    cache->stats.tiles++;
+    cache->stats.inserts++;
+
+    // memory bound, CLOCK over all the tiles
+    uint32_t sweep = 0;
+    while (cache->stats.bytes > cache->config.max_bytes && sweep < 2 * cache->config.capacity) {
+        struct sky_tile_t *victim = &cache->tiles[cache->hand];
+        cache->hand = (cache->hand + 1) & (cache->config.capacity - 1);
+        sweep++;
+        if (!victim->used || victim == tile)
+            continue;
+        if (victim->ref) {
+            victim->ref = 0;
+            continue;
+        }
+        sky_tile_clear(cache, victim);
+        cache->stats.evictions++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void sky_geocache_get_stats(struct sky_geocache_t *cache, struct sky_geocache_stats_t *stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,251 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sky_minhash.h"
+
+#define SKY_MINHASH_ROWS    (SKY_MINHASH_K / SKY_MINHASH_BANDS)
+#define SKY_MINHASH_SLOTS   4   // slots of a band bucket
+
+// all the hash functions of a signature are computed at once by the vector
+// extension, which the compiler maps to the SIMD registers of the target
+typedef uint32_t sky_v16u32 __attribute__((vector_size(SKY_MINHASH_K * sizeof(uint32_t))));
+
+// odd multipliers and seeds of the hash functions
+static const sky_v16u32 sky_minhash_mul = {
+    0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F, 0x165667B1, 0xD3A2646D, 0xFD7046C5, 0xB55A4F09,
+    0x7FEB352D, 0x846CA68B, 0x21F0AAAD, 0xD35A2D97, 0x2C1B3C6D, 0x297A2D39, 0x5BD1E995, 0xCC9E2D51
+};
+static const sky_v16u32 sky_minhash_seed = {
+    0x1B873593, 0xE6546B64, 0x68E31DA4, 0xB5297A4D, 0x1B56C4E9, 0x6C8E9CF5, 0x7A1D3C85, 0xF1BBCDCB,
+    0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19, 0xCBBB9D5D, 0x629A292A
+};
+
+struct sky_minhash_entry_t {
+    uint32_t signature[SKY_MINHASH_K];
+    uint32_t tags[SKY_MINHASH_BANDS];  // band keys, validate the bucket slots
+    uint64_t fingerprint;              // sky_cache fingerprint, 0 if empty
+    uint32_t context;                  // payload type and partner id
+};
+
+struct sky_minhash_slot_t {
+    uint32_t tag;                      // band key
+    uint32_t entry;                    // index of the entry + 1, 0 if empty
+};
+
+struct sky_minhash_t {
+    pthread_rwlock_t lock;
+    float threshold;
+    uint8_t min_aps;
+    uint32_t mask;                     // capacity - 1
+    uint32_t head;                     // next entry to replace
+    struct sky_minhash_entry_t *entries;
+    struct sky_minhash_slot_t *buckets[SKY_MINHASH_BANDS]; // capacity / SKY_MINHASH_SLOTS buckets each
+    struct sky_minhash_stats_t stats;
+};
+
+static uint32_t sky_mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    return h ^ (h >> 16);
+}
+
+static uint32_t sky_minhash_context(const struct location_rq_t *creq) {
+    return sky_mix32(SKY_KEY(creq).partner_id * 31 + creq->payload_ext.payload.type);
+}
+
+// band key of the rows of the band
+static uint32_t sky_minhash_band(const uint32_t *signature, uint32_t band) {
+    uint32_t h = band;
+    uint32_t i;
+    for (i = 0; i < SKY_MINHASH_ROWS; i++)
+        h = sky_mix32(h ^ signature[band * SKY_MINHASH_ROWS + i]);
+    return h;
+}
+
+struct sky_minhash_t * sky_minhash_create(const struct sky_minhash_config_t *config) {
+    struct sky_minhash_t *index = calloc(1, sizeof(struct sky_minhash_t));
+    uint32_t capacity = SKY_MINHASH_SLOTS;
+    uint32_t i;
+
+    if (index == NULL) {
+        perror("calloc failed");
+        return NULL;
+    }
+    while (capacity < config->capacity)
+        capacity <<= 1;
+    index->mask = capacity - 1;
+    index->threshold = (config->threshold > 0) ? config->threshold : SKY_MINHASH_THRESHOLD;
+    index->min_aps = (config->min_aps > 0) ? config->min_aps : SKY_MINHASH_MIN_APS;
+    pthread_rwlock_init(&index->lock, NULL);
+
+    if ((index->entries = calloc(capacity, sizeof(struct sky_minhash_entry_t))) == NULL) {
+        perror("calloc failed");
+        sky_minhash_destroy(index);
+        return NULL;
+    }
+    for (i = 0; i < SKY_MINHASH_BANDS; i++) {
+        if ((index->buckets[i] = calloc(capacity, sizeof(struct sky_minhash_slot_t))) == NULL) {
+            perror("calloc failed");
+            sky_minhash_destroy(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+void sky_minhash_destroy(struct sky_minhash_t *index) {
+    uint32_t i;
+
+    if (index == NULL)
+        return;
+    for (i = 0; i < SKY_MINHASH_BANDS; i++)
+        free(index->buckets[i]);
+    free(index->entries);
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
+
+void sky_minhash_signature(const struct location_rq_t *creq, uint32_t *signature) {
+    sky_v16u32 sig;
+    uint32_t i, j;
+
+    memset(&sig, 0xFF, sizeof(sig));
+    for (i = 0; i < creq->ap_count; i++) {
+        uint64_t mac = 0;
+        for (j = 0; j < MAC_SIZE; j++)
+            mac = (mac << 8) | creq->aps[i].MAC[j];
+        uint32_t x = sky_mix32((uint32_t)mac ^ (uint32_t)(mac >> 32) * 0x9E3779B1);
+
+        // K hash functions of the MAC, and the minimum of each
+        sky_v16u32 h = (x ^ sky_minhash_seed) * sky_minhash_mul;
+        h ^= h >> 15;
+        h *= 0x2C1B3C6D;
+        h ^= h >> 12;
+        sky_v16u32 less = (sky_v16u32)(h < sig);
+        sig = (h & less) | (sig & ~less);
+    }
+    memcpy(signature, &sig, sizeof(sig));
+}
+
+float sky_minhash_similarity(const uint32_t *a, const uint32_t *b) {
+    uint32_t i, n = 0;
+    for (i = 0; i < SKY_MINHASH_K; i++)
+        n += (a[i] == b[i]);
+    return (float)n / SKY_MINHASH_K;
+}
+
+int32_t sky_minhash_lookup(struct sky_minhash_t *index, const struct location_rq_t *creq,
+        uint64_t *fingerprint) {
+    uint32_t signature[SKY_MINHASH_K];
+    uint32_t context = sky_minhash_context(creq);
+    uint32_t candidates = 0, best = 0;
+    float best_similarity = 0;
+    uint32_t band, i;
+
+    if (creq->ap_count < index->min_aps) {
+        __atomic_fetch_add(&index->stats.lookups, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&index->stats.misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    sky_minhash_signature(creq, signature);
+
+    pthread_rwlock_rdlock(&index->lock);
+    for (band = 0; band < SKY_MINHASH_BANDS; band++) {
+        uint32_t tag = sky_minhash_band(signature, band);
+        struct sky_minhash_slot_t *slot =
+                &index->buckets[band][(tag & index->mask) & ~(SKY_MINHASH_SLOTS - 1)];
+        for (i = 0; i < SKY_MINHASH_SLOTS; i++, slot++) {
+            if (slot->entry == 0 || slot->tag != tag || slot->entry == best)
+                continue;
+            struct sky_minhash_entry_t *e = &index->entries[slot->entry - 1];
+            if (e->tags[band] != tag || e->context != context)
+                continue; // the entry is replaced
+            candidates++;
+            float similarity = sky_minhash_similarity(signature, e->signature);
+            if (similarity > best_similarity) {
+                best_similarity = similarity;
+                best = slot->entry;
+            }
+        }
+    }
+    int32_t found = (best > 0 && best_similarity >= index->threshold);
+    if (found)
+        *fingerprint = index->entries[best - 1].fingerprint;
+    pthread_rwlock_unlock(&index->lock);
+
+    __atomic_fetch_add(&index->stats.lookups, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(found ? &index->stats.hits : &index->stats.misses, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&index->stats.candidates, candidates, __ATOMIC_RELAXED);
+    return found;
+}
+
+int32_t sky_minhash_put(struct sky_minhash_t *index, const struct location_rq_t *creq,
+        uint64_t fingerprint) {
+    uint32_t signature[SKY_MINHASH_K];
+    uint32_t tags[SKY_MINHASH_BANDS];
+    uint32_t band, i;
+
+    if (creq->ap_count < index->min_aps)
+        return -1;
+    sky_minhash_signature(creq, signature);
+    for (band = 0; band < SKY_MINHASH_BANDS; band++)
+        tags[band] = sky_minhash_band(signature, band);
+
+    pthread_rwlock_wrlock(&index->lock);
+    // FIFO replacement, the slots of the replaced entry become stale
+    uint32_t n = index->head;
+    index->head = (n + 1) & index->mask;
+    struct sky_minhash_entry_t *e = &index->entries[n];
+    memcpy(e->signature, signature, sizeof(signature));
+    memcpy(e->tags, tags, sizeof(tags));
+    e->fingerprint = fingerprint;
+    e->context = sky_minhash_context(creq);
+
+    for (band = 0; band < SKY_MINHASH_BANDS; band++) {
+        struct sky_minhash_slot_t *slots =
+                &index->buckets[band][(tags[band] & index->mask) & ~(SKY_MINHASH_SLOTS - 1)];
+        struct sky_minhash_slot_t *slot = NULL;
+        // an empty or stale slot, otherwise the slot of the oldest entry
+        uint32_t oldest = 0, age = 0;
+        for (i = 0; i < SKY_MINHASH_SLOTS && slot == NULL; i++) {
+            if (slots[i].entry == 0 || index->entries[slots[i].entry - 1].tags[band] != slots[i].tag)
+                slot = &slots[i];
+            else if (((n - (slots[i].entry - 1)) & index->mask) > age) {
+                age = (n - (slots[i].entry - 1)) & index->mask;
+                oldest = i;
+            }
+        }
+        if (slot == NULL)
+            slot = &slots[oldest];
+        slot->tag = tags[band];
+        slot->entry = n + 1;
+    }
+    index->stats.inserts++;
+    pthread_rwlock_unlock(&index->lock);
+    return 0;
+}
+
+void sky_minhash_set_threshold(struct sky_minhash_t *index, float threshold) {
+    pthread_rwlock_wrlock(&index->lock);
+    index->threshold = threshold;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+void sky_minhash_get_stats(struct sky_minhash_t *index, struct sky_minhash_stats_t *stats) {
+    pthread_rwlock_rdlock(&index->lock);
+    stats->lookups = __atomic_load_n(&index->stats.lookups, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&index->stats.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&index->stats.misses, __ATOMIC_RELAXED);
+    stats->candidates = __atomic_load_n(&index->stats.candidates, __ATOMIC_RELAXED);
+    stats->inserts = index->stats.inserts;
+    pthread_rwlock_unlock(&index->lock);
+}
@@ -0,0 +1,221 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "sky_internal.h"
+#include "sky_session.h"
+
+struct sky_session_entry_t {
+    uint64_t fingerprint;      // 0 if empty
+    uint32_t rq_id;            // request id of the last request of the device
+    uint32_t expires;          // seconds since epoch
+    uint16_t ap_count;
+    struct ap_t aps[MAX_APS];  // sorted by MAC
+};
+
+struct sky_session_shard_t {
+    pthread_mutex_t lock;
+    struct sky_session_entry_t *entries; // sets * SKY_SESSION_WAYS
+    struct sky_session_stats_t stats;
+} __attribute__((aligned(64)));
+
+struct sky_session_t {
+    struct sky_session_config_t config;
+    uint32_t shard_mask;
+    uint32_t set_mask;
+    struct sky_session_shard_t *shards;
+};
+
+static int32_t sky_cmp_mac(const void *a, const void *b) {
+    return memcmp(a, b, MAC_SIZE);
+}
+
+struct sky_session_t * sky_session_create(const struct sky_session_config_t *config) {
+    struct sky_session_t *session = calloc(1, sizeof(struct sky_session_t));
+    uint32_t i;
+
+    if (session == NULL) {
+        perror("calloc failed");
+        return NULL;
+    }
+    session->config = *config;
+    if (session->config.ttl == 0)
+        session->config.ttl = SKY_SESSION_TTL_DEFAULT;
+
+    uint32_t shards = config->shards;
+    uint32_t sets = sky_shard_sets(&shards, config->capacity, SKY_SESSION_WAYS);
+    session->config.shards = shards;
+    session->config.capacity = sets * shards * SKY_SESSION_WAYS;
+    session->shard_mask = shards - 1;
+    session->set_mask = sets - 1;
+
+    if ((session->shards = sky_shards_alloc(shards, sizeof(struct sky_session_shard_t))) == NULL) {
+        free(session);
+        return NULL;
+    }
+    for (i = 0; i < shards; i++) {
+        struct sky_session_shard_t *shard = &session->shards[i];
+        shard->entries = calloc(sets * SKY_SESSION_WAYS, sizeof(struct sky_session_entry_t));
+        if (shard->entries == NULL) {
+            perror("calloc failed");
+            sky_session_destroy(session);
+            return NULL;
+        }
+    }
+    return session;
+}
+
+void sky_session_destroy(struct sky_session_t *session) {
+    uint32_t i;
+
+    if (session == NULL)
+        return;
+    for (i = 0; i < session->config.shards; i++)
+        free(session->shards[i].entries);
+    sky_shards_free(session->shards, session->config.shards, sizeof(struct sky_session_shard_t));
+    free(session);
+}
+
+// fingerprint of the device: partner id and the first device MAC, never 0
+static uint64_t sky_session_fingerprint(const struct location_rq_t *creq) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    uint64_t mac = 0;
+    uint32_t i;
+
+    for (i = 0; i < MAC_SIZE; i++)
+        mac = (mac << 8) | creq->mac[i];
+    h = sky_mix64(h, SKY_KEY(creq).partner_id);
+    h = sky_mix64(h, mac);
+    return (h == 0) ? 1 : h;
+}
+
+static struct sky_session_shard_t * sky_session_shard(struct sky_session_t *session, uint64_t fingerprint) {
+    return &session->shards[(fingerprint >> 32) & session->shard_mask];
+}
+
+static struct sky_session_entry_t * sky_session_ways(struct sky_session_t *session,
+        struct sky_session_shard_t *shard, uint64_t fingerprint) {
+    uint32_t set = (uint32_t)fingerprint & session->set_mask;
+    return &shard->entries[set * SKY_SESSION_WAYS];
+}
+
+int32_t sky_session_apply(struct sky_session_t *session, struct location_rq_t *creq,
+        struct ap_t *aps, uint32_t max_aps) {
+    struct sky_session_entry_t *e = NULL;
+    uint32_t i = 0, j = 0, r = 0, n = 0;
+
+    if (creq->base_id == 0)
+        return 1;
+    if (creq->mac_count == 0)
+        return -1;
+    if (creq->ap_count > 0)
+        qsort(creq->aps, creq->ap_count, sizeof(struct ap_t), sky_cmp_ap_mac);
+    if (creq->removed_count > 0)
+        qsort(creq->removed, creq->removed_count, MAC_SIZE, sky_cmp_mac);
+
+    uint64_t fingerprint = sky_session_fingerprint(creq);
+    struct sky_session_shard_t *shard = sky_session_shard(session, fingerprint);
+    struct sky_session_entry_t *ways = sky_session_ways(session, shard, fingerprint);
+    uint32_t now = sky_now_sec();
+
+    pthread_mutex_lock(&shard->lock);
+    for (i = 0; i < SKY_SESSION_WAYS && e == NULL; i++)
+        if (ways[i].fingerprint == fingerprint && ways[i].rq_id == creq->base_id && ways[i].expires > now)
+            e = &ways[i];
+    if (e == NULL) {
+        shard->stats.misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    // merge of the sorted base and delta, without the removed MACs
+    i = 0;
+    while ((i < e->ap_count || j < creq->ap_count) && n < max_aps) {
+        int32_t cmp;
+        if (i == e->ap_count)
+            cmp = 1;
+        else if (j == creq->ap_count)
+            cmp = -1;
+        else
+            cmp = memcmp(e->aps[i].MAC, creq->aps[j].MAC, MAC_SIZE);
+        if (cmp < 0) {
+            while (r < creq->removed_count && memcmp(creq->removed + r * MAC_SIZE, e->aps[i].MAC, MAC_SIZE) < 0)
+                r++;
+            if (r < creq->removed_count && memcmp(creq->removed + r * MAC_SIZE, e->aps[i].MAC, MAC_SIZE) == 0)
+                i++;
+            else
+                aps[n++] = e->aps[i++];
+        } else {
+            if (cmp == 0)
+                i++; // changed
+            aps[n++] = creq->aps[j++];
+        }
+    }
+    shard->stats.hits++;
+    pthread_mutex_unlock(&shard->lock);
+
+    creq->aps = aps;
+    creq->ap_count = n;
+    creq->base_id = 0;
+    creq->removed_count = 0;
+    creq->removed = NULL;
+    return 0;
+}
+
+int32_t sky_session_put(struct sky_session_t *session, const struct location_rq_t *creq) {
+    struct sky_session_entry_t *e = NULL;
+    struct ap_t sorted[MAX_APS];
+    uint32_t i;
+
+    if (creq->rq_id == 0 || creq->mac_count == 0 || creq->ap_count > MAX_APS)
+        return -1;
+    if (creq->ap_count > 0) {
+        memcpy(sorted, creq->aps, creq->ap_count * sizeof(struct ap_t));
+        qsort(sorted, creq->ap_count, sizeof(struct ap_t), sky_cmp_ap_mac);
+    }
+
+    uint64_t fingerprint = sky_session_fingerprint(creq);
+    struct sky_session_shard_t *shard = sky_session_shard(session, fingerprint);
+    struct sky_session_entry_t *ways = sky_session_ways(session, shard, fingerprint);
+    uint32_t now = sky_now_sec();
+
+    pthread_mutex_lock(&shard->lock);
+    // the same device, then an empty or expired way, then the one expiring first
+    for (i = 0; i < SKY_SESSION_WAYS && e == NULL; i++)
+        if (ways[i].fingerprint == fingerprint)
+            e = &ways[i];
+    for (i = 0; i < SKY_SESSION_WAYS && e == NULL; i++)
+        if (ways[i].fingerprint == 0 || ways[i].expires <= now)
+            e = &ways[i];
+    if (e == NULL) {
+        e = &ways[0];
+        for (i = 1; i < SKY_SESSION_WAYS; i++)
+            if (ways[i].expires < e->expires)
+                e = &ways[i];
+    }
+
+    if (e->fingerprint == 0)
+        shard->stats.entries++;
+    else if (e->fingerprint != fingerprint && e->expires > now)
+        shard->stats.evictions++;
+    e->fingerprint = fingerprint;
+    e->rq_id = creq->rq_id;
+    e->expires = now + session->config.ttl;
+    e->ap_count = creq->ap_count;
+    memcpy(e->aps, sorted, creq->ap_count * sizeof(struct ap_t));
+    shard->stats.inserts++;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+void sky_session_get_stats(struct sky_session_t *session, struct sky_session_stats_t *stats) {
+    sky_shards_stats(session->shards, session->config.shards, sizeof(struct sky_session_shard_t),
+            offsetof(struct sky_session_shard_t, stats), stats, sizeof(*stats));
+}
@@ -0,0 +1,313 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sky_internal.h"
+#include "sky_cache.h"
+#include "sky_shmcache.h"
+
+#define SKY_SHMCACHE_MAGIC      0x53484B53 // "SKHS"
+#define SKY_SHMCACHE_VERSION    3
+#define SKY_SHMCACHE_RETRIES    16  // reads of a slot being written
+#define SKY_SHMCACHE_WAIT       100 // ms to wait for the creator of the segment
+
+struct sky_shmcache_header_t {
+    uint32_t magic;            // stored last by the creator
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t ttl;
+} __attribute__((aligned(64)));
+
+struct sky_shmcache_slot_t {
+    uint64_t lock;             // sequence number, odd while written, and the pid of the writer above
+    uint64_t fingerprint;      // 0 if empty
+    struct location_t location;
+    uint32_t expires;          // seconds since epoch
+    uint8_t type;              // response payload type
+    uint8_t unused;
+    uint16_t addr_len;         // 0 if none
+    uint8_t addr[SKY_SHMCACHE_ADDR_MAX];
+} __attribute__((aligned(64)));
+
+struct sky_shmcache_t {
+    struct sky_shmcache_header_t *header;
+    struct sky_shmcache_slot_t *slots;
+    size_t size;
+    uint32_t set_mask;
+    uint32_t ttl;
+    struct sky_shmcache_stats_t stats;
+};
+
+static void sky_shmcache_count(uint64_t *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+struct sky_shmcache_t * sky_shmcache_open(const char *name, const struct sky_shmcache_config_t *config) {
+    struct sky_shmcache_t *cache;
+    struct stat st;
+    uint32_t slots = SKY_SHMCACHE_WAYS;
+    uint32_t i;
+    int fd;
+
+    if (sizeof(struct sky_shmcache_slot_t) != SKY_SHMCACHE_SLOT_SIZE) {
+        fprintf(stderr, "slot size mismatch\n");
+        return NULL;
+    }
+    while (slots < config->capacity)
+        slots <<= 1;
+
+    // the creator sizes the segment, which is zero filled: all the slots are empty
+    int32_t creator = 1;
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0) {
+            perror("shm_open failed");
+            return NULL;
+        }
+        creator = 0;
+    }
+    if (creator && ftruncate(fd, sizeof(struct sky_shmcache_header_t)
+            + (size_t)slots * sizeof(struct sky_shmcache_slot_t)) != 0) {
+        perror("ftruncate failed");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    for (i = 0; ; i++) {
+        if (fstat(fd, &st) != 0) {
+            perror("fstat failed");
+            close(fd);
+            return NULL;
+        }
+        if ((size_t)st.st_size > sizeof(struct sky_shmcache_header_t))
+            break;
+        if (i == SKY_SHMCACHE_WAIT) {
+            fprintf(stderr, "shared memory segment not created\n");
+            close(fd);
+            return NULL;
+        }
+        usleep(1000);
+    }
+
+    if ((cache = calloc(1, sizeof(struct sky_shmcache_t))) == NULL) {
+        perror("calloc failed");
+        close(fd);
+        return NULL;
+    }
+    cache->size = st.st_size;
+    cache->header = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache->header == MAP_FAILED) {
+        perror("mmap failed");
+        if (creator)
+            shm_unlink(name);
+        free(cache);
+        return NULL;
+    }
+    cache->slots = (struct sky_shmcache_slot_t *)(cache->header + 1);
+
+    struct sky_shmcache_header_t *header = cache->header;
+    if (creator) {
+        header->version = SKY_SHMCACHE_VERSION;
+        header->slots = slots;
+        header->slot_size = SKY_SHMCACHE_SLOT_SIZE;
+        header->ttl = (config->ttl > 0) ? config->ttl : SKY_SHMCACHE_TTL_DEFAULT;
+        __atomic_store_n(&header->magic, SKY_SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        for (i = 0; __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SKY_SHMCACHE_MAGIC; i++) {
+            if (i == SKY_SHMCACHE_WAIT) {
+                fprintf(stderr, "shared memory segment not initialized\n");
+                sky_shmcache_close(cache);
+                return NULL;
+            }
+            usleep(1000);
+        }
+        if (header->version != SKY_SHMCACHE_VERSION || header->slot_size != SKY_SHMCACHE_SLOT_SIZE
+                || sizeof(struct sky_shmcache_header_t)
+                        + (size_t)header->slots * sizeof(struct sky_shmcache_slot_t) > cache->size) {
+            fprintf(stderr, "shared memory segment mismatch\n");
+            sky_shmcache_close(cache);
+            return NULL;
+        }
+    }
+    cache->set_mask = header->slots / SKY_SHMCACHE_WAYS - 1;
+    cache->ttl = header->ttl;
+    return cache;
+}
+
+void sky_shmcache_close(struct sky_shmcache_t *cache) {
+    if (cache == NULL)
+        return;
+    munmap(cache->header, cache->size);
+    free(cache);
+}
+
+int32_t sky_shmcache_unlink(const char *name) {
+    if (shm_unlink(name) != 0) {
+        perror("shm_unlink failed");
+        return -1;
+    }
+    return 0;
+}
+
+// copies a consistent slot into copy
+// returns 1, or 0 if it was written by every retry
+static int32_t sky_shmcache_read(struct sky_shmcache_t *cache, const struct sky_shmcache_slot_t *slot,
+        struct sky_shmcache_slot_t *copy) {
+    uint32_t i;
+
+    for (i = 0; i < SKY_SHMCACHE_RETRIES; i++) {
+        uint32_t seq = (uint32_t)__atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+        if ((seq & 1) == 0) {
+            memcpy(copy, slot, sizeof(*copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if ((uint32_t)__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == seq)
+                return 1;
+        }
+        sky_shmcache_count(&cache->stats.retries);
+    }
+    return 0;
+}
+
+// claims slot for this process, a slot not being written or, if stale, only
+// a slot left odd by a writer that died
+// returns the odd sequence number of the claim, or 0 if another writer has it
+static uint32_t sky_shmcache_claim(struct sky_shmcache_t *cache, struct sky_shmcache_slot_t *slot,
+        int32_t stale) {
+    uint64_t lock = __atomic_load_n(&slot->lock, __ATOMIC_RELAXED);
+    uint32_t seq = (uint32_t)lock;
+    pid_t owner = (pid_t)(lock >> 32);
+
+    if ((seq & 1) == 0) {
+        if (stale)
+            return 0;
+        seq += 1;
+    } else {
+        if (owner > 0 && (kill(owner, 0) == 0 || errno != ESRCH))
+            return 0;
+        seq += 2;
+    }
+    // the pid is stored with the sequence number, a live writer is never reclaimed
+    if (!__atomic_compare_exchange_n(&slot->lock, &lock, ((uint64_t)getpid() << 32) | seq, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    // the slot stores are not seen before the odd sequence number
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (lock & 1)
+        sky_shmcache_count(&cache->stats.reclaimed);
+    return seq;
+}
+
+static void sky_shmcache_release(struct sky_shmcache_slot_t *slot, uint32_t seq) {
+    __atomic_store_n(&slot->lock, (uint64_t)(seq + 1), __ATOMIC_RELEASE);
+}
+
+int32_t sky_shmcache_get(struct sky_shmcache_t *cache, uint64_t fingerprint,
+        struct location_rsp_t *cresp, char *buff, uint32_t buff_len) {
+    struct sky_shmcache_slot_t *ways = &cache->slots[((uint32_t)fingerprint & cache->set_mask) * SKY_SHMCACHE_WAYS];
+    struct sky_shmcache_slot_t copy;
+    uint32_t now = sky_now_sec();
+    uint32_t i, seq;
+
+    for (i = 0; i < SKY_SHMCACHE_WAYS; i++) {
+        if (__atomic_load_n(&ways[i].fingerprint, __ATOMIC_RELAXED) != fingerprint)
+            continue;
+        if (!sky_shmcache_read(cache, &ways[i], &copy)) {
+            // empty the slot of a writer that died, the next lookups do not retry it
+            if ((seq = sky_shmcache_claim(cache, &ways[i], 1)) != 0) {
+                ways[i].fingerprint = 0;
+                ways[i].expires = 0;
+                ways[i].addr_len = 0;
+                sky_shmcache_release(&ways[i], seq);
+            }
+            break;
+        }
+        if (copy.fingerprint != fingerprint || copy.expires <= now)
+            break;
+        if (copy.addr_len > buff_len) {
+            perror("buffer too small");
+            break;
+        }
+        cresp->payload_ext.payload.type = copy.type;
+        cresp->location = copy.location;
+        sky_addr_unpack(&cresp->location_ext, copy.addr, copy.addr_len, buff);
+        sky_shmcache_count(&cache->stats.hits);
+        return 1;
+    }
+    sky_shmcache_count(&cache->stats.misses);
+    return 0;
+}
+
+int32_t sky_shmcache_put(struct sky_shmcache_t *cache, uint64_t fingerprint,
+        const struct location_rsp_t *cresp) {
+    uint8_t type = cresp->payload_ext.payload.type;
+    uint32_t addr_len = 0;
+    uint32_t now = sky_now_sec();
+    uint32_t i;
+
+    if (type != LOCATION_RQ_SUCCESS && type != LOCATION_RQ_ADDR_SUCCESS)
+        return -1;
+    if (type == LOCATION_RQ_ADDR_SUCCESS) {
+        addr_len = sky_addr_packed_len(&cresp->location_ext);
+        if (addr_len > SKY_SHMCACHE_ADDR_MAX)
+            return -1; // does not fit a slot
+    }
+
+    // the same fingerprint, then an empty or expired slot, then the slot expiring first
+    struct sky_shmcache_slot_t *ways = &cache->slots[((uint32_t)fingerprint & cache->set_mask) * SKY_SHMCACHE_WAYS];
+    struct sky_shmcache_slot_t *slot = NULL;
+    for (i = 0; i < SKY_SHMCACHE_WAYS && slot == NULL; i++)
+        if (__atomic_load_n(&ways[i].fingerprint, __ATOMIC_RELAXED) == fingerprint)
+            slot = &ways[i];
+    for (i = 0; i < SKY_SHMCACHE_WAYS && slot == NULL; i++)
+        if (__atomic_load_n(&ways[i].fingerprint, __ATOMIC_RELAXED) == 0
+                || __atomic_load_n(&ways[i].expires, __ATOMIC_RELAXED) <= now)
+            slot = &ways[i];
+    if (slot == NULL) {
+        slot = &ways[0];
+        for (i = 1; i < SKY_SHMCACHE_WAYS; i++)
+            if (__atomic_load_n(&ways[i].expires, __ATOMIC_RELAXED)
+                    < __atomic_load_n(&slot->expires, __ATOMIC_RELAXED))
+                slot = &ways[i];
+    }
+
+    uint32_t seq = sky_shmcache_claim(cache, slot, 0);
+    if (seq == 0) {
+        sky_shmcache_count(&cache->stats.contended);
+        return -1;
+    }
+    if (slot->fingerprint != 0 && slot->fingerprint != fingerprint && slot->expires > now)
+        sky_shmcache_count(&cache->stats.evictions);
+    slot->fingerprint = fingerprint;
+    slot->expires = now + cache->ttl;
+    slot->location = cresp->location;
+    slot->type = type;
+    slot->addr_len = (uint16_t)addr_len;
+    if (addr_len > 0)
+        sky_addr_pack(&cresp->location_ext, slot->addr);
+    sky_shmcache_release(slot, seq);
+
+    sky_shmcache_count(&cache->stats.inserts);
+    return 0;
+}
+
+void sky_shmcache_get_stats(struct sky_shmcache_t *cache, struct sky_shmcache_stats_t *stats) {
+    stats->hits = __atomic_load_n(&cache->stats.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cache->stats.misses, __ATOMIC_RELAXED);
+    stats->inserts = __atomic_load_n(&cache->stats.inserts, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&cache->stats.evictions, __ATOMIC_RELAXED);
+    stats->contended = __atomic_load_n(&cache->stats.contended, __ATOMIC_RELAXED);
+    stats->retries = __atomic_load_n(&cache->stats.retries, __ATOMIC_RELAXED);
+    stats->reclaimed = __atomic_load_n(&cache->stats.reclaimed, __ATOMIC_RELAXED);
+}
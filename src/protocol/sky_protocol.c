@@ -13,6 +13,8 @@
 #include <float.h>
 #include "sky_crypt.h"
 #include "sky_protocol.h"
+#include "sky_internal.h"
+#include "sky_util.h"
 
 // set the flag of an access point to claim the device is currently connected
 inline
@@ -59,6 +61,18 @@ uint8_t pad_16(uint32_t num) {
     return (residual_16 == 0) ? 0 : (~residual_16 & 0X0F) + 1;
 }
 
+// Return true if the packet is sealed by AES-GCM instead of checksum and CBC.
+inline
+bool sky_is_aead(uint8_t version) {
+    return version == SKY_PROTOCOL_VERSION_AEAD;
+}
+
+// Return the length of the checksum or authentication tag after the payload.
+inline
+uint32_t sky_trailer_len(uint8_t version) {
+    return sky_is_aead(version) ? SKY_AEAD_TAG_SIZE : sizeof(sky_checksum_t);
+}
+
 // Return data entry by parameter "sky_entry & entry".
 inline
 bool adjust_data_entry(const uint8_t * buff, uint32_t buff_len, uint32_t offset, sky_entry_ext_t * p_entry) {
@@ -72,6 +86,37 @@ bool adjust_data_entry(const uint8_t * buff, uint32_t buff_len, uint32_t offset,
     return true;
 }
 
+// Set the type and count of the entry in buffer, in the extended form if the
+// count does not fit a byte, the data follows the high byte of the count.
+inline
+void sky_set_entry(sky_entry_ext_t * p_entry, uint8_t data_type, uint32_t count) {
+    p_entry->entry->data_type = data_type;
+    p_entry->entry->data_type_count = (uint8_t)count;
+    if (count > UINT8_MAX) {
+        p_entry->entry->data_type |= SKY_ENTRY_EXT;
+        *p_entry->data++ = (uint8_t)(count >> 8);
+    }
+}
+
+// Return the count of the entry in buffer, the data of an extended entry
+// follows the high byte of the count.
+inline
+uint32_t sky_get_entry_count(sky_entry_ext_t * p_entry) {
+    uint32_t count = p_entry->entry->data_type_count;
+    if (p_entry->entry->data_type & SKY_ENTRY_EXT)
+        count |= (uint32_t)*p_entry->data++ << 8;
+    return count;
+}
+
+// Return true if the entry at offset in the payload, the high byte of the count
+// of an extended entry and sz bytes of data end within the payload and buffer.
+inline
+bool sky_entry_fits(const uint8_t * buff, uint32_t buff_len, const sky_entry_ext_t * p_entry,
+        uint32_t offset, uint32_t payload_len, uint32_t sz) {
+    uint32_t len = sizeof(sky_entry_t) + ((p_entry->entry->data_type & SKY_ENTRY_EXT) ? 1 : 0) + sz;
+    return offset + len <= payload_len && (const uint8_t *)p_entry->entry + len <= buff + buff_len;
+}
+
 inline
 void sky_header_endian_swap(uint8_t * p_header, uint32_t header_len) {
     assert(p_header != NULL);
@@ -161,31 +206,51 @@ void sky_location_endian_swap(struct location_t * p) {
     SKY_ENDIAN_SWAP(p->distance_to_point);
 }
 
-inline
+// scan limits, set at startup by sky_set_limits
+static struct sky_limits_t sky_limits = { MAX_MACS, MAX_IPS, MAX_APS, MAX_GPSS, MAX_CELLS, MAX_BLES };
+
+void sky_set_limits(const struct sky_limits_t * limits) {
+    sky_limits.max_macs = (limits->max_macs < MAX_MACS) ? limits->max_macs : MAX_MACS;
+    sky_limits.max_ips = (limits->max_ips < MAX_IPS) ? limits->max_ips : MAX_IPS;
+    sky_limits.max_aps = (limits->max_aps < MAX_APS) ? limits->max_aps : MAX_APS;
+    sky_limits.max_gpss = (limits->max_gpss < MAX_GPSS) ? limits->max_gpss : MAX_GPSS;
+    sky_limits.max_cells = (limits->max_cells < MAX_CELLS) ? limits->max_cells : MAX_CELLS;
+    sky_limits.max_bles = (limits->max_bles < MAX_BLES) ? limits->max_bles : MAX_BLES;
+}
+
+void sky_get_limits(struct sky_limits_t * limits) {
+    *limits = sky_limits;
+}
+
+static inline
 bool check_rq_max_counts(const struct location_rq_t * p_rq) {
-    if (p_rq->mac_count > MAX_MACS) {
-        perror("Too big: mac_count > MAX_MACS");
+    if (p_rq->mac_count > sky_limits.max_macs) {
+        perror("Too big: mac_count > max_macs");
+        return false;
+    }
+    if (p_rq->ip_count > sky_limits.max_ips) {
+        perror("Too big: ip_count > max_ips");
         return false;
     }
-    if (p_rq->ip_count > MAX_IPS) {
-        perror("Too big: ip_count > MAX_IPS");
+    if (p_rq->ap_count > sky_limits.max_aps) {
+        perror("Too big: ap_count > max_aps");
         return false;
     }
-    if (p_rq->ap_count > MAX_APS) {
-        perror("Too big: ap_count > MAX_APS");
+    if (p_rq->ap_count + p_rq->removed_count > sky_limits.max_aps) {
+        perror("Too big: ap_count + removed_count > max_aps");
         return false;
     }
-    if (p_rq->cell_count > MAX_CELLS) {
-        perror("Too big: cell_count > MAX_CELLS");
+    if (p_rq->cell_count > sky_limits.max_cells) {
+        perror("Too big: cell_count > max_cells");
         return false;
     }
-    if (p_rq->gps_count > MAX_GPSS) {
-        perror("Too big: gps_count > MAX_GPSS");
+    if (p_rq->gps_count > sky_limits.max_gpss) {
+        perror("Too big: gps_count > max_gpss");
         return false;
     }
-    if (p_rq->ble_count > MAX_BLES) {
-        perror("Too big: ble_count > MAX_BLES");
-        return false;;
+    if (p_rq->ble_count > sky_limits.max_bles) {
+        perror("Too big: ble_count > max_bles");
+        return false;
     }
     return true;
 }
@@ -305,125 +370,1015 @@ uint32_t sky_get_partner_id_from_rq_header(uint8_t *buff, uint32_t buff_len) {
     return 0;
 }
 
-// received by the server from the client
-/* decode binary data from client, result is in the location_req_t struct */
-/* binary encoded data in buff from client with data */
-int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
-        struct location_rq_t *creq) {
+//
+// compact binary protocol, SKY_PROTOCOL_VERSION_COMPACT
+// format description in sky_protocol.h
+//
+
+// write or read position in buffer
+// a put cursor with p NULL only counts the bytes
+typedef struct {
+    uint8_t * p;               // current position
+    uint8_t * end;             // end of buffer
+    uint32_t count;            // bytes put if p is NULL
+} sky_cursor_t;
+
+static inline
+bool sky_put_bytes(sky_cursor_t * c, const void * data, uint32_t len) {
+    if (c->p == NULL) {
+        c->count += len;
+        return true;
+    }
+    if (c->p + len > c->end)
+        return false;
+    memcpy(c->p, data, len);
+    c->p += len;
+    return true;
+}
 
-    memset(&creq->header, 0, sizeof(creq->header));
-    if (!sky_get_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+static inline
+bool sky_put_u8(sky_cursor_t * c, uint8_t v) {
+    if (c->p == NULL) {
+        c->count++;
+        return true;
+    }
+    if (c->p >= c->end)
+        return false;
+    *c->p++ = v;
+    return true;
+}
+
+// unsigned LEB128
+static inline
+bool sky_put_varint(sky_cursor_t * c, uint32_t v) {
+    while (v >= 0x80) {
+        if (!sky_put_u8(c, (uint8_t)(v | 0x80)))
+            return false;
+        v >>= 7;
+    }
+    return sky_put_u8(c, (uint8_t)v);
+}
+
+// zigzag encoded signed varint
+static inline
+bool sky_put_svarint(sky_cursor_t * c, int32_t v) {
+    return sky_put_varint(c, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+static inline
+bool sky_get_bytes(sky_cursor_t * c, void * data, uint32_t len) {
+    if (c->p + len > c->end)
+        return false;
+    memcpy(data, c->p, len);
+    c->p += len;
+    return true;
+}
+
+static inline
+bool sky_get_u8(sky_cursor_t * c, uint8_t * v) {
+    if (c->p >= c->end)
+        return false;
+    *v = *c->p++;
+    return true;
+}
+
+static inline
+bool sky_get_varint(sky_cursor_t * c, uint32_t * v) {
+    uint32_t shift;
+    uint8_t b;
+    *v = 0;
+    for (shift = 0; shift < 35; shift += 7) {
+        if (!sky_get_u8(c, &b))
+            return false;
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+    return false; // more than 5 bytes
+}
+
+static inline
+bool sky_get_svarint(sky_cursor_t * c, int32_t * v) {
+    uint32_t u;
+    if (!sky_get_varint(c, &u))
+        return false;
+    *v = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+    return true;
+}
+
+static inline
+bool sky_get_varint16(sky_cursor_t * c, uint16_t * v) {
+    uint32_t u;
+    if (!sky_get_varint(c, &u) || u > USHRT_MAX)
+        return false;
+    *v = (uint16_t)u;
+    return true;
+}
+
+// round to the nearest integer in the int32_t range, without linking libm
+static inline
+int32_t sky_round(double v) {
+    if (v >= INT_MAX)
+        return INT_MAX;
+    if (v <= INT_MIN)
+        return INT_MIN;
+    return (int32_t)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+// degrees quantized to 10^-7 (about 1 cm)
+static inline
+bool sky_put_deg(sky_cursor_t * c, double deg) {
+    if (deg < -180.0 || deg > 180.0)
+        deg = 0;
+    return sky_put_svarint(c, sky_round(deg * 1E7));
+}
+
+static inline
+bool sky_get_deg(sky_cursor_t * c, double * deg) {
+    int32_t v;
+    if (!sky_get_svarint(c, &v))
+        return false;
+    *deg = v / 1E7;
+    return true;
+}
+
+// non negative float quantized to 1 / scale
+static inline
+uint32_t sky_quantize(float v, float scale) {
+    if (v <= 0)
+        return 0;
+    return (uint32_t)sky_round((double)v * scale);
+}
+
+static inline
+bool sky_put_compact_entry(sky_cursor_t * c, uint8_t data_type, uint32_t count) {
+    if (count > UINT8_MAX) {
+        sky_entry_t entry = { (uint8_t)(data_type | SKY_ENTRY_EXT), (uint8_t)count };
+        return sky_put_bytes(c, &entry, sizeof(entry)) && sky_put_u8(c, (uint8_t)(count >> 8));
+    }
+    sky_entry_t entry = { data_type, (uint8_t)count };
+    return sky_put_bytes(c, &entry, sizeof(entry));
+}
+
+static inline
+bool sky_put_compact_aps(sky_cursor_t * c, const struct ap_t * aps, uint32_t count) {
+    struct ap_t sorted[MAX_APS];
+    const uint8_t * prev = NULL;
+    uint32_t i;
+
+    if (count > MAX_APS)
+        return false;
+    // sorted by MAC to share the longest prefixes
+    memcpy(sorted, aps, count * sizeof(struct ap_t));
+    qsort(sorted, count, sizeof(struct ap_t), sky_cmp_ap_mac);
+    for (i = 0; i < count; i++) {
+        uint8_t shared = 0;
+        if (prev != NULL)
+            while (shared < MAC_SIZE && sorted[i].MAC[shared] == prev[shared])
+                shared++;
+        if (!sky_put_u8(c, (uint8_t)(shared << 4) | (sorted[i].flag & 0x0F))
+                || !sky_put_bytes(c, sorted[i].MAC + shared, MAC_SIZE - shared)
+                || !sky_put_u8(c, (uint8_t)sorted[i].rssi))
+            return false;
+        prev = sorted[i].MAC;
+    }
+    return true;
+}
+
+static inline
+bool sky_get_compact_aps(sky_cursor_t * c, struct ap_t * aps, uint32_t count) {
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        uint8_t b;
+        if (!sky_get_u8(c, &b))
+            return false;
+        uint8_t shared = b >> 4;
+        if (shared > MAC_SIZE || (i == 0 && shared > 0))
+            return false;
+        if (shared > 0)
+            memcpy(aps[i].MAC, aps[i - 1].MAC, shared);
+        aps[i].flag = b & 0x0F;
+        if (!sky_get_bytes(c, aps[i].MAC + shared, MAC_SIZE - shared)
+                || !sky_get_u8(c, (uint8_t *)&aps[i].rssi))
+            return false;
+    }
+    return true;
+}
+
+// gsm and umts have the same layout
+static inline
+bool sky_put_compact_gsm(sky_cursor_t * c, const struct gsm_t * gsm) {
+    return sky_put_varint(c, gsm->ci) && sky_put_varint(c, gsm->age)
+            && sky_put_varint(c, gsm->mcc) && sky_put_varint(c, gsm->mnc)
+            && sky_put_varint(c, gsm->lac) && sky_put_u8(c, (uint8_t)gsm->rssi);
+}
+
+static inline
+bool sky_get_compact_gsm(sky_cursor_t * c, struct gsm_t * gsm) {
+    memset(gsm, 0, sizeof(*gsm));
+    return sky_get_varint(c, &gsm->ci) && sky_get_varint(c, &gsm->age)
+            && sky_get_varint16(c, &gsm->mcc) && sky_get_varint16(c, &gsm->mnc)
+            && sky_get_varint16(c, &gsm->lac) && sky_get_u8(c, (uint8_t *)&gsm->rssi);
+}
+
+static inline
+bool sky_put_compact_cdma(sky_cursor_t * c, const struct cdma_t * cdma) {
+    return sky_put_deg(c, cdma->lat) && sky_put_deg(c, cdma->lon)
+            && sky_put_varint(c, cdma->age) && sky_put_varint(c, cdma->sid)
+            && sky_put_varint(c, cdma->nid) && sky_put_varint(c, cdma->bsid)
+            && sky_put_u8(c, (uint8_t)cdma->rssi);
+}
+
+static inline
+bool sky_get_compact_cdma(sky_cursor_t * c, struct cdma_t * cdma) {
+    memset(cdma, 0, sizeof(*cdma));
+    return sky_get_deg(c, &cdma->lat) && sky_get_deg(c, &cdma->lon)
+            && sky_get_varint(c, &cdma->age) && sky_get_varint16(c, &cdma->sid)
+            && sky_get_varint16(c, &cdma->nid) && sky_get_varint16(c, &cdma->bsid)
+            && sky_get_u8(c, (uint8_t *)&cdma->rssi);
+}
+
+static inline
+bool sky_put_compact_lte(sky_cursor_t * c, const struct lte_t * lte) {
+    return sky_put_varint(c, lte->age) && sky_put_varint(c, lte->eucid)
+            && sky_put_varint(c, lte->mcc) && sky_put_varint(c, lte->mnc)
+            && sky_put_u8(c, (uint8_t)lte->rssi);
+}
+
+static inline
+bool sky_get_compact_lte(sky_cursor_t * c, struct lte_t * lte) {
+    memset(lte, 0, sizeof(*lte));
+    return sky_get_varint(c, &lte->age) && sky_get_varint(c, &lte->eucid)
+            && sky_get_varint16(c, &lte->mcc) && sky_get_varint16(c, &lte->mnc)
+            && sky_get_u8(c, (uint8_t *)&lte->rssi);
+}
+
+// bits of the gps attribute presence byte
+#define GPS_HAS_LATLON  (1 << 0)
+#define GPS_HAS_HDOP    (1 << 1)
+#define GPS_HAS_HPE     (1 << 2)
+#define GPS_HAS_ALT     (1 << 3)
+#define GPS_HAS_SPEED   (1 << 4)
+#define GPS_HAS_AGE     (1 << 5)
+
+static inline
+bool sky_put_compact_gps(sky_cursor_t * c, const struct gps_t * gps) {
+    uint8_t has = 0;
+    if (gps->lat != DBL_MAX && gps->lon != DBL_MAX)
+        has |= GPS_HAS_LATLON;
+    if (gps->hdop != -1)
+        has |= GPS_HAS_HDOP;
+    if (gps->hpe != -1)
+        has |= GPS_HAS_HPE;
+    if (gps->alt != FLT_MAX)
+        has |= GPS_HAS_ALT;
+    if (gps->speed != -1)
+        has |= GPS_HAS_SPEED;
+    if (gps->age != UINT_MAX)
+        has |= GPS_HAS_AGE;
+
+    if (!sky_put_u8(c, has) || !sky_put_u8(c, gps->nsat) || !sky_put_u8(c, gps->fix))
+        return false;
+    if ((has & GPS_HAS_LATLON) && !(sky_put_deg(c, gps->lat) && sky_put_deg(c, gps->lon)))
+        return false;
+    if ((has & GPS_HAS_HDOP) && !sky_put_varint(c, sky_quantize(gps->hdop, 10)))
+        return false;
+    if ((has & GPS_HAS_HPE) && !sky_put_varint(c, sky_quantize(gps->hpe, 1)))
+        return false;
+    if ((has & GPS_HAS_ALT) && !sky_put_svarint(c, sky_round(gps->alt * 10)))
+        return false;
+    if ((has & GPS_HAS_SPEED) && !sky_put_varint(c, sky_quantize(gps->speed, 10)))
+        return false;
+    if ((has & GPS_HAS_AGE) && !sky_put_varint(c, gps->age))
+        return false;
+    return true;
+}
+
+static inline
+bool sky_get_compact_gps(sky_cursor_t * c, struct gps_t * gps) {
+    uint8_t has;
+    uint32_t u;
+    int32_t s;
+
+    memset(gps, 0, sizeof(*gps));
+    sky_init_gps_attrib(gps);
+    if (!sky_get_u8(c, &has) || !sky_get_u8(c, &gps->nsat) || !sky_get_u8(c, &gps->fix))
+        return false;
+    if ((has & GPS_HAS_LATLON) && !(sky_get_deg(c, &gps->lat) && sky_get_deg(c, &gps->lon)))
+        return false;
+    if (has & GPS_HAS_HDOP) {
+        if (!sky_get_varint(c, &u))
+            return false;
+        gps->hdop = u / 10.0f;
+    }
+    if (has & GPS_HAS_HPE) {
+        if (!sky_get_varint(c, &u))
+            return false;
+        gps->hpe = (float)u;
+    }
+    if (has & GPS_HAS_ALT) {
+        if (!sky_get_svarint(c, &s))
+            return false;
+        gps->alt = s / 10.0f;
+    }
+    if (has & GPS_HAS_SPEED) {
+        if (!sky_get_varint(c, &u))
+            return false;
+        gps->speed = u / 10.0f;
+    }
+    if ((has & GPS_HAS_AGE) && !sky_get_varint(c, &gps->age))
+        return false;
+    return true;
+}
+
+static inline
+bool sky_put_compact_ble(sky_cursor_t * c, const struct ble_t * ble) {
+    uint8_t major[2] = { ble->major & 0xFF, ble->major >> 8 };
+    uint8_t minor[2] = { ble->minor & 0xFF, ble->minor >> 8 };
+    return sky_put_bytes(c, major, 2) && sky_put_bytes(c, minor, 2)
+            && sky_put_bytes(c, ble->MAC, MAC_SIZE) && sky_put_bytes(c, ble->uuid, 16)
+            && sky_put_u8(c, (uint8_t)ble->rssi);
+}
+
+static inline
+bool sky_get_compact_ble(sky_cursor_t * c, struct ble_t * ble) {
+    uint8_t major[2], minor[2];
+    memset(ble, 0, sizeof(*ble));
+    if (!(sky_get_bytes(c, major, 2) && sky_get_bytes(c, minor, 2)
+            && sky_get_bytes(c, ble->MAC, MAC_SIZE) && sky_get_bytes(c, ble->uuid, 16)
+            && sky_get_u8(c, (uint8_t *)&ble->rssi)))
+        return false;
+    ble->major = major[0] | (major[1] << 8);
+    ble->minor = minor[0] | (minor[1] << 8);
+    return true;
+}
+
+// encode a deprecated cell_t array as the entry of its cell type
+static inline
+bool sky_put_compact_cells(sky_cursor_t * c, const union cell_t * cells, uint8_t cell_type, uint8_t count) {
+    uint32_t i;
+    if (!sky_put_compact_entry(c, cell_type, count))
+        return false;
+    for (i = 0; i < count; i++) {
+        bool ok;
+        switch (cell_type) {
+        case DATA_TYPE_GSM:
+            ok = sky_put_compact_gsm(c, &cells[i].gsm);
+            break;
+        case DATA_TYPE_UMTS:
+            ok = sky_put_compact_gsm(c, (const struct gsm_t *)&cells[i].umts);
+            break;
+        case DATA_TYPE_CDMA:
+            ok = sky_put_compact_cdma(c, &cells[i].cdma);
+            break;
+        case DATA_TYPE_LTE:
+            ok = sky_put_compact_lte(c, &cells[i].lte);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// allocate an array for decoded data entries in the unused tail of the buffer
+static inline
+void * sky_alloc_compact(sky_cursor_t * arena, uint32_t size) {
+    uint8_t * p = arena->p + ((8 - ((uintptr_t)arena->p & 7)) & 7); // 64-bit aligned
+    if (p + size > arena->end)
+        return NULL;
+    arena->p = p + size;
+    return p;
+}
+
+// packs the data entries of the request at the cursor, returns false if they do not fit
+static bool sky_put_compact_req(sky_cursor_t * c, const struct location_rq_t * creq) {
+    bool ok = true;
+    uint32_t i;
+
+    if (creq->rq_id != 0)
+        ok = sky_put_compact_entry(c, DATA_TYPE_RQ_ID, SKY_RQ_ID_SIZE)
+                && sky_put_bytes(c, &creq->rq_id, SKY_RQ_ID_SIZE);
+    if (creq->base_id != 0)
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_DELTA, SKY_RQ_ID_SIZE)
+                && sky_put_bytes(c, &creq->base_id, SKY_RQ_ID_SIZE);
+    if (creq->mac_count > 0)
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_MAC, creq->mac_count)
+                && sky_put_bytes(c, creq->mac, creq->mac_count * MAC_SIZE);
+    if (creq->ip_count > 0) {
+        uint8_t ip_type = (creq->ip_type == DATA_TYPE_IPV4) ? DATA_TYPE_IPV4 : DATA_TYPE_IPV6;
+        ok = ok && sky_put_compact_entry(c, ip_type, creq->ip_count)
+                && sky_put_bytes(c, creq->ip_addr,
+                        creq->ip_count * (ip_type == DATA_TYPE_IPV4 ? IPV4_SIZE : IPV6_SIZE));
+    }
+    if (creq->ap_count > 0)
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_AP, creq->ap_count)
+                && sky_put_compact_aps(c, creq->aps, creq->ap_count);
+    if (creq->removed_count > 0)
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_AP_REMOVED, creq->removed_count)
+                && sky_put_bytes(c, creq->removed, creq->removed_count * MAC_SIZE);
+    if (creq->ble_count > 0) {
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_BLE, creq->ble_count);
+        for (i = 0; ok && i < creq->ble_count; i++)
+            ok = sky_put_compact_ble(c, &creq->bles[i]);
+    }
+    if (creq->cell_count > 0)
+        ok = ok && sky_put_compact_cells(c, creq->cell, creq->cell_type, creq->cell_count);
+    if (creq->gsm_count > 0) {
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_GSM, creq->gsm_count);
+        for (i = 0; ok && i < creq->gsm_count; i++)
+            ok = sky_put_compact_gsm(c, &creq->gsms[i]);
+    }
+    if (creq->cdma_count > 0) {
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_CDMA, creq->cdma_count);
+        for (i = 0; ok && i < creq->cdma_count; i++)
+            ok = sky_put_compact_cdma(c, &creq->cdmas[i]);
+    }
+    if (creq->umts_count > 0) {
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_UMTS, creq->umts_count);
+        for (i = 0; ok && i < creq->umts_count; i++)
+            ok = sky_put_compact_gsm(c, (const struct gsm_t *)&creq->umtss[i]);
+    }
+    if (creq->lte_count > 0) {
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_LTE, creq->lte_count);
+        for (i = 0; ok && i < creq->lte_count; i++)
+            ok = sky_put_compact_lte(c, &creq->ltes[i]);
+    }
+    if (creq->gps_count > 0) {
+        ok = ok && sky_put_compact_entry(c, DATA_TYPE_GPS, creq->gps_count);
+        for (i = 0; ok && i < creq->gps_count; i++)
+            ok = sky_put_compact_gps(c, &creq->gps[i]);
+    }
+    return ok;
+}
+
+// packs the scans of a batch, each a DATA_TYPE_SCAN entry of its payload and its data entries
+static bool sky_put_compact_scans(sky_cursor_t * c, const struct location_rq_t * scans, uint32_t count) {
+    bool ok = true;
+    uint32_t i;
+
+    for (i = 0; ok && i < count; i++)
+        ok = sky_put_compact_entry(c, DATA_TYPE_SCAN, sizeof(sky_payload_t))
+                && sky_put_bytes(c, &scans[i].payload_ext.payload, sizeof(sky_payload_t))
+                && sky_put_compact_req(c, &scans[i]);
+    return ok;
+}
+
+// encodes the packed request, with the count scans of a batch after its data entries
+static int32_t sky_encode_req_compact(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        const struct location_rq_t *scans, uint32_t count) {
+    uint32_t header_len = sizeof(sky_rq_header_t);
+    uint32_t trailer_len = sky_trailer_len(creq->header.version);
+    bool aead = sky_is_aead(creq->header.version);
+
+    if (buff_len < header_len + sizeof(sky_payload_t) + trailer_len) {
+        perror("buffer too small");
         return -1;
-    if (!sky_verify_checksum(buff, buff_len, (uint8_t)sizeof(creq->header), creq->header.payload_length))
+    }
+
+    // the data entries are written first, since the payload length is unknown until then
+    sky_cursor_t c = { buff + header_len + sizeof(sky_payload_t), buff + buff_len - trailer_len, 0 };
+    bool ok = sky_put_compact_req(&c, creq) && sky_put_compact_scans(&c, scans, count);
+
+    // payload length must be a multiple of 16 bytes, unless it is sealed by AES-GCM
+    uint32_t payload_length = c.p - (buff + header_len);
+    uint8_t pad_len = aead ? 0 : pad_16(payload_length);
+    if (ok && pad_len > 0) {
+        if (c.p + pad_len > c.end)
+            ok = false;
+        else
+            memset(c.p, DATA_TYPE_PAD, pad_len);
+    }
+    if (!ok) {
+        perror("buffer too small");
         return -1;
-    memset(&creq->payload_ext, 0, sizeof(creq->payload_ext));
-    if (!sky_get_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+    }
+    payload_length += pad_len;
+    if (payload_length > UINT16_MAX) {
+        perror("payload too long");
         return -1;
+    }
 
-    /* binary protocol description in sky_protocol.h */
-    creq->key.partner_id = creq->header.user_id;
-
-    if (creq->payload_ext.payload.type != LOCATION_RQ
-            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR) {
-        fprintf(stderr, "Unknown payload type %d\n", creq->payload_ext.payload.type);
+    creq->header.payload_length = payload_length;
+    creq->header.user_id = SKY_KEY(creq).partner_id;
+    // 16 byte initialization vector, the nonce is set by sky_seal_packet
+    if (aead)
+        memset(creq->header.iv, 0, sizeof(creq->header.iv));
+    else
+        sky_gen_iv(creq->header.iv);
+    if (!sky_set_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
         return -1;
+    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+        return -1;
+    if (!aead && !sky_set_checksum(buff, buff_len, (uint8_t)sizeof(creq->header), creq->header.payload_length))
+        return -1;
+
+    return header_len + payload_length + trailer_len;
+}
+
+// decodes the packed data entries of the request up to the padding, the end
+// of the payload or a DATA_TYPE_SCAN entry; the structs are allocated from arena
+// returns 1 at a DATA_TYPE_SCAN entry, 0 at the end or -1 when fails
+static int32_t sky_get_compact_entries(sky_cursor_t * c, sky_cursor_t * arena, struct location_rq_t *creq) {
+    uint32_t i;
+
+    while (c->p < c->end) {
+        sky_entry_t entry;
+        void * data = NULL;
+        bool ok = true;
+
+        if (*c->p == DATA_TYPE_PAD)
+            return 0; // success
+        if (*c->p == DATA_TYPE_SCAN)
+            return 1;
+        if (!sky_get_bytes(c, &entry, sizeof(entry))) {
+            perror("invalid data entry");
+            return -1;
+        }
+        uint32_t count = entry.data_type_count;
+        if (entry.data_type & SKY_ENTRY_EXT) {
+            uint8_t high;
+            if (!sky_get_u8(c, &high)) {
+                perror("invalid data entry");
+                return -1;
+            }
+            count |= (uint32_t)high << 8;
+            entry.data_type &= ~SKY_ENTRY_EXT;
+            if (entry.data_type != DATA_TYPE_AP && entry.data_type != DATA_TYPE_AP_REMOVED) {
+                perror("data entry too long");
+                return -1;
+            }
+        }
+
+        switch (entry.data_type) {
+        case DATA_TYPE_RQ_ID:
+            ok = count == SKY_RQ_ID_SIZE && sky_get_bytes(c, &creq->rq_id, SKY_RQ_ID_SIZE);
+            break;
+        case DATA_TYPE_DELTA:
+            ok = count == SKY_RQ_ID_SIZE && sky_get_bytes(c, &creq->base_id, SKY_RQ_ID_SIZE);
+            break;
+        case DATA_TYPE_MAC:
+            creq->mac_count = count;
+            creq->mac = c->p;
+            ok = c->p + count * MAC_SIZE <= c->end;
+            c->p += count * MAC_SIZE;
+            break;
+        case DATA_TYPE_IPV4:
+        case DATA_TYPE_IPV6: {
+            uint32_t sz = count * (entry.data_type == DATA_TYPE_IPV4 ? IPV4_SIZE : IPV6_SIZE);
+            creq->ip_count = count;
+            creq->ip_type = entry.data_type;
+            creq->ip_addr = c->p;
+            ok = c->p + sz <= c->end;
+            c->p += sz;
+            break;
+        }
+        case DATA_TYPE_AP:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct ap_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->ap_count = count;
+            creq->aps = (struct ap_t *)data;
+            ok = sky_get_compact_aps(c, creq->aps, count);
+            break;
+        case DATA_TYPE_AP_REMOVED:
+            creq->removed_count = count;
+            creq->removed = c->p;
+            ok = c->p + count * MAC_SIZE <= c->end;
+            c->p += count * MAC_SIZE;
+            break;
+        case DATA_TYPE_BLE:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct ble_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->ble_count = count;
+            creq->bles = (struct ble_t *)data;
+            for (i = 0; ok && i < count; i++)
+                ok = sky_get_compact_ble(c, &creq->bles[i]);
+            break;
+        case DATA_TYPE_GSM:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct gsm_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->gsm_count = count;
+            creq->gsms = (struct gsm_t *)data;
+            for (i = 0; ok && i < count; i++)
+                ok = sky_get_compact_gsm(c, &creq->gsms[i]);
+            break;
+        case DATA_TYPE_CDMA:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct cdma_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->cdma_count = count;
+            creq->cdmas = (struct cdma_t *)data;
+            for (i = 0; ok && i < count; i++)
+                ok = sky_get_compact_cdma(c, &creq->cdmas[i]);
+            break;
+        case DATA_TYPE_UMTS:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct umts_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->umts_count = count;
+            creq->umtss = (struct umts_t *)data;
+            for (i = 0; ok && i < count; i++)
+                ok = sky_get_compact_gsm(c, (struct gsm_t *)&creq->umtss[i]);
+            break;
+        case DATA_TYPE_LTE:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct lte_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->lte_count = count;
+            creq->ltes = (struct lte_t *)data;
+            for (i = 0; ok && i < count; i++)
+                ok = sky_get_compact_lte(c, &creq->ltes[i]);
+            break;
+        case DATA_TYPE_GPS:
+            if ((data = sky_alloc_compact(arena, count * sizeof(struct gps_t))) == NULL) {
+                perror("buffer too small");
+                return -1;
+            }
+            creq->gps_count = count;
+            creq->gps = (struct gps_t *)data;
+            for (i = 0; ok && i < count; i++)
+                ok = sky_get_compact_gps(c, &creq->gps[i]);
+            break;
+        default:
+            perror("unknown data type");
+            return -1;
+        }
+        if (!ok) {
+            perror("invalid data entry");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    // read data entries from buffer
-    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
-    uint32_t payload_offset = sizeof(sky_payload_t);
-    while (payload_offset < creq->header.payload_length) {
+// a scan of a batch has the header and the key of the batch
+static void sky_init_scan(const struct location_rq_t *creq, struct location_rq_t *scan) {
+    memset(scan, 0, sizeof(*scan));
+    scan->header = creq->header;
+#ifndef SKY_KEY_BY_REF
+    scan->key.partner_id = creq->header.user_id;
+#endif
+}
+
+// the MAC and IP of the batch are the ones of its scans without their own
+static void sky_inherit_scans(const struct location_rq_t *creq, struct location_rq_t *scans, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (scans[i].mac_count == 0) {
+            scans[i].mac_count = creq->mac_count;
+            scans[i].mac = creq->mac;
+        }
+        if (scans[i].ip_count == 0) {
+            scans[i].ip_count = creq->ip_count;
+            scans[i].ip_type = creq->ip_type;
+            scans[i].ip_addr = creq->ip_addr;
+        }
+    }
+}
+
+// decodes the packed data entries of the request, and the scans of a batch
+// the structs are expanded into buff after data_len
+// returns the # of scans or -1 when fails
+static int32_t sky_decode_req_compact(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rq_t *creq, struct location_rq_t *scans, uint32_t max_scans) {
+    uint32_t header_len = sizeof(sky_rq_header_t);
+    uint8_t * payload_end = buff + header_len + creq->header.payload_length;
+    sky_cursor_t c = { buff + header_len + sizeof(sky_payload_t), payload_end, 0 };
+    // the decoded arrays are allocated after the packet
+    uint32_t packet_len = header_len + creq->header.payload_length + sky_trailer_len(creq->header.version);
+    sky_cursor_t arena = { buff + (data_len > packet_len ? data_len : packet_len), buff + buff_len, 0 };
+    uint32_t n = 0;
+
+    int32_t rc = sky_get_compact_entries(&c, &arena, creq);
+    while (rc > 0) {
+        sky_entry_t entry;
+        if (n == max_scans) {
+            perror("too many scans");
+            return -1;
+        }
+        struct location_rq_t * scan = &scans[n++];
+        sky_init_scan(creq, scan);
+        if (!sky_get_bytes(&c, &entry, sizeof(entry)) || entry.data_type_count != sizeof(sky_payload_t)
+                || !sky_get_bytes(&c, &scan->payload_ext.payload, sizeof(sky_payload_t))) {
+            perror("invalid scan");
+            return -1;
+        }
+        rc = sky_get_compact_entries(&c, &arena, scan);
+    }
+    if (rc < 0)
+        return -1;
+    sky_inherit_scans(creq, scans, n);
+    return n;
+}
+
+// reads the data entries of the request in place in buffer, from p_entry_ex at
+// payload_offset up to the padding, the end of the payload or a DATA_TYPE_SCAN entry
+// returns 1 at a DATA_TYPE_SCAN entry, 0 at the end or -1 when fails
+static int32_t sky_get_rq_entries(uint8_t *buff, uint32_t buff_len, sky_entry_ext_t * p_entry_ex,
+        uint32_t * payload_offset, uint32_t payload_length, struct location_rq_t *creq) {
+    while (*payload_offset < payload_length) {
         uint32_t sz = 0;
-        switch (p_entry_ex->entry->data_type) {
+        uint8_t data_type = p_entry_ex->entry->data_type & ~SKY_ENTRY_EXT;
+        // the padding can be a single byte
+        if (p_entry_ex->entry->data_type == DATA_TYPE_PAD)
+            return 0; // success
+        if (!sky_entry_fits(buff, buff_len, p_entry_ex, *payload_offset, payload_length, 0)) {
+            perror("invalid data entry");
+            return -1;
+        }
+        uint32_t count = sky_get_entry_count(p_entry_ex);
+        if (count > UINT8_MAX && data_type != DATA_TYPE_AP && data_type != DATA_TYPE_AP_REMOVED) {
+            perror("data entry too long");
+            return -1;
+        }
+        // the request id and the base request id are copied out of the buffer
+        if ((data_type == DATA_TYPE_RQ_ID || data_type == DATA_TYPE_DELTA)
+                && !sky_entry_fits(buff, buff_len, p_entry_ex, *payload_offset, payload_length, count)) {
+            perror("invalid data entry");
+            return -1;
+        }
+        switch (data_type) {
+        case DATA_TYPE_RQ_ID:
+            if (count != SKY_RQ_ID_SIZE) {
+                perror("invalid request id");
+                return -1;
+            }
+            sz = count;
+            memcpy(&creq->rq_id, p_entry_ex->data, sz);
+            break;
+        case DATA_TYPE_DELTA:
+            if (count != SKY_RQ_ID_SIZE) {
+                perror("invalid base request id");
+                return -1;
+            }
+            sz = count;
+            memcpy(&creq->base_id, p_entry_ex->data, sz);
+            break;
         case DATA_TYPE_MAC:
-            creq->mac_count = p_entry_ex->entry->data_type_count;
-            sz = MAC_SIZE * p_entry_ex->entry->data_type_count;
+            creq->mac_count = count;
+            sz = MAC_SIZE * count;
             creq->mac = p_entry_ex->data;
             break;
         case DATA_TYPE_IPV4:
-            creq->ip_count = p_entry_ex->entry->data_type_count;
+            creq->ip_count = count;
             creq->ip_type = DATA_TYPE_IPV4;
-            sz = IPV4_SIZE * p_entry_ex->entry->data_type_count;
+            sz = IPV4_SIZE * count;
             creq->ip_addr = p_entry_ex->data;
             break;
         case DATA_TYPE_IPV6:
-            creq->ip_count = p_entry_ex->entry->data_type_count;
+            creq->ip_count = count;
             creq->ip_type = DATA_TYPE_IPV6;
-            sz = IPV6_SIZE * p_entry_ex->entry->data_type_count;
+            sz = IPV6_SIZE * count;
             creq->ip_addr = p_entry_ex->data;
             break;
         case DATA_TYPE_AP:
-            creq->ap_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct ap_t) * p_entry_ex->entry->data_type_count;
+            if (count > sky_limits.max_aps) {
+                perror("Too big: ap_count > max_aps");
+                return -1;
+            }
+            creq->ap_count = count;
+            sz = sizeof(struct ap_t) * count;
             creq->aps = (struct ap_t *)p_entry_ex->data;
             break;
+        case DATA_TYPE_AP_REMOVED:
+            if (count > sky_limits.max_aps) {
+                perror("Too big: removed_count > max_aps");
+                return -1;
+            }
+            creq->removed_count = count;
+            sz = MAC_SIZE * count;
+            creq->removed = p_entry_ex->data;
+            break;
         case DATA_TYPE_BLE:
-            creq->ble_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct ble_t) * p_entry_ex->entry->data_type_count;
+            creq->ble_count = count;
+            sz = sizeof(struct ble_t) * count;
             creq->bles = (struct ble_t *)p_entry_ex->data;
 #ifdef __BIG_ENDIAN__
             sky_ble_endian_swap(creq->bles);
 #endif
             break;
         case DATA_TYPE_GSM:
-            creq->gsm_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct gsm_t) * p_entry_ex->entry->data_type_count;
+            creq->gsm_count = count;
+            sz = sizeof(struct gsm_t) * count;
             creq->gsms = (struct gsm_t *)p_entry_ex->data;
 #ifdef __BIG_ENDIAN__
             sky_gsm_endian_swap(&creq->cell->gsm);
 #endif
             break;
         case DATA_TYPE_CDMA:
-            creq->cdma_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct cdma_t) * p_entry_ex->entry->data_type_count;
+            creq->cdma_count = count;
+            sz = sizeof(struct cdma_t) * count;
             creq->cdmas = (struct cdma_t *)p_entry_ex->data;
 #ifdef __BIG_ENDIAN__
             sky_cdma_endian_swap(&creq->cell->cdma);
 #endif
             break;
         case DATA_TYPE_UMTS:
-            creq->umts_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct umts_t) * p_entry_ex->entry->data_type_count;
+            creq->umts_count = count;
+            sz = sizeof(struct umts_t) * count;
             creq->umtss = (struct umts_t *)p_entry_ex->data;
 #ifdef __BIG_ENDIAN__
             sky_umts_endian_swap(&creq->cell->umtss);
 #endif
             break;
         case DATA_TYPE_LTE:
-            creq->lte_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct lte_t) * p_entry_ex->entry->data_type_count;
+            creq->lte_count = count;
+            sz = sizeof(struct lte_t) * count;
             creq->ltes = (struct lte_t *)p_entry_ex->data;
 #ifdef __BIG_ENDIAN__
             sky_lte_endian_swap(&creq->cell->lte);
 #endif
             break;
         case DATA_TYPE_GPS:
-            creq->gps_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct gps_t) * p_entry_ex->entry->data_type_count;
+            creq->gps_count = count;
+            sz = sizeof(struct gps_t) * count;
             creq->gps = (struct gps_t *)p_entry_ex->data;
 #ifdef __BIG_ENDIAN__
             sky_gps_endian_swap(creq->gps);
 #endif
             break;
-        case DATA_TYPE_PAD:
-            return 0; // success
+        case DATA_TYPE_SCAN:
+            return 1;
         default:
             perror("unknown data type");
             return -1;
         }
-        payload_offset += sizeof(sky_entry_t) + sz;
-        adjust_data_entry(buff, buff_len, sizeof(sky_rq_header_t) + payload_offset, p_entry_ex);
+        if (!sky_entry_fits(buff, buff_len, p_entry_ex, *payload_offset, payload_length, sz)) {
+            perror("invalid data entry");
+            return -1;
+        }
+        *payload_offset += (p_entry_ex->data - (uint8_t *)p_entry_ex->entry) + sz;
+        adjust_data_entry(buff, buff_len, sizeof(sky_rq_header_t) + *payload_offset, p_entry_ex);
     }
     return 0;
 }
 
-// sent by the server to the client
-/* encodes the loc struct into binary formatted packet sent to client */
-// returns the packet len or -1 when fails
-int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp) {
+// reads the data entries of the version 1 request in place in buffer, and the scans of a batch
+// returns the # of scans or -1 when fails
+static int32_t sky_decode_req_legacy(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        struct location_rq_t *scans, uint32_t max_scans) {
+    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+    uint32_t payload_offset = sizeof(sky_payload_t);
+    uint32_t n = 0;
+
+    int32_t rc = sky_get_rq_entries(buff, buff_len, p_entry_ex, &payload_offset, creq->header.payload_length, creq);
+    while (rc > 0) {
+        if (n == max_scans) {
+            perror("too many scans");
+            return -1;
+        }
+        struct location_rq_t * scan = &scans[n++];
+        sky_init_scan(creq, scan);
+        if (p_entry_ex->entry->data_type != DATA_TYPE_SCAN
+                || p_entry_ex->entry->data_type_count != sizeof(sky_payload_t)
+                || payload_offset + sizeof(sky_entry_t) + sizeof(sky_payload_t) > creq->header.payload_length) {
+            perror("invalid scan");
+            return -1;
+        }
+        memcpy(&scan->payload_ext.payload, p_entry_ex->data, sizeof(sky_payload_t));
+        payload_offset += sizeof(sky_entry_t) + sizeof(sky_payload_t);
+        adjust_data_entry(buff, buff_len, sizeof(sky_rq_header_t) + payload_offset, p_entry_ex);
+        rc = sky_get_rq_entries(buff, buff_len, p_entry_ex, &payload_offset, creq->header.payload_length, scan);
+    }
+    if (rc < 0)
+        return -1;
+    sky_inherit_scans(creq, scans, n);
+    return n;
+}
+
+// reads the header and the payload of the request
+static bool sky_decode_rq_payload(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
+    memset(&creq->header, 0, sizeof(creq->header));
+    creq->rq_id = 0;
+    creq->base_id = 0;
+    creq->removed_count = 0;
+    if (!sky_get_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+        return false;
+    // sealed packets are verified by sky_open_packet
+    if (!sky_is_aead(creq->header.version)
+            && !sky_verify_checksum(buff, buff_len, (uint8_t)sizeof(creq->header), creq->header.payload_length))
+        return false;
+    memset(&creq->payload_ext, 0, sizeof(creq->payload_ext));
+    if (!sky_get_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+        return false;
+
+    /* binary protocol description in sky_protocol.h */
+#ifndef SKY_KEY_BY_REF
+    creq->key.partner_id = creq->header.user_id;
+#endif
+    return true;
+}
+
+// received by the server from the client
+/* decode binary data from client, result is in the location_req_t struct */
+/* binary encoded data in buff from client with data */
+int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rq_t *creq) {
+
+    // the packet is read from the data_len bytes received only
+    if (data_len > buff_len) {
+        perror("invalid packet length");
+        return -1;
+    }
+    if (!sky_decode_rq_payload(buff, data_len, creq))
+        return -1;
+
+    // a probe has no data entries
+    if (creq->payload_ext.payload.type == PROBE_REQUEST)
+        return 0;
+    if (creq->payload_ext.payload.type != LOCATION_RQ
+            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR) {
+        fprintf(stderr, "Unknown payload type %d\n", creq->payload_ext.payload.type);
+        return -1;
+    }
+
+    // a request has no scans
+    int32_t rc;
+    if (creq->header.version == SKY_PROTOCOL_VERSION_COMPACT || sky_is_aead(creq->header.version))
+        rc = sky_decode_req_compact(buff, buff_len, data_len, creq, NULL, 0);
+    else
+        rc = sky_decode_req_legacy(buff, data_len, creq, NULL, 0);
+    if (rc == 0 && creq->removed_count > 0 && creq->base_id == 0) {
+        perror("removed access points without a base scan");
+        return -1;
+    }
+    // the scan limits of the gateway
+    if (rc == 0 && !check_rq_max_counts(creq))
+        return -1;
+    return rc;
+}
+
+// received by the server from the client
+int32_t sky_decode_req_batch(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rq_t *batch, struct location_rq_t *scans, uint32_t max_scans) {
+
+    if (data_len > buff_len) {
+        perror("invalid packet length");
+        return -1;
+    }
+    if (!sky_decode_rq_payload(buff, data_len, batch))
+        return -1;
+    if (batch->payload_ext.payload.type != LOCATION_RQ_BATCH) {
+        fprintf(stderr, "Unknown payload type %d\n", batch->payload_ext.payload.type);
+        return -1;
+    }
 
+    int32_t n;
+    if (batch->header.version == SKY_PROTOCOL_VERSION_COMPACT || sky_is_aead(batch->header.version))
+        n = sky_decode_req_compact(buff, buff_len, data_len, batch, scans, max_scans);
+    else
+        n = sky_decode_req_legacy(buff, data_len, batch, scans, max_scans);
+    if (n < 0)
+        return -1;
+
+    // the scans are full location requests
+    uint32_t i;
+    for (i = 0; i < (uint32_t)n; i++) {
+        if (scans[i].payload_ext.payload.type != LOCATION_RQ
+                && scans[i].payload_ext.payload.type != LOCATION_RQ_ADDR) {
+            fprintf(stderr, "Unknown scan payload type %d\n", scans[i].payload_ext.payload.type);
+            return -1;
+        }
+        if (scans[i].base_id != 0 || scans[i].removed_count > 0) {
+            perror("delta scan in a batch");
+            return -1;
+        }
+    }
+    if (batch->base_id != 0 || batch->removed_count > 0) {
+        perror("delta scan in a batch");
+        return -1;
+    }
+
+    // the scan limits of the gateway
+    if (!check_rq_max_counts(batch))
+        return -1;
+    for (i = 0; i < (uint32_t)n; i++)
+        if (!check_rq_max_counts(&scans[i]))
+            return -1;
+    return n;
+}
+
+// bytes of the payload of the response, without padding
+static uint32_t sky_resp_payload_len(const struct location_rsp_t *cresp) {
     uint32_t payload_length = sizeof(sky_payload_t);
 
+    // request id, in every response type
+    if (cresp->rq_id != 0)
+        payload_length += sizeof(sky_entry_t) + SKY_RQ_ID_SIZE;
+
     // count bytes of data entries
     switch (cresp->payload_ext.payload.type) {
     case LOCATION_RQ_SUCCESS:
@@ -432,164 +1387,169 @@ int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rs
     case LOCATION_RQ_ADDR_SUCCESS:
         payload_length += sizeof(sky_entry_t) + sizeof(struct location_t); // latitude and longitude
         if (cresp->location_ext.mac_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.mac_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.mac_len) + cresp->location_ext.mac_len;
         if (cresp->location_ext.ip_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.ip_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.ip_len) + cresp->location_ext.ip_len;
         if (cresp->location_ext.street_num_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.street_num_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.street_num_len) + cresp->location_ext.street_num_len;
         if (cresp->location_ext.address_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.address_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.address_len) + cresp->location_ext.address_len;
         if (cresp->location_ext.city_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.city_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.city_len) + cresp->location_ext.city_len;
         if (cresp->location_ext.state_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.state_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.state_len) + cresp->location_ext.state_len;
         if (cresp->location_ext.state_code_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.state_code_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.state_code_len) + cresp->location_ext.state_code_len;
         if (cresp->location_ext.metro1_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.metro1_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.metro1_len) + cresp->location_ext.metro1_len;
         if (cresp->location_ext.metro2_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.metro2_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.metro2_len) + cresp->location_ext.metro2_len;
         if (cresp->location_ext.postal_code_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.postal_code_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.postal_code_len) + cresp->location_ext.postal_code_len;
         if (cresp->location_ext.county_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.county_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.county_len) + cresp->location_ext.county_len;
         if (cresp->location_ext.country_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.country_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.country_len) + cresp->location_ext.country_len;
         if (cresp->location_ext.country_code_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.country_code_len;
+            payload_length += SKY_ENTRY_LEN(cresp->location_ext.country_code_len) + cresp->location_ext.country_code_len;
         break;
     default: // i.e. PROBE_REQUEST_SUCCESS, LOCATION_RQ_ERROR, LOCATION_GATEWAY_ERROR, LOCATION_API_ERROR, etc.
-        // no data entry in payload so far
+        // no data entry in payload but the request id
         break;
     }
+    return payload_length;
+}
 
-    // payload length must be a multiple of 16 bytes
-    uint8_t pad_len = pad_16(payload_length);
-    payload_length += pad_len;
-
-    // Note that buffer contains the legacy date for location request,
-    // so some fields (e.g. user id) are correct already.
-    // update fields in buffer
-    cresp->header.payload_length = payload_length;
-    sky_gen_iv(cresp->header.iv); // 16 byte initialization vector
-    if (!sky_set_header(buff, buff_len, (uint8_t *)&cresp->header, sizeof(cresp->header)))
-        return -1;
-
-    if (!sky_set_payload(buff, buff_len, sizeof(sky_rsp_header_t), &cresp->payload_ext, cresp->header.payload_length))
-        return -1;
-
-    // fill in data entries in place in buffer
+// fills in an entry of the response of len bytes of data, in the extended form if
+// len does not fit a byte
+static inline
+void sky_set_resp_entry(uint8_t *buff, uint32_t buff_len, sky_entry_ext_t * p_entry_ex,
+        uint8_t data_type, const void *data, uint32_t len) {
+    sky_set_entry(p_entry_ex, data_type, len);
+    memcpy(p_entry_ex->data, data, len);
+    adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + len, p_entry_ex);
+}
 
+// fills in the data entries of the response in place in buffer, from p_entry_ex
+static void sky_set_resp_entries(uint8_t *buff, uint32_t buff_len, sky_entry_ext_t * p_entry_ex,
+        struct location_rsp_t *cresp) {
 #ifdef __BIG_ENDIAN__
     sky_location_endian_swap(&cresp->location);
 #endif
 
+    // request id
+    if (cresp->rq_id != 0)
+        sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_RQ_ID, &cresp->rq_id, SKY_RQ_ID_SIZE);
     // latitude and longitude
-    if (cresp->payload_ext.payload.type == LOCATION_RQ_SUCCESS) {
-        sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
-        p_entry_ex->entry->data_type = DATA_TYPE_LAT_LON;
-        p_entry_ex->entry->data_type_count = sizeof(cresp->location);
-        memcpy(p_entry_ex->data, &cresp->location, sizeof(cresp->location));
-        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-    }
+    if (cresp->payload_ext.payload.type == LOCATION_RQ_SUCCESS)
+        sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_LAT_LON, &cresp->location,
+                sizeof(cresp->location));
     // latitude, longitude, and full address, etc.
     if (cresp->payload_ext.payload.type == LOCATION_RQ_ADDR_SUCCESS) {
-        sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
-        p_entry_ex->entry->data_type = DATA_TYPE_LAT_LON;
-        p_entry_ex->entry->data_type_count = sizeof(cresp->location);
-        memcpy(p_entry_ex->data, &cresp->location, sizeof(cresp->location));
-        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
+        sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_LAT_LON, &cresp->location,
+                sizeof(cresp->location));
 
-        if (cresp->location_ext.mac_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_MAC;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.mac_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.mac, p_entry_ex->entry->data_type_count);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.mac_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_MAC, cresp->location_ext.mac,
+                    cresp->location_ext.mac_len);
 
-        if (cresp->location_ext.ip_len > 0) {
-            p_entry_ex->entry->data_type = cresp->location_ext.ip_type;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.ip_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.ip_addr, p_entry_ex->entry->data_type_count);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.ip_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, cresp->location_ext.ip_type, cresp->location_ext.ip_addr,
+                    cresp->location_ext.ip_len);
 
-        if (cresp->location_ext.street_num_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_STREET_NUM;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.street_num_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.street_num, cresp->location_ext.street_num_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.street_num_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_STREET_NUM, cresp->location_ext.street_num,
+                    cresp->location_ext.street_num_len);
 
-        if (cresp->location_ext.address_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_ADDRESS;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.address_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.address, cresp->location_ext.address_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.address_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_ADDRESS, cresp->location_ext.address,
+                    cresp->location_ext.address_len);
 
-        if (cresp->location_ext.city_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_CITY;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.city_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.city, cresp->location_ext.city_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.city_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_CITY, cresp->location_ext.city,
+                    cresp->location_ext.city_len);
 
-        if (cresp->location_ext.state_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_STATE;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.state_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.state, cresp->location_ext.state_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.state_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_STATE, cresp->location_ext.state,
+                    cresp->location_ext.state_len);
 
-        if (cresp->location_ext.state_code_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_STATE_CODE;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.state_code_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.state_code, cresp->location_ext.state_code_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.state_code_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_STATE_CODE, cresp->location_ext.state_code,
+                    cresp->location_ext.state_code_len);
 
-        if (cresp->location_ext.metro1_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_METRO1;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.metro1_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.metro1, cresp->location_ext.metro1_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.metro1_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_METRO1, cresp->location_ext.metro1,
+                    cresp->location_ext.metro1_len);
 
-        if (cresp->location_ext.metro2_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_METRO2;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.metro2_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.metro2, cresp->location_ext.metro2_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.metro2_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_METRO2, cresp->location_ext.metro2,
+                    cresp->location_ext.metro2_len);
 
-        if (cresp->location_ext.postal_code_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_POSTAL_CODE;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.postal_code_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.postal_code, cresp->location_ext.postal_code_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);;
-        }
+        if (cresp->location_ext.postal_code_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_POSTAL_CODE, cresp->location_ext.postal_code,
+                    cresp->location_ext.postal_code_len);
 
-        if (cresp->location_ext.county_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_COUNTY;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.county_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.county, cresp->location_ext.county_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.county_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_COUNTY, cresp->location_ext.county,
+                    cresp->location_ext.county_len);
 
-        if (cresp->location_ext.country_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_COUNTRY;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.country_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.country, cresp->location_ext.country_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.country_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_COUNTRY, cresp->location_ext.country,
+                    cresp->location_ext.country_len);
 
-        if (cresp->location_ext.country_code_len > 0) {
-            p_entry_ex->entry->data_type = DATA_TYPE_COUNTRY_CODE;
-            p_entry_ex->entry->data_type_count = cresp->location_ext.country_code_len;
-            memcpy(p_entry_ex->data, cresp->location_ext.country_code, cresp->location_ext.country_code_len);
-            adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
-        }
+        if (cresp->location_ext.country_code_len > 0)
+            sky_set_resp_entry(buff, buff_len, p_entry_ex, DATA_TYPE_COUNTRY_CODE, cresp->location_ext.country_code,
+                    cresp->location_ext.country_code_len);
+    }
+}
+
+// encodes the response, with the count responses to the scans of a batch after its data entries
+static int32_t sky_encode_resp(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp,
+        struct location_rsp_t *scans, uint32_t count) {
+    uint32_t i;
+
+    uint32_t payload_length = sky_resp_payload_len(cresp);
+    for (i = 0; i < count; i++)
+        payload_length += sizeof(sky_entry_t) + sky_resp_payload_len(&scans[i]);
+
+    // payload length must be a multiple of 16 bytes, unless it is sealed by AES-GCM
+    bool aead = sky_is_aead(cresp->header.version);
+    uint8_t pad_len = aead ? 0 : pad_16(payload_length);
+    payload_length += pad_len;
+    if (buff_len < sizeof(sky_rsp_header_t) + payload_length + sky_trailer_len(cresp->header.version)) {
+        perror("buffer too small");
+        return -1;
+    }
+    if (payload_length > UINT16_MAX) {
+        perror("payload too long");
+        return -1;
+    }
+
+    // Note that buffer contains the legacy date for location request,
+    // so some fields (e.g. user id) are correct already.
+    // update fields in buffer
+    cresp->header.payload_length = payload_length;
+    // 16 byte initialization vector, the nonce is set by sky_seal_packet
+    if (aead)
+        memset(cresp->header.iv, 0, sizeof(cresp->header.iv));
+    else
+        sky_gen_iv(cresp->header.iv);
+    if (!sky_set_header(buff, buff_len, (uint8_t *)&cresp->header, sizeof(cresp->header)))
+        return -1;
+
+    if (!sky_set_payload(buff, buff_len, sizeof(sky_rsp_header_t), &cresp->payload_ext, cresp->header.payload_length))
+        return -1;
+
+    // fill in data entries in place in buffer
+    sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
+    sky_set_resp_entries(buff, buff_len, p_entry_ex, cresp);
+    // the payload of a scan is the data of its DATA_TYPE_SCAN entry, its data entries follow
+    for (i = 0; i < count; i++) {
+        p_entry_ex->entry->data_type = DATA_TYPE_SCAN;
+        p_entry_ex->entry->data_type_count = sizeof(sky_payload_t);
+        memcpy(p_entry_ex->data, &scans[i].payload_ext.payload, sizeof(sky_payload_t));
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sizeof(sky_payload_t), p_entry_ex);
+        sky_set_resp_entries(buff, buff_len, p_entry_ex, &scans[i]);
     }
 
     // fill in padding bytes
@@ -598,38 +1558,110 @@ int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rs
         memset(pad_bytes, DATA_TYPE_PAD, pad_len);
     }
 
-    sky_set_checksum(buff, buff_len, (uint8_t)sizeof(cresp->header), cresp->header.payload_length);
+    if (!aead)
+        sky_set_checksum(buff, buff_len, (uint8_t)sizeof(cresp->header), cresp->header.payload_length);
 
-    return sizeof(sky_rsp_header_t) + cresp->header.payload_length + sizeof(sky_checksum_t);
+    return sizeof(sky_rsp_header_t) + cresp->header.payload_length + sky_trailer_len(cresp->header.version);
 }
 
-// sent by the client to the server
-/* encodes the request struct into binary formatted packet sent to server */
+// sent by the server to the client
+/* encodes the loc struct into binary formatted packet sent to client */
 // returns the packet len or -1 when fails
-int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
+int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp) {
+    return sky_encode_resp(buff, buff_len, cresp, NULL, 0);
+}
 
-    if (creq->cell_count &&
-            (creq->gsm_count || creq->cdma_count || creq->umts_count || creq->lte_count)) {
-        perror("struct location_rq_t: use cell_t or gsm_t|cdma_t|umts_t|lte_t, but not both");
+// sent by the server to the client
+int32_t sky_encode_resp_batch(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *batch,
+        struct location_rsp_t *scans, uint32_t count) {
+    uint32_t i;
+
+    if (count == 0) {
+        perror("batch without scans");
         return -1;
     }
-    if (!check_rq_max_counts(creq))
-        return -1;
+    for (i = 0; i < count; i++)
+        if (scans[i].payload_ext.payload.type == LOCATION_RQ_BATCH_SUCCESS) {
+            perror("batch in a batch");
+            return -1;
+        }
+    batch->payload_ext.payload.type = LOCATION_RQ_BATCH_SUCCESS;
+    return sky_encode_resp(buff, buff_len, batch, scans, count);
+}
 
-    if (creq->payload_ext.payload.type != LOCATION_RQ
-            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR) {
-        fprintf(stderr, "sky_encode_req_bin: unknown payload type %d\n", creq->payload_ext.payload.type);
+// responses without data entries: the payload padded to 16 bytes, or sealed
+// Note: the payload length is in the host order, as the server is little endian.
+struct sky_resp_template_t {
+    sky_rsp_header_t header;
+    sky_payload_t payload;
+    uint8_t pad[16 - sizeof(sky_payload_t)];
+};
+
+static const struct sky_resp_template_t sky_resp_templates[2] = {
+    { { SKY_PROTOCOL_VERSION, 0, 16, { 0 } }, { 0, { 0 }, 0 }, { DATA_TYPE_PAD } },
+    { { SKY_PROTOCOL_VERSION_AEAD, 0, sizeof(sky_payload_t), { 0 } }, { 0, { 0 }, 0 }, { 0 } },
+};
+
+int32_t sky_encode_resp_status(uint8_t *buff, uint32_t buff_len, uint8_t version, uint8_t type,
+        uint32_t rq_id) {
+    bool aead = sky_is_aead(version);
+    const struct sky_resp_template_t *t = &sky_resp_templates[aead];
+    // the request id entry fits the padding of the legacy template
+    uint32_t payload_length = t->header.payload_length;
+    if (aead && rq_id != 0)
+        payload_length += sizeof(sky_entry_t) + SKY_RQ_ID_SIZE;
+    uint32_t packet_len = sizeof(sky_rsp_header_t) + payload_length + sky_trailer_len(version);
+
+    if (type == LOCATION_RQ_SUCCESS || type == LOCATION_RQ_ADDR_SUCCESS) {
+        fprintf(stderr, "response type %d has data entries\n", type);
         return -1;
     }
+    if (buff_len < packet_len) {
+        perror("buffer too small");
+        return -1;
+    }
+    memcpy(buff, t, sizeof(sky_rsp_header_t) + t->header.payload_length);
+    // version, iv, timestamp and type
+    buff[0] = version;
+    if (!aead)
+        sky_gen_iv(buff + sizeof(sky_rsp_header_t) - 16);
+    uint8_t * payload = buff + sizeof(sky_rsp_header_t);
+    uint64_t ts = get_timestamp_ms();
+    uint32_t i;
+    for (i = 0; i < sizeof(t->payload.timestamp); i++)
+        payload[1 + i] = (uint8_t)(ts >> (8 * i)); // little endianness
+    payload[sizeof(sky_payload_t) - 1] = type;
+    if (rq_id != 0) {
+        uint8_t * entry = payload + sizeof(sky_payload_t);
+        entry[0] = DATA_TYPE_RQ_ID;
+        entry[1] = SKY_RQ_ID_SIZE;
+        memcpy(entry + sizeof(sky_entry_t), &rq_id, SKY_RQ_ID_SIZE);
+        buff[2] = (uint8_t)payload_length; // little endianness
+        buff[3] = (uint8_t)(payload_length >> 8);
+    }
 
+    if (!aead && !sky_set_checksum(buff, buff_len, (uint8_t)sizeof(sky_rsp_header_t), payload_length))
+        return -1;
+    return packet_len;
+}
+
+// bytes of the version 1 payload of the request, without padding
+// returns -1 if the cell type is unknown
+static int32_t sky_rq_payload_len(const struct location_rq_t *creq) {
     uint32_t payload_length = sizeof(sky_payload_t);
+    if (creq->rq_id != 0)
+        payload_length += sizeof(sky_entry_t) + SKY_RQ_ID_SIZE;
+    if (creq->base_id != 0)
+        payload_length += sizeof(sky_entry_t) + SKY_RQ_ID_SIZE;
     if (creq->mac_count > 0)
         payload_length += sizeof(sky_entry_t) + creq->mac_count * MAC_SIZE;
     if (creq->ip_count > 0)
         payload_length += sizeof(sky_entry_t) +
             creq->ip_count * (creq->ip_type == DATA_TYPE_IPV4 ? IPV4_SIZE : IPV6_SIZE);
     if (creq->ap_count > 0)
-        payload_length += sizeof(sky_entry_t) + creq->ap_count * sizeof(struct ap_t);
+        payload_length += SKY_ENTRY_LEN(creq->ap_count) + creq->ap_count * sizeof(struct ap_t);
+    if (creq->removed_count > 0)
+        payload_length += SKY_ENTRY_LEN(creq->removed_count) + creq->removed_count * MAC_SIZE;
     if (creq->ble_count > 0)
         payload_length += sizeof(sky_entry_t) + creq->ble_count * sizeof(struct ble_t);
     if (creq->gps_count > 0)
@@ -667,26 +1699,30 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
     if (creq->lte_count > 0) {
         payload_length += sizeof(sky_entry_t) + creq->lte_count * sizeof(struct lte_t);
     }
+    return payload_length;
+}
 
-    // payload length must be a multiple of 16 bytes
-    uint8_t pad_len = pad_16(payload_length);
-    payload_length += pad_len;
-
-    creq->header.payload_length = payload_length;
-    creq->header.user_id = creq->key.partner_id;
-    // 16 byte initialization vector
-    sky_gen_iv(creq->header.iv);
-    if (!sky_set_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
-        return -1;
-
-    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
-        return -1;
-
-    // fill in data entries in buffer
-    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+// fills in the data entries of the request in place in buffer, from p_entry_ex
+// returns false if the cell type is unknown
+static bool sky_set_rq_entries(uint8_t *buff, uint32_t buff_len, sky_entry_ext_t * p_entry_ex,
+        struct location_rq_t *creq) {
     uint32_t sz = 0;
+    // request id
+    if (creq->rq_id != 0) {
+        p_entry_ex->entry->data_type = DATA_TYPE_RQ_ID;
+        p_entry_ex->entry->data_type_count = SKY_RQ_ID_SIZE;
+        memcpy(p_entry_ex->data, &creq->rq_id, SKY_RQ_ID_SIZE);
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + SKY_RQ_ID_SIZE, p_entry_ex);
+    }
+    // base request id of a delta scan
+    if (creq->base_id != 0) {
+        p_entry_ex->entry->data_type = DATA_TYPE_DELTA;
+        p_entry_ex->entry->data_type_count = SKY_RQ_ID_SIZE;
+        memcpy(p_entry_ex->data, &creq->base_id, SKY_RQ_ID_SIZE);
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + SKY_RQ_ID_SIZE, p_entry_ex);
+    }
     // MAC
-    {
+    if (creq->mac_count > 0) {
         p_entry_ex->entry->data_type = DATA_TYPE_MAC;
         p_entry_ex->entry->data_type_count = creq->mac_count;
         sz = MAC_SIZE * p_entry_ex->entry->data_type_count;
@@ -694,14 +1730,14 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
     // IP
-    if (creq->ip_type == DATA_TYPE_IPV4) {
+    if (creq->ip_count > 0 && creq->ip_type == DATA_TYPE_IPV4) {
         // IPv4
         p_entry_ex->entry->data_type = DATA_TYPE_IPV4;
         p_entry_ex->entry->data_type_count = creq->ip_count;
         sz = IPV4_SIZE * p_entry_ex->entry->data_type_count;
         memcpy(p_entry_ex->data, creq->ip_addr, sz);
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
-    } else {
+    } else if (creq->ip_count > 0) {
         // IPv6
         p_entry_ex->entry->data_type = DATA_TYPE_IPV6;
         p_entry_ex->entry->data_type_count = creq->ip_count;
@@ -711,12 +1747,18 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
     }
     // Access Point
     if (creq->ap_count > 0) {
-        p_entry_ex->entry->data_type = DATA_TYPE_AP;
-        p_entry_ex->entry->data_type_count = creq->ap_count;
+        sky_set_entry(p_entry_ex, DATA_TYPE_AP, creq->ap_count);
         sz = sizeof(struct ap_t) * creq->ap_count;
         memcpy(p_entry_ex->data, creq->aps, sz);
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
+    // Access Points removed from the base scan
+    if (creq->removed_count > 0) {
+        sky_set_entry(p_entry_ex, DATA_TYPE_AP_REMOVED, creq->removed_count);
+        sz = MAC_SIZE * creq->removed_count;
+        memcpy(p_entry_ex->data, creq->removed, sz);
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
+    }
     // Blue Tooth
     if (creq->ble_count > 0) {
         p_entry_ex->entry->data_type = DATA_TYPE_BLE;
@@ -763,7 +1805,7 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
             break;
         default:
             perror("unknown data type");
-            return -1;
+            return false;
         }
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
@@ -823,6 +1865,92 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
 
+    return true;
+}
+
+// checks the counts and the payload type of a request or a scan of a batch
+static bool sky_check_rq(const struct location_rq_t *creq) {
+    if (creq->cell_count &&
+            (creq->gsm_count || creq->cdma_count || creq->umts_count || creq->lte_count)) {
+        perror("struct location_rq_t: use cell_t or gsm_t|cdma_t|umts_t|lte_t, but not both");
+        return false;
+    }
+    if (!check_rq_max_counts(creq))
+        return false;
+    // the gateway finds the base scan by the device MAC, and answers with the request id
+    if (creq->removed_count > 0 && creq->base_id == 0) {
+        perror("removed access points without a base scan");
+        return false;
+    }
+    if (creq->base_id != 0 && (creq->rq_id == 0 || creq->mac_count == 0)) {
+        perror("delta scan without a request id or device MAC");
+        return false;
+    }
+
+    // a probe has no data entries, so it fits the first 16 byte block
+    if (creq->payload_ext.payload.type == PROBE_REQUEST
+            && (creq->rq_id || creq->base_id || creq->removed_count || creq->mac_count || creq->ip_count
+            || creq->ap_count || creq->ble_count || creq->cell_count
+            || creq->gsm_count || creq->cdma_count || creq->lte_count || creq->umts_count || creq->gps_count)) {
+        perror("probe request with data entries");
+        return false;
+    }
+    if (creq->payload_ext.payload.type != LOCATION_RQ
+            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR
+            && creq->payload_ext.payload.type != PROBE_REQUEST) {
+        fprintf(stderr, "sky_encode_req_bin: unknown payload type %d\n", creq->payload_ext.payload.type);
+        return false;
+    }
+    return true;
+}
+
+// encodes the version 1 request, with the count scans of a batch after its data entries
+static int32_t sky_encode_req_legacy(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        struct location_rq_t *scans, uint32_t count) {
+    uint32_t i;
+
+    int32_t payload_length = sky_rq_payload_len(creq);
+    if (payload_length < 0)
+        return -1;
+    for (i = 0; i < count; i++) {
+        int32_t len = sky_rq_payload_len(&scans[i]);
+        if (len < 0)
+            return -1;
+        payload_length += sizeof(sky_entry_t) + len;
+    }
+
+    // payload length must be a multiple of 16 bytes
+    uint8_t pad_len = pad_16(payload_length);
+    payload_length += pad_len;
+    if (payload_length > UINT16_MAX) {
+        perror("payload too long");
+        return -1;
+    }
+
+    creq->header.payload_length = payload_length;
+    creq->header.user_id = SKY_KEY(creq).partner_id;
+    // 16 byte initialization vector
+    sky_gen_iv(creq->header.iv);
+    if (!sky_set_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+        return -1;
+
+    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+        return -1;
+
+    // fill in data entries in buffer
+    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+    if (!sky_set_rq_entries(buff, buff_len, p_entry_ex, creq))
+        return -1;
+    // the payload of a scan is the data of its DATA_TYPE_SCAN entry, its data entries follow
+    for (i = 0; i < count; i++) {
+        p_entry_ex->entry->data_type = DATA_TYPE_SCAN;
+        p_entry_ex->entry->data_type_count = sizeof(sky_payload_t);
+        memcpy(p_entry_ex->data, &scans[i].payload_ext.payload, sizeof(sky_payload_t));
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sizeof(sky_payload_t), p_entry_ex);
+        if (!sky_set_rq_entries(buff, buff_len, p_entry_ex, &scans[i]))
+            return -1;
+    }
+
     // fill in padding bytes
     if (pad_len > 0) {
         uint8_t * pad_bytes = p_entry_ex->data - sizeof(sky_entry_t);
@@ -835,114 +1963,501 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
     return sizeof(sky_rq_header_t) + creq->header.payload_length + sizeof(sky_checksum_t);
 }
 
-// received by the client from the server
-/* decodes the binary data and the result is in the location_resp_t struct */
-int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
-        struct location_rsp_t *cresp) {
+// sent by the client to the server
+/* encodes the request struct into binary formatted packet sent to server */
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
 
-    memset(&cresp->header, 0, sizeof(cresp->header));
-    if (!sky_get_header(buff, buff_len, (uint8_t *)&cresp->header, sizeof(cresp->header)))
+    if (!sky_check_rq(creq))
+        return -1;
+
+    if (creq->header.version == SKY_PROTOCOL_VERSION_COMPACT || sky_is_aead(creq->header.version))
+        return sky_encode_req_compact(buff, buff_len, creq, NULL, 0);
+    return sky_encode_req_legacy(buff, buff_len, creq, NULL, 0);
+}
+
+// sent by the client to the server
+int32_t sky_encode_req_batch(uint8_t *buff, uint32_t buff_len, struct location_rq_t *batch,
+        struct location_rq_t *scans, uint32_t count) {
+    uint32_t i;
+
+    if (count == 0) {
+        perror("batch without scans");
         return -1;
-    if (!sky_verify_checksum(buff, buff_len, (uint8_t)sizeof(cresp->header), cresp->header.payload_length))
+    }
+    // the batch has the data entries of the device only
+    if (batch->base_id || batch->removed_count || batch->ap_count || batch->ble_count || batch->cell_count || batch->gsm_count || batch->cdma_count
+            || batch->lte_count || batch->umts_count || batch->gps_count) {
+        perror("batch with scan data entries");
         return -1;
-    if (!sky_get_payload(buff, buff_len, sizeof(sky_rsp_header_t), &cresp->payload_ext, cresp->header.payload_length))
+    }
+    if (!check_rq_max_counts(batch))
         return -1;
+    for (i = 0; i < count; i++) {
+        if (!sky_check_rq(&scans[i]))
+            return -1;
+        if (scans[i].payload_ext.payload.type == PROBE_REQUEST) {
+            perror("probe request in a batch");
+            return -1;
+        }
+        if (scans[i].base_id != 0) {
+            perror("delta scan in a batch");
+            return -1;
+        }
+    }
+    batch->payload_ext.payload.type = LOCATION_RQ_BATCH;
 
-    if (cresp->payload_ext.payload.type != LOCATION_RQ_SUCCESS
-            && cresp->payload_ext.payload.type != LOCATION_RQ_ADDR_SUCCESS) {
+    if (batch->header.version == SKY_PROTOCOL_VERSION_COMPACT || sky_is_aead(batch->header.version))
+        return sky_encode_req_compact(buff, buff_len, batch, scans, count);
+    return sky_encode_req_legacy(buff, buff_len, batch, scans, count);
+}
 
-        switch (cresp->payload_ext.payload.type) {
-        case PROBE_REQUEST_SUCCESS:
-        case LOCATION_RQ_ERROR:
-        case LOCATION_GATEWAY_ERROR:
-        case LOCATION_API_ERROR:
-        case LOCATION_UNKNOWN:
-        case LOCATION_UNABLE_TO_DETERMINE:
-            return 0; // success
-        default:
-            fprintf(stderr, "Unknown payload type %d\n", cresp->payload_ext.payload.type);
-            return -1;
+// true if the access points sorted by MAC have a MAC more than once
+static bool sky_has_dup_macs(const struct ap_t *aps, uint32_t count) {
+    uint32_t i;
+    for (i = 1; i < count; i++)
+        if (memcmp(aps[i].MAC, aps[i - 1].MAC, MAC_SIZE) == 0)
+            return true;
+    return false;
+}
+
+// sent by the client to the server
+int32_t sky_encode_req_delta(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        const struct sky_delta_t *base) {
+    struct ap_t sorted[MAX_APS], aps[MAX_APS];
+    uint8_t removed[MAX_APS * MAC_SIZE];
+    uint32_t i = 0, j = 0, n = 0, m = 0;
+
+    if (base == NULL || base->base_id == 0 || creq->rq_id == 0 || creq->mac_count == 0
+            || creq->base_id != 0 || creq->ap_count > MAX_APS
+            || (creq->payload_ext.payload.type != LOCATION_RQ
+            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR))
+        return sky_encode_req_bin(buff, buff_len, creq);
+
+    // the gateway reconstructs the scan by MAC
+    memcpy(sorted, creq->aps, creq->ap_count * sizeof(struct ap_t));
+    qsort(sorted, creq->ap_count, sizeof(struct ap_t), sky_cmp_ap_mac);
+    if (sky_has_dup_macs(sorted, creq->ap_count))
+        return sky_encode_req_bin(buff, buff_len, creq);
+
+    // merge of the sorted scan and base
+    while (i < creq->ap_count || j < base->ap_count) {
+        int32_t cmp;
+        if (i == creq->ap_count)
+            cmp = 1;
+        else if (j == base->ap_count)
+            cmp = -1;
+        else
+            cmp = memcmp(sorted[i].MAC, base->aps[j].MAC, MAC_SIZE);
+        if (cmp < 0) {
+            aps[n++] = sorted[i++]; // added
+        } else if (cmp > 0) {
+            memcpy(removed + m++ * MAC_SIZE, base->aps[j++].MAC, MAC_SIZE);
+        } else {
+            if (sorted[i].rssi != base->aps[j].rssi || sorted[i].flag != base->aps[j].flag)
+                aps[n++] = sorted[i]; // changed
+            i++;
+            j++;
         }
     }
 
-    // read data entries from buffer
-    // latitude, longitude and full address, etc.
-    sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
-    uint32_t payload_offset = sizeof(sky_payload_t);
-    while (payload_offset < cresp->header.payload_length) {
-        switch (p_entry_ex->entry->data_type) {
+    struct location_rq_t delta = *creq;
+    delta.base_id = base->base_id;
+    delta.ap_count = n;
+    delta.aps = aps;
+    delta.removed_count = m;
+    delta.removed = removed;
+    int32_t full_len = sky_rq_bin_len(creq);
+    int32_t delta_len = sky_rq_bin_len(&delta);
+    if (full_len < 0 || delta_len < 0 || delta_len >= full_len || n + m > sky_limits.max_aps)
+        return sky_encode_req_bin(buff, buff_len, creq);
+
+    int32_t len = sky_encode_req_bin(buff, buff_len, &delta);
+    creq->header = delta.header;
+    creq->payload_ext = delta.payload_ext;
+    return len;
+}
+
+// received by the client from the server
+void sky_delta_update(struct sky_delta_t *base, const struct location_rq_t *creq, uint8_t rsp_type) {
+    base->base_id = 0;
+    base->ap_count = 0;
+
+    // the gateway stores the scan before the api server request
+    switch (rsp_type) {
+    case LOCATION_RQ_SUCCESS:
+    case LOCATION_RQ_ADDR_SUCCESS:
+    case LOCATION_API_ERROR:
+    case LOCATION_UNABLE_TO_DETERMINE:
+        break;
+    default:
+        return;
+    }
+    if (creq->rq_id == 0 || creq->mac_count == 0 || creq->ap_count > MAX_APS)
+        return;
+    memcpy(base->aps, creq->aps, creq->ap_count * sizeof(struct ap_t));
+    qsort(base->aps, creq->ap_count, sizeof(struct ap_t), sky_cmp_ap_mac);
+    if (sky_has_dup_macs(base->aps, creq->ap_count))
+        return;
+    base->ap_count = creq->ap_count;
+    base->base_id = creq->rq_id;
+}
+
+// payload types of a response or of the response to a scan, without data entries
+// but the request id unless it is a success
+static bool sky_check_resp_type(uint8_t type) {
+    switch (type) {
+    case LOCATION_RQ_SUCCESS:
+    case LOCATION_RQ_ADDR_SUCCESS:
+    case PROBE_REQUEST_SUCCESS:
+    case LOCATION_RQ_ERROR:
+    case LOCATION_GATEWAY_ERROR:
+    case LOCATION_API_ERROR:
+    case LOCATION_UNKNOWN:
+    case LOCATION_UNABLE_TO_DETERMINE:
+    case LOCATION_RQ_BASE_UNKNOWN:
+        return true;
+    default:
+        fprintf(stderr, "Unknown payload type %d\n", type);
+        return false;
+    }
+}
+
+// reads the data entries of the response in place in buffer, from p_entry_ex at
+// payload_offset up to the padding, the end of the payload or a DATA_TYPE_SCAN entry
+// returns 1 at a DATA_TYPE_SCAN entry, 0 at the end or -1 when fails
+static int32_t sky_get_resp_entries(uint8_t *buff, uint32_t buff_len, sky_entry_ext_t * p_entry_ex,
+        uint32_t * payload_offset, uint32_t payload_length, struct location_rsp_t *cresp) {
+    while (*payload_offset < payload_length) {
+        uint8_t data_type = p_entry_ex->entry->data_type & ~SKY_ENTRY_EXT;
+        // the padding can be a single byte
+        if (p_entry_ex->entry->data_type == DATA_TYPE_PAD)
+            return 0; // success
+        if (!sky_entry_fits(buff, buff_len, p_entry_ex, *payload_offset, payload_length, 0)) {
+            perror("invalid data entry");
+            return -1;
+        }
+        uint32_t count = sky_get_entry_count(p_entry_ex);
+        if (!sky_entry_fits(buff, buff_len, p_entry_ex, *payload_offset, payload_length, count)) {
+            perror("invalid data entry");
+            return -1;
+        }
+        // the mac and ip lengths are one byte
+        if (count > UINT8_MAX && (data_type == DATA_TYPE_MAC
+                || data_type == DATA_TYPE_IPV4 || data_type == DATA_TYPE_IPV6)) {
+            perror("data entry too long");
+            return -1;
+        }
+        switch (data_type) {
+        case DATA_TYPE_RQ_ID:
+            if (count != SKY_RQ_ID_SIZE) {
+                perror("invalid request id");
+                return -1;
+            }
+            memcpy(&cresp->rq_id, p_entry_ex->data, count);
+            break;
         case DATA_TYPE_MAC:
-            cresp->location_ext.mac_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.mac_len = count;
             cresp->location_ext.mac = p_entry_ex->data;
             break;
         case DATA_TYPE_IPV4:
             cresp->location_ext.ip_type = DATA_TYPE_IPV4;
-            cresp->location_ext.ip_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.ip_len = count;
             cresp->location_ext.ip_addr = p_entry_ex->data;
             break;
         case DATA_TYPE_IPV6:
             cresp->location_ext.ip_type = DATA_TYPE_IPV6;
-            cresp->location_ext.ip_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.ip_len = count;
             cresp->location_ext.ip_addr = p_entry_ex->data;
             break;
         case DATA_TYPE_LAT_LON:
+            if (count != sizeof(cresp->location)) {
+                perror("invalid location");
+                return -1;
+            }
 #ifdef __BIG_ENDIAN__
             sky_location_endian_swap(&cresp->location);
 #endif
-            memcpy(&cresp->location, p_entry_ex->data, p_entry_ex->entry->data_type_count);
+            memcpy(&cresp->location, p_entry_ex->data, count);
             break;
         case DATA_TYPE_STREET_NUM:
-            cresp->location_ext.street_num_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.street_num_len = count;
             cresp->location_ext.street_num = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_ADDRESS:
-            cresp->location_ext.address_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.address_len = count;
             cresp->location_ext.address = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_CITY:
-            cresp->location_ext.city_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.city_len = count;
             cresp->location_ext.city = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_STATE:
-            cresp->location_ext.state_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.state_len = count;
             cresp->location_ext.state = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_STATE_CODE:
-            cresp->location_ext.state_code_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.state_code_len = count;
             cresp->location_ext.state_code = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_METRO1:
-            cresp->location_ext.metro1_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.metro1_len = count;
             cresp->location_ext.metro1 = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_METRO2:
-            cresp->location_ext.metro2_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.metro2_len = count;
             cresp->location_ext.metro2 = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_POSTAL_CODE:
-            cresp->location_ext.postal_code_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.postal_code_len = count;
             cresp->location_ext.postal_code = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_COUNTY:
-            cresp->location_ext.county_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.county_len = count;
             cresp->location_ext.county = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_COUNTRY:
-            cresp->location_ext.country_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.country_len = count;
             cresp->location_ext.country = (char *)p_entry_ex->data;
             break;
         case DATA_TYPE_COUNTRY_CODE:
-            cresp->location_ext.country_code_len = p_entry_ex->entry->data_type_count;
+            cresp->location_ext.country_code_len = count;
             cresp->location_ext.country_code = (char *)p_entry_ex->data;
             break;
-        case DATA_TYPE_PAD:
-            return 0; // success
+        case DATA_TYPE_SCAN:
+            return 1;
         default:
             perror("unknown data type");
             return -1;
         }
-        payload_offset += sizeof(sky_entry_t) + p_entry_ex->entry->data_type_count;
-        adjust_data_entry(buff, buff_len, sizeof(sky_rsp_header_t) + payload_offset, p_entry_ex);
+        *payload_offset += (p_entry_ex->data - (uint8_t *)p_entry_ex->entry) + count;
+        adjust_data_entry(buff, buff_len, sizeof(sky_rsp_header_t) + *payload_offset, p_entry_ex);
     }
     return 0; // success
 }
+
+// reads the header, the payload and the data entries of the response, and the responses to the scans of a batch
+// from the data_len bytes received
+// returns the # of scans or -1 when fails
+static int32_t sky_decode_resp(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rsp_t *cresp, struct location_rsp_t *scans, uint32_t max_scans) {
+    uint32_t n = 0;
+
+    if (data_len > buff_len) {
+        perror("invalid packet length");
+        return -1;
+    }
+    buff_len = data_len;
+    memset(&cresp->header, 0, sizeof(cresp->header));
+    cresp->rq_id = 0;
+    if (!sky_get_header(buff, buff_len, (uint8_t *)&cresp->header, sizeof(cresp->header)))
+        return -1;
+    if (buff_len < sizeof(sky_rsp_header_t) + cresp->header.payload_length
+            + sky_trailer_len(cresp->header.version)) {
+        perror("invalid packet length");
+        return -1;
+    }
+    // sealed packets are verified by sky_open_packet
+    if (!sky_is_aead(cresp->header.version)
+            && !sky_verify_checksum(buff, buff_len, (uint8_t)sizeof(cresp->header), cresp->header.payload_length))
+        return -1;
+    if (!sky_get_payload(buff, buff_len, sizeof(sky_rsp_header_t), &cresp->payload_ext, cresp->header.payload_length))
+        return -1;
+
+    // the responses to the scans follow the data entries of a batch
+    if (cresp->payload_ext.payload.type == LOCATION_RQ_BATCH_SUCCESS) {
+        if (scans == NULL) {
+            fprintf(stderr, "Unknown payload type %d\n", cresp->payload_ext.payload.type);
+            return -1;
+        }
+    } else if (!sky_check_resp_type(cresp->payload_ext.payload.type)) {
+        return -1;
+    }
+
+    // read data entries from buffer
+    // latitude, longitude and full address, etc.
+    sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
+    uint32_t payload_offset = sizeof(sky_payload_t);
+    int32_t rc = sky_get_resp_entries(buff, buff_len, p_entry_ex, &payload_offset, cresp->header.payload_length, cresp);
+    while (rc > 0) {
+        if (n == max_scans) {
+            perror("too many scans");
+            return -1;
+        }
+        struct location_rsp_t * scan = &scans[n++];
+        memset(scan, 0, sizeof(*scan));
+        scan->header = cresp->header;
+        if (p_entry_ex->entry->data_type != DATA_TYPE_SCAN
+                || p_entry_ex->entry->data_type_count != sizeof(sky_payload_t)
+                || payload_offset + sizeof(sky_entry_t) + sizeof(sky_payload_t) > cresp->header.payload_length) {
+            perror("invalid scan");
+            return -1;
+        }
+        memcpy(&scan->payload_ext.payload, p_entry_ex->data, sizeof(sky_payload_t));
+        if (!sky_check_resp_type(scan->payload_ext.payload.type))
+            return -1;
+        payload_offset += sizeof(sky_entry_t) + sizeof(sky_payload_t);
+        adjust_data_entry(buff, buff_len, sizeof(sky_rsp_header_t) + payload_offset, p_entry_ex);
+        rc = sky_get_resp_entries(buff, buff_len, p_entry_ex, &payload_offset, cresp->header.payload_length, scan);
+    }
+    return rc < 0 ? -1 : (int32_t)n;
+}
+
+// received by the client from the server
+/* decodes the binary data and the result is in the location_resp_t struct */
+int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rsp_t *cresp) {
+    return sky_decode_resp(buff, buff_len, data_len, cresp, NULL, 0);
+}
+
+// received by the client from the server
+int32_t sky_decode_resp_batch(uint8_t *buff, uint32_t buff_len, uint32_t data_len,
+        struct location_rsp_t *batch, struct location_rsp_t *scans, uint32_t max_scans) {
+    int32_t n = sky_decode_resp(buff, buff_len, data_len, batch, scans, max_scans);
+
+    if (n >= 0 && batch->payload_ext.payload.type != LOCATION_RQ_BATCH_SUCCESS) {
+        fprintf(stderr, "Unknown payload type %d\n", batch->payload_ext.payload.type);
+        return -1;
+    }
+    return n;
+}
+
+// probe requests have no data entries, they are recognized by the payload
+// length in the header and verified on a copy of the packet
+bool sky_is_probe_rq(const uint8_t *buff, uint32_t data_len, const uint8_t *key) {
+    uint8_t packet[sizeof(sky_rq_header_t) + 16 + SKY_AEAD_TAG_SIZE];
+    sky_rq_header_t header;
+
+    if (!sky_get_header(buff, data_len, (uint8_t *)&header, sizeof(header)))
+        return false;
+    bool aead = sky_is_aead(header.version);
+    uint32_t payload_len = aead ? sizeof(sky_payload_t) : 16; // padded to 16 bytes
+    uint32_t len = sizeof(header) + payload_len + sky_trailer_len(header.version);
+    if (header.payload_length != payload_len || data_len < len)
+        return false;
+
+    memcpy(packet, buff, len);
+    if (aead) {
+        if (sky_open_packet(packet, len, sizeof(header), key) < 0)
+            return false;
+    } else {
+        if (sky_aes_decrypt(packet + sizeof(header), payload_len, (uint8_t *)key, header.iv) < 0)
+            return false;
+        // the checksum authenticates the probe, sky_verify_checksum only reports a mismatch
+        sky_checksum_t cs = *(sky_checksum_t *)(packet + sizeof(header) + payload_len); // little endianness
+        SKY_ENDIAN_SWAP(cs);
+        if (cs != fletcher16(packet, sizeof(header) + payload_len))
+            return false;
+    }
+    return packet[sizeof(header) + sizeof(sky_payload_t) - 1] == PROBE_REQUEST;
+}
+
+// Return the length of the sealed packet in buff, or 0 if it is invalid.
+inline
+uint32_t sky_aead_packet_len(const uint8_t *buff, uint32_t buff_len, uint32_t header_len) {
+    if (header_len != sizeof(sky_rq_header_t) && header_len != sizeof(sky_rsp_header_t)) {
+        perror("invalid header length");
+        return 0;
+    }
+    if (buff_len < header_len) {
+        perror("buffer too small");
+        return 0;
+    }
+    // version and payload length are at the same offsets in both headers
+    if (!sky_is_aead(buff[0])) {
+        fprintf(stderr, "protocol version %d is not sealed\n", buff[0]);
+        return 0;
+    }
+    uint32_t payload_len = buff[2] | (uint32_t)buff[3] << 8; // little endianness
+    if (buff_len < header_len + payload_len + SKY_AEAD_TAG_SIZE) {
+        perror("buffer too small");
+        return 0;
+    }
+    return header_len + payload_len + SKY_AEAD_TAG_SIZE;
+}
+
+// encrypts and authenticates the packet in place
+// the iv is the last field of both headers, the header is the associated data
+int32_t sky_seal_packet(uint8_t *buff, uint32_t buff_len, uint32_t header_len,
+        const uint8_t *key) {
+    uint32_t len = sky_aead_packet_len(buff, buff_len, header_len);
+    if (len == 0)
+        return -1;
+
+    uint8_t * iv = buff + header_len - 16;
+    memset(iv, 0, 16);
+    if (sky_gen_nonce(iv) < 0)
+        return -1;
+    uint32_t payload_len = len - header_len - SKY_AEAD_TAG_SIZE;
+    if (sky_gcm_seal(key, iv, buff, header_len, buff + header_len, payload_len,
+            buff + header_len + payload_len) < 0)
+        return -1;
+    return len;
+}
+
+// verifies and decrypts the packet in place
+int32_t sky_open_packet(uint8_t *buff, uint32_t data_len, uint32_t header_len,
+        const uint8_t *key) {
+    uint32_t len = sky_aead_packet_len(buff, data_len, header_len);
+    if (len == 0)
+        return -1;
+
+    uint32_t payload_len = len - header_len - SKY_AEAD_TAG_SIZE;
+    if (sky_gcm_open(key, buff + header_len - 16, buff, header_len, buff + header_len, payload_len,
+            buff + header_len + payload_len) < 0)
+        return -1;
+    return len;
+}
+
+int32_t sky_rq_bin_len(const struct location_rq_t *creq) {
+    uint32_t payload_length;
+
+    // the packing copies the access points into an array of MAX_APS
+    if (!check_rq_max_counts(creq))
+        return -1;
+
+    if (creq->header.version == SKY_PROTOCOL_VERSION_COMPACT || sky_is_aead(creq->header.version)) {
+        // dry run of the packing
+        sky_cursor_t c = { NULL, NULL, 0 };
+        if (!sky_put_compact_req(&c, creq))
+            return -1;
+        payload_length = sizeof(sky_payload_t) + c.count;
+    } else {
+        int32_t len = sky_rq_payload_len(creq);
+        if (len < 0)
+            return -1;
+        payload_length = len;
+    }
+    if (!sky_is_aead(creq->header.version))
+        payload_length += pad_16(payload_length);
+    return sizeof(sky_rq_header_t) + payload_length + sky_trailer_len(creq->header.version);
+}
+
+uint32_t sky_resp_bin_len(const struct location_rsp_t *cresp) {
+    uint32_t payload_length = sky_resp_payload_len(cresp);
+
+    if (!sky_is_aead(cresp->header.version))
+        payload_length += pad_16(payload_length);
+    return sizeof(sky_rsp_header_t) + payload_length + sky_trailer_len(cresp->header.version);
+}
+
+uint32_t sky_rq_buff_len(const struct sky_limits_t *limits) {
+    // a packed entry is never longer than its struct, cells are counted at the largest
+    return sizeof(sky_rq_header_t) + sizeof(sky_payload_t) + 15 + SKY_AEAD_TAG_SIZE
+        + (sizeof(sky_entry_t) + SKY_RQ_ID_SIZE)
+        + (sizeof(sky_entry_t) + SKY_RQ_ID_SIZE) // base request id
+        + SKY_ENTRY_LEN(limits->max_aps) // removed access points, in place of access points
+        + (sizeof(sky_entry_t) + limits->max_macs * MAC_SIZE)
+        + (sizeof(sky_entry_t) + limits->max_ips * IPV6_SIZE)
+        + (SKY_ENTRY_LEN(limits->max_aps) + limits->max_aps * sizeof(struct ap_t))
+        + (sizeof(sky_entry_t) + limits->max_gpss * sizeof(struct gps_t))
+        + (sizeof(sky_entry_t) + limits->max_cells * sizeof(union cell_t))
+        + (sizeof(sky_entry_t) + limits->max_bles * sizeof(struct ble_t));
+}
+
+uint32_t sky_buff_class(uint32_t len) {
+    uint32_t size = SKY_BUFF_CLASS_MIN;
+    while (size < len)
+        size <<= 1;
+    return size;
+}
@@ -38,9 +38,8 @@ int32_t sky_aes_encrypt(uint8_t *data, uint32_t data_len, uint8_t *key,
         return -1;
     }
 
-    uint8_t output[data_len];
-    AES128_CBC_encrypt_buffer(output, data, data_len, key, iv);
-    memcpy(data, output, data_len);
+    // each block is encrypted after it is xor'ed in place, so it is done in place
+    AES128_CBC_encrypt_buffer(data, data, data_len, key, iv);
     return 0;
 }
 
@@ -0,0 +1,559 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+/* AES-128-GCM (NIST SP 800-38D) with 96-bit nonce and 128-bit tag.
+ *
+ * On x86 cpus with AES-NI and PCLMULQDQ the block cipher and GHASH run on the
+ * instructions, checked at run time; otherwise a table driven software
+ * implementation is used (32-bit T-tables for AES, 4-bit Shoup tables for GHASH).
+ * Build with -DSKY_GCM_NO_HW to always use the software implementation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "sky_crypt.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(SKY_GCM_NO_HW)
+#define SKY_GCM_HW
+#include <immintrin.h>
+#endif
+
+#define GCM_BLOCK_SIZE 16
+
+// the key schedule and hash key of the last key used by the thread
+struct sky_gcm_ctx_t {
+#ifdef SKY_GCM_HW
+    __m128i rk_hw[11];         // AES-NI round keys
+    __m128i h_hw;              // byte reflected hash key
+#endif
+    uint32_t rk[44];           // software round keys
+    uint64_t hl[16];           // software GHASH table, low halves
+    uint64_t hh[16];           // software GHASH table, high halves
+    uint8_t key[16];
+    bool hw;                   // use AES-NI and PCLMULQDQ
+};
+
+static __thread struct sky_gcm_ctx_t sky_gcm_ctx;
+static __thread bool sky_gcm_ctx_init = false;
+
+//
+// software AES-128 encryption
+//
+
+static uint8_t sky_sbox[256];
+static uint32_t sky_te0[256];
+static pthread_once_t sky_tables_once = PTHREAD_ONCE_INIT;
+
+#define ROTL8(x, n)   ((uint8_t)(((x) << (n)) | ((x) >> (8 - (n)))))
+#define ROTR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define GET_BE32(p)   ((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | (uint32_t)(p)[2] << 8 | (p)[3])
+#define PUT_BE32(p, v) do { (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); \
+                            (p)[2] = (uint8_t)((v) >> 8); (p)[3] = (uint8_t)(v); } while (0)
+
+static uint8_t xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1B : 0));
+}
+
+// generate the s-box and the T-table instead of storing them
+static void sky_init_tables(void) {
+    uint8_t p = 1, q = 1;
+    int32_t i;
+
+    do {
+        // p * 3 and q / 3 walk the multiplicative group, so q = p^-1
+        p = p ^ xtime(p);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80)
+            q ^= 0x09;
+        sky_sbox[p] = q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4) ^ 0x63;
+    } while (p != 1);
+    sky_sbox[0] = 0x63;
+
+    for (i = 0; i < 256; i++) {
+        uint8_t s = sky_sbox[i];
+        uint8_t s2 = xtime(s);
+        sky_te0[i] = (uint32_t)s2 << 24 | (uint32_t)s << 16 | (uint32_t)s << 8 | (uint8_t)(s2 ^ s);
+    }
+}
+
+static uint32_t sky_sub_word(uint32_t w) {
+    return (uint32_t)sky_sbox[w >> 24] << 24 | (uint32_t)sky_sbox[(w >> 16) & 0xFF] << 16
+            | (uint32_t)sky_sbox[(w >> 8) & 0xFF] << 8 | sky_sbox[w & 0xFF];
+}
+
+static void sky_aes_key_expansion(uint32_t *rk, const uint8_t *key) {
+    static const uint8_t rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36 };
+    int32_t i;
+
+    for (i = 0; i < 4; i++)
+        rk[i] = GET_BE32(key + 4 * i);
+    for (i = 4; i < 44; i++) {
+        uint32_t t = rk[i - 1];
+        if ((i & 3) == 0)
+            t = sky_sub_word((t << 8) | (t >> 24)) ^ ((uint32_t)rcon[i / 4 - 1] << 24);
+        rk[i] = rk[i - 4] ^ t;
+    }
+}
+
+#define TE(a, b, c, d) (sky_te0[(a) >> 24] ^ ROTR32(sky_te0[((b) >> 16) & 0xFF], 8) \
+        ^ ROTR32(sky_te0[((c) >> 8) & 0xFF], 16) ^ ROTR32(sky_te0[(d) & 0xFF], 24))
+#define SB(a, b, c, d) ((uint32_t)sky_sbox[(a) >> 24] << 24 | (uint32_t)sky_sbox[((b) >> 16) & 0xFF] << 16 \
+        | (uint32_t)sky_sbox[((c) >> 8) & 0xFF] << 8 | sky_sbox[(d) & 0xFF])
+
+static void sky_aes_encrypt_block(const uint32_t *rk, const uint8_t *in, uint8_t *out) {
+    uint32_t s0 = GET_BE32(in) ^ rk[0];
+    uint32_t s1 = GET_BE32(in + 4) ^ rk[1];
+    uint32_t s2 = GET_BE32(in + 8) ^ rk[2];
+    uint32_t s3 = GET_BE32(in + 12) ^ rk[3];
+    uint32_t t0, t1, t2, t3;
+    int32_t r;
+
+    for (r = 1; r < 10; r++) {
+        t0 = TE(s0, s1, s2, s3) ^ rk[4 * r];
+        t1 = TE(s1, s2, s3, s0) ^ rk[4 * r + 1];
+        t2 = TE(s2, s3, s0, s1) ^ rk[4 * r + 2];
+        t3 = TE(s3, s0, s1, s2) ^ rk[4 * r + 3];
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+    t0 = SB(s0, s1, s2, s3) ^ rk[40];
+    t1 = SB(s1, s2, s3, s0) ^ rk[41];
+    t2 = SB(s2, s3, s0, s1) ^ rk[42];
+    t3 = SB(s3, s0, s1, s2) ^ rk[43];
+    PUT_BE32(out, t0);
+    PUT_BE32(out + 4, t1);
+    PUT_BE32(out + 8, t2);
+    PUT_BE32(out + 12, t3);
+}
+
+//
+// software GHASH
+//
+
+static const uint64_t sky_last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+// precompute the multiples of the hash key for the 4-bit table multiplication
+static void sky_ghash_table(struct sky_gcm_ctx_t *ctx, const uint8_t *h) {
+    uint64_t vh = (uint64_t)GET_BE32(h) << 32 | GET_BE32(h + 4);
+    uint64_t vl = (uint64_t)GET_BE32(h + 8) << 32 | GET_BE32(h + 12);
+    int32_t i, j;
+
+    ctx->hl[0] = ctx->hh[0] = 0;
+    ctx->hl[8] = vl;
+    ctx->hh[8] = vh;
+    for (i = 4; i > 0; i >>= 1) {
+        uint32_t t = (vl & 1) * 0xe1000000U;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ ((uint64_t)t << 32);
+        ctx->hl[i] = vl;
+        ctx->hh[i] = vh;
+    }
+    for (i = 2; i <= 8; i *= 2) {
+        for (j = 1; j < i; j++) {
+            ctx->hh[i + j] = ctx->hh[i] ^ ctx->hh[j];
+            ctx->hl[i + j] = ctx->hl[i] ^ ctx->hl[j];
+        }
+    }
+}
+
+// x = x * H
+static void sky_ghash_mult(const struct sky_gcm_ctx_t *ctx, uint8_t *x) {
+    uint8_t lo = x[15] & 0x0F, hi, rem;
+    uint64_t zh = ctx->hh[lo], zl = ctx->hl[lo];
+    int32_t i;
+
+    for (i = 15; i >= 0; i--) {
+        lo = x[i] & 0x0F;
+        hi = x[i] >> 4;
+        if (i != 15) {
+            rem = (uint8_t)zl & 0x0F;
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (sky_last4[rem] << 48) ^ ctx->hh[lo];
+            zl ^= ctx->hl[lo];
+        }
+        rem = (uint8_t)zl & 0x0F;
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (sky_last4[rem] << 48) ^ ctx->hh[hi];
+        zl ^= ctx->hl[hi];
+    }
+    PUT_BE32(x, (uint32_t)(zh >> 32));
+    PUT_BE32(x + 4, (uint32_t)zh);
+    PUT_BE32(x + 8, (uint32_t)(zl >> 32));
+    PUT_BE32(x + 12, (uint32_t)zl);
+}
+
+static void sky_ghash_update(const struct sky_gcm_ctx_t *ctx, uint8_t *y, const uint8_t *data, uint32_t len) {
+    uint32_t i, j;
+    for (i = 0; i < len; i += GCM_BLOCK_SIZE) {
+        uint32_t n = (len - i < GCM_BLOCK_SIZE) ? len - i : GCM_BLOCK_SIZE;
+        for (j = 0; j < n; j++)
+            y[j] ^= data[i + j];
+        sky_ghash_mult(ctx, y);
+    }
+}
+
+static void sky_inc32(uint8_t *ctr) {
+    int32_t i;
+    for (i = 15; i >= 12; i--)
+        if (++ctr[i] != 0)
+            break;
+}
+
+static void sky_gcm_crypt_sw(const struct sky_gcm_ctx_t *ctx, const uint8_t *nonce,
+        const uint8_t *aad, uint32_t aad_len, uint8_t *data, uint32_t len, uint8_t *tag, bool encrypt) {
+    uint8_t y[GCM_BLOCK_SIZE], ctr[GCM_BLOCK_SIZE], ks[GCM_BLOCK_SIZE];
+    uint32_t i, j;
+
+    memset(y, 0, sizeof(y));
+    sky_ghash_update(ctx, y, aad, aad_len);
+
+    memcpy(ctr, nonce, SKY_AEAD_NONCE_SIZE);
+    ctr[12] = ctr[13] = ctr[14] = 0;
+    ctr[15] = 1;
+    sky_aes_encrypt_block(ctx->rk, ctr, tag); // E(K, J0)
+
+    for (i = 0; i < len; i += GCM_BLOCK_SIZE) {
+        uint32_t n = (len - i < GCM_BLOCK_SIZE) ? len - i : GCM_BLOCK_SIZE;
+        sky_inc32(ctr);
+        sky_aes_encrypt_block(ctx->rk, ctr, ks);
+        if (!encrypt)
+            sky_ghash_update(ctx, y, data + i, n);
+        for (j = 0; j < n; j++)
+            data[i + j] ^= ks[j];
+        if (encrypt)
+            sky_ghash_update(ctx, y, data + i, n);
+    }
+
+    // lengths in bits
+    uint8_t lens[GCM_BLOCK_SIZE];
+    PUT_BE32(lens, 0);
+    PUT_BE32(lens + 4, aad_len << 3);
+    PUT_BE32(lens + 8, 0);
+    PUT_BE32(lens + 12, len << 3);
+    sky_ghash_update(ctx, y, lens, sizeof(lens));
+
+    for (j = 0; j < GCM_BLOCK_SIZE; j++)
+        tag[j] ^= y[j];
+}
+
+#ifdef SKY_GCM_HW
+//
+// AES-NI and PCLMULQDQ
+//
+
+#define SKY_TARGET_HW __attribute__((target("aes,pclmul,ssse3")))
+
+SKY_TARGET_HW
+static __m128i sky_aesni_expand(__m128i k, __m128i kg) {
+    kg = _mm_shuffle_epi32(kg, 0xFF);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, kg);
+}
+
+#define AESNI_EXPAND(i, rcon) \
+    rk[i] = sky_aesni_expand(rk[(i) - 1], _mm_aeskeygenassist_si128(rk[(i) - 1], rcon))
+
+SKY_TARGET_HW
+static void sky_aesni_key_expansion(__m128i *rk, const uint8_t *key) {
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    AESNI_EXPAND(1, 0x01);
+    AESNI_EXPAND(2, 0x02);
+    AESNI_EXPAND(3, 0x04);
+    AESNI_EXPAND(4, 0x08);
+    AESNI_EXPAND(5, 0x10);
+    AESNI_EXPAND(6, 0x20);
+    AESNI_EXPAND(7, 0x40);
+    AESNI_EXPAND(8, 0x80);
+    AESNI_EXPAND(9, 0x1B);
+    AESNI_EXPAND(10, 0x36);
+}
+
+SKY_TARGET_HW
+static __m128i sky_aesni_encrypt(const __m128i *rk, __m128i x) {
+    int32_t r;
+    x = _mm_xor_si128(x, rk[0]);
+    for (r = 1; r < 10; r++)
+        x = _mm_aesenc_si128(x, rk[r]);
+    return _mm_aesenclast_si128(x, rk[10]);
+}
+
+// carry-less multiplication of byte reflected operands in GF(2^128)
+// (Intel, Carry-Less Multiplication and Its Usage for Computing the GCM Mode, algorithm 1)
+SKY_TARGET_HW
+static __m128i sky_gfmul(__m128i a, __m128i b) {
+    __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+    t3 = _mm_clmulepi64_si128(a, b, 0x00);
+    t4 = _mm_clmulepi64_si128(a, b, 0x10);
+    t5 = _mm_clmulepi64_si128(a, b, 0x01);
+    t6 = _mm_clmulepi64_si128(a, b, 0x11);
+    t4 = _mm_xor_si128(t4, t5);
+    t5 = _mm_slli_si128(t4, 8);
+    t4 = _mm_srli_si128(t4, 8);
+    t3 = _mm_xor_si128(t3, t5);
+    t6 = _mm_xor_si128(t6, t4);
+
+    // shift the 256-bit product left by 1
+    t7 = _mm_srli_epi32(t3, 31);
+    t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+
+    // reduce modulo x^128 + x^7 + x^2 + x + 1
+    t7 = _mm_slli_epi32(t3, 31);
+    t8 = _mm_slli_epi32(t3, 30);
+    t9 = _mm_slli_epi32(t3, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+    t2 = _mm_srli_epi32(t3, 1);
+    t4 = _mm_srli_epi32(t3, 2);
+    t5 = _mm_srli_epi32(t3, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+// load up to 16 bytes, zero padded
+SKY_TARGET_HW
+static __m128i sky_load_partial(const uint8_t *p, uint32_t n) {
+    uint8_t block[GCM_BLOCK_SIZE];
+    if (n == GCM_BLOCK_SIZE)
+        return _mm_loadu_si128((const __m128i *)p);
+    memset(block, 0, sizeof(block));
+    memcpy(block, p, n);
+    return _mm_loadu_si128((const __m128i *)block);
+}
+
+SKY_TARGET_HW
+static void sky_gcm_init_hw(struct sky_gcm_ctx_t *ctx, const uint8_t *key) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    sky_aesni_key_expansion(ctx->rk_hw, key);
+    ctx->h_hw = _mm_shuffle_epi8(sky_aesni_encrypt(ctx->rk_hw, _mm_setzero_si128()), bswap);
+}
+
+SKY_TARGET_HW
+static void sky_gcm_crypt_hw(const struct sky_gcm_ctx_t *ctx, const uint8_t *nonce,
+        const uint8_t *aad, uint32_t aad_len, uint8_t *data, uint32_t len, uint8_t *tag, bool encrypt) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    const __m128i *rk = ctx->rk_hw;
+    __m128i h = ctx->h_hw;
+    __m128i y = _mm_setzero_si128();
+    uint8_t j0[GCM_BLOCK_SIZE];
+    uint32_t i, n, r;
+
+    for (i = 0; i < aad_len; i += GCM_BLOCK_SIZE) {
+        n = (aad_len - i < GCM_BLOCK_SIZE) ? aad_len - i : GCM_BLOCK_SIZE;
+        y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(sky_load_partial(aad + i, n), bswap)), h);
+    }
+
+    memcpy(j0, nonce, SKY_AEAD_NONCE_SIZE);
+    j0[12] = j0[13] = j0[14] = 0;
+    j0[15] = 1;
+    __m128i ctr = _mm_loadu_si128((const __m128i *)j0);
+    __m128i ekj0 = sky_aesni_encrypt(rk, ctr);
+    ctr = _mm_shuffle_epi8(ctr, bswap); // the 32-bit counter is the low lane now
+
+    // 4 blocks at a time to keep the AES pipeline busy
+    for (i = 0; i + 4 * GCM_BLOCK_SIZE <= len; i += 4 * GCM_BLOCK_SIZE) {
+        __m128i c0 = _mm_shuffle_epi8(ctr = _mm_add_epi32(ctr, one), bswap);
+        __m128i c1 = _mm_shuffle_epi8(ctr = _mm_add_epi32(ctr, one), bswap);
+        __m128i c2 = _mm_shuffle_epi8(ctr = _mm_add_epi32(ctr, one), bswap);
+        __m128i c3 = _mm_shuffle_epi8(ctr = _mm_add_epi32(ctr, one), bswap);
+        c0 = _mm_xor_si128(c0, rk[0]);
+        c1 = _mm_xor_si128(c1, rk[0]);
+        c2 = _mm_xor_si128(c2, rk[0]);
+        c3 = _mm_xor_si128(c3, rk[0]);
+        for (r = 1; r < 10; r++) {
+            c0 = _mm_aesenc_si128(c0, rk[r]);
+            c1 = _mm_aesenc_si128(c1, rk[r]);
+            c2 = _mm_aesenc_si128(c2, rk[r]);
+            c3 = _mm_aesenc_si128(c3, rk[r]);
+        }
+        c0 = _mm_aesenclast_si128(c0, rk[10]);
+        c1 = _mm_aesenclast_si128(c1, rk[10]);
+        c2 = _mm_aesenclast_si128(c2, rk[10]);
+        c3 = _mm_aesenclast_si128(c3, rk[10]);
+
+        __m128i *p = (__m128i *)(data + i);
+        __m128i d0 = _mm_loadu_si128(p);
+        __m128i d1 = _mm_loadu_si128(p + 1);
+        __m128i d2 = _mm_loadu_si128(p + 2);
+        __m128i d3 = _mm_loadu_si128(p + 3);
+        c0 = _mm_xor_si128(c0, d0);
+        c1 = _mm_xor_si128(c1, d1);
+        c2 = _mm_xor_si128(c2, d2);
+        c3 = _mm_xor_si128(c3, d3);
+        _mm_storeu_si128(p, c0);
+        _mm_storeu_si128(p + 1, c1);
+        _mm_storeu_si128(p + 2, c2);
+        _mm_storeu_si128(p + 3, c3);
+        if (encrypt) {
+            d0 = c0, d1 = c1, d2 = c2, d3 = c3;
+        }
+        y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(d0, bswap)), h);
+        y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(d1, bswap)), h);
+        y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(d2, bswap)), h);
+        y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(d3, bswap)), h);
+    }
+    for (; i < len; i += GCM_BLOCK_SIZE) {
+        uint8_t block[GCM_BLOCK_SIZE];
+        n = (len - i < GCM_BLOCK_SIZE) ? len - i : GCM_BLOCK_SIZE;
+        ctr = _mm_add_epi32(ctr, one);
+        __m128i ks = sky_aesni_encrypt(rk, _mm_shuffle_epi8(ctr, bswap));
+        __m128i d = sky_load_partial(data + i, n);
+        if (!encrypt)
+            y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(d, bswap)), h);
+        _mm_storeu_si128((__m128i *)block, _mm_xor_si128(d, ks));
+        memcpy(data + i, block, n);
+        if (encrypt)
+            y = sky_gfmul(_mm_xor_si128(y, _mm_shuffle_epi8(sky_load_partial(data + i, n), bswap)), h);
+    }
+
+    // lengths in bits
+    __m128i lens = _mm_set_epi64x((int64_t)aad_len << 3, (int64_t)len << 3);
+    y = sky_gfmul(_mm_xor_si128(y, lens), h);
+    _mm_storeu_si128((__m128i *)tag, _mm_xor_si128(_mm_shuffle_epi8(y, bswap), ekj0));
+}
+#endif
+
+// return the context of the key, the thread keeps the last one
+static const struct sky_gcm_ctx_t * sky_gcm_get_ctx(const uint8_t *key) {
+    struct sky_gcm_ctx_t *ctx = &sky_gcm_ctx;
+
+    if (sky_gcm_ctx_init && memcmp(ctx->key, key, sizeof(ctx->key)) == 0)
+        return ctx;
+
+    memcpy(ctx->key, key, sizeof(ctx->key));
+#ifdef SKY_GCM_HW
+    __builtin_cpu_init();
+    ctx->hw = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul")
+            && __builtin_cpu_supports("ssse3");
+    if (ctx->hw) {
+        sky_gcm_init_hw(ctx, key);
+        sky_gcm_ctx_init = true;
+        return ctx;
+    }
+#else
+    ctx->hw = false;
+#endif
+    uint8_t h[GCM_BLOCK_SIZE];
+    pthread_once(&sky_tables_once, sky_init_tables);
+    sky_aes_key_expansion(ctx->rk, key);
+    memset(h, 0, sizeof(h));
+    sky_aes_encrypt_block(ctx->rk, h, h);
+    sky_ghash_table(ctx, h);
+    sky_gcm_ctx_init = true;
+    return ctx;
+}
+
+static void sky_gcm_crypt(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, uint32_t aad_len,
+        uint8_t *data, uint32_t data_len, uint8_t *tag, bool encrypt) {
+    const struct sky_gcm_ctx_t *ctx = sky_gcm_get_ctx(key);
+#ifdef SKY_GCM_HW
+    if (ctx->hw) {
+        sky_gcm_crypt_hw(ctx, nonce, aad, aad_len, data, data_len, tag, encrypt);
+        return;
+    }
+#endif
+    sky_gcm_crypt_sw(ctx, nonce, aad, aad_len, data, data_len, tag, encrypt);
+}
+
+int32_t sky_gcm_seal(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, uint32_t aad_len,
+        uint8_t *data, uint32_t data_len, uint8_t *tag) {
+    sky_gcm_crypt(key, nonce, aad, aad_len, data, data_len, tag, true);
+    return 0;
+}
+
+int32_t sky_gcm_open(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, uint32_t aad_len,
+        uint8_t *data, uint32_t data_len, const uint8_t *tag) {
+    uint8_t expected[SKY_AEAD_TAG_SIZE];
+    uint8_t diff = 0;
+    int32_t i;
+
+    sky_gcm_crypt(key, nonce, aad, aad_len, data, data_len, expected, false);
+    // constant time compare
+    for (i = 0; i < SKY_AEAD_TAG_SIZE; i++)
+        diff |= expected[i] ^ tag[i];
+    if (diff != 0) {
+        memset(data, 0, data_len); // never release unauthenticated plain text
+        perror("invalid authentication tag");
+        return -1;
+    }
+    return 0;
+}
+
+//
+// nonce: 4 random bytes per process followed by a 64-bit counter starting at a random value,
+// both drawn again in the child of a fork, which would repeat the nonces of its parent
+//
+
+static uint8_t sky_nonce_salt[4];
+static uint64_t sky_nonce_counter;
+static int32_t sky_nonce_rc = -1; // 0 once seeded
+static pthread_once_t sky_nonce_once = PTHREAD_ONCE_INIT;
+
+static void sky_seed_nonce(void) {
+    uint8_t seed[12];
+    size_t n = 0;
+
+    // no fallback to a weaker source, a repeated nonce breaks gcm
+    while (n < sizeof(seed)) {
+        ssize_t rc = getrandom(seed + n, sizeof(seed) - n, 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0) {
+            perror("getrandom failed");
+            sky_nonce_rc = -1;
+            return;
+        }
+        n += rc;
+    }
+    memcpy(sky_nonce_salt, seed, sizeof(sky_nonce_salt));
+    memcpy(&sky_nonce_counter, seed + 4, sizeof(sky_nonce_counter));
+    sky_nonce_rc = 0;
+}
+
+static void sky_init_nonce(void) {
+    sky_seed_nonce();
+    pthread_atfork(NULL, NULL, sky_seed_nonce);
+}
+
+int32_t sky_gen_nonce(uint8_t *nonce) {
+    int32_t i;
+
+    pthread_once(&sky_nonce_once, sky_init_nonce);
+    if (sky_nonce_rc < 0)
+        return -1;
+    uint64_t n = __atomic_fetch_add(&sky_nonce_counter, 1, __ATOMIC_RELAXED);
+    memcpy(nonce, sky_nonce_salt, sizeof(sky_nonce_salt));
+    for (i = 0; i < 8; i++)
+        nonce[4 + i] = (uint8_t)(n >> (56 - 8 * i));
+    return 0;
+}
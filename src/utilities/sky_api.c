@@ -0,0 +1,154 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sky_api.h"
+#include "sky_xml.h"
+#include "sky_json.h"
+
+const char * sky_api_content_type(uint8_t api_format) {
+    switch (api_format) {
+    case API_FORMAT_JSON:
+        return "application/json";
+    default:
+        return "text/xml";
+    }
+}
+
+int32_t sky_encode_req_api(char *buff, int32_t buff_len, const struct location_rq_t *creq) {
+    switch (SKY_KEY(creq).api_format) {
+    case API_FORMAT_XML:
+        return sky_encode_req_xml(buff, buff_len, creq);
+    case API_FORMAT_JSON:
+        return sky_encode_req_json(buff, buff_len, creq);
+    default:
+        fprintf(stderr, "sky_encode_req_api: unknown api format %d\n", SKY_KEY(creq).api_format);
+        return -1;
+    }
+}
+
+static int32_t sky_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// zero, broadcast and multicast MACs are invalid
+static uint32_t sky_valid_mac(const uint8_t *mac) {
+    uint32_t i;
+    if (mac[0] & 0x01)
+        return 0;
+    for (i = 0; i < MAC_SIZE; i++)
+        if (mac[i] != 0)
+            return 1;
+    return 0;
+}
+
+static void sky_swap_u32(uint32_t *a, uint32_t *b) {
+    uint32_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// moves the k largest of the distinct keys to keys[0 .. k-1], quickselect
+static void sky_select_top(uint32_t *keys, uint32_t n, uint32_t k) {
+    uint32_t lo = 0, hi = n, i;
+
+    while (hi - lo > 1) {
+        // middle key as the pivot, the larger keys before it
+        sky_swap_u32(&keys[lo + (hi - lo) / 2], &keys[hi - 1]);
+        uint32_t p = lo;
+        for (i = lo; i < hi - 1; i++)
+            if (keys[i] > keys[hi - 1])
+                sky_swap_u32(&keys[i], &keys[p++]);
+        sky_swap_u32(&keys[p], &keys[hi - 1]);
+
+        if (k == p || k == p + 1)
+            return;
+        if (k < p)
+            hi = p;
+        else
+            lo = p + 1;
+    }
+}
+
+uint32_t sky_select_aps(struct location_rq_t *creq, uint32_t max_aps) {
+    uint64_t macs[MAX_APS];
+    uint32_t keys[MAX_APS];
+    uint8_t keep[MAX_APS];
+    uint32_t ap_count = (creq->ap_count < MAX_APS) ? creq->ap_count : MAX_APS;
+    uint32_t i, j, n = 0;
+
+    // sort by MAC to find the duplicates
+    for (i = 0; i < ap_count; i++) {
+        const struct ap_t *ap = &creq->aps[i];
+        if (!sky_valid_mac(ap->MAC))
+            continue;
+        uint64_t mac = 0;
+        for (j = 0; j < MAC_SIZE; j++)
+            mac = (mac << 8) | ap->MAC[j];
+        macs[n++] = mac << 16 | i;
+    }
+    qsort(macs, n, sizeof(uint64_t), sky_cmp_u64);
+
+    // the strongest of a MAC is kept, with the connected flag of its duplicates
+    memset(keep, 0, sizeof(keep));
+    uint32_t unique = 0;
+    for (i = 0; i < n; i++) {
+        uint16_t index = (uint16_t)macs[i];
+        if (i > 0 && macs[i] >> 16 == macs[i - 1] >> 16) {
+            struct ap_t *kept = &creq->aps[keys[unique - 1]];
+            uint8_t connected = (kept->flag | creq->aps[index].flag) & 0x01;
+            if (creq->aps[index].rssi > kept->rssi) {
+                keys[unique - 1] = index;
+                kept = &creq->aps[index];
+            }
+            kept->flag |= connected;
+            continue;
+        }
+        keys[unique++] = index;
+    }
+
+    // keys of the unique access points: connected bit, rssi and index
+    for (i = 0; i < unique; i++) {
+        const struct ap_t *ap = &creq->aps[keys[i]];
+        keys[i] = (uint32_t)(ap->flag & 0x01) << 24 | (uint32_t)(uint8_t)(ap->rssi - INT8_MIN) << 16 | keys[i];
+    }
+
+    if (max_aps > 0 && unique > max_aps)
+        sky_select_top(keys, unique, max_aps);
+    else
+        max_aps = unique;
+    for (i = 0; i < max_aps; i++)
+        keep[keys[i] & 0xFFFF] = 1;
+
+    // compact in request order, the access points beyond MAX_APS are dropped too
+    for (i = 0, n = 0; i < ap_count; i++)
+        if (keep[i])
+            creq->aps[n++] = creq->aps[i];
+    uint32_t dropped = creq->ap_count - n;
+    creq->ap_count = (uint16_t)n;
+    return dropped;
+}
+
+int32_t sky_decode_resp_api(char *buff, int32_t buff_len, int32_t data_len,
+        const struct location_rq_t *creq, struct location_rsp_t *cresp) {
+    cresp->rq_id = creq->rq_id; // echoed in the response
+    switch (SKY_KEY(creq).api_format) {
+    case API_FORMAT_XML:
+        // a LOCATION_RQ response carries no address
+        return sky_decode_resp_xml_fields(buff, buff_len, data_len, creq, cresp,
+                creq->payload_ext.payload.type == LOCATION_RQ ? ADDR_FIELD_NONE : ADDR_FIELD_ALL);
+    case API_FORMAT_JSON:
+        return sky_decode_resp_json(buff, buff_len, data_len, creq, cresp);
+    default:
+        fprintf(stderr, "sky_decode_resp_api: unknown api format %d\n", SKY_KEY(creq).api_format);
+        cresp->payload_ext.payload.type = LOCATION_GATEWAY_ERROR;
+        return -1;
+    }
+}
@@ -0,0 +1,259 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "sky_compress.h"
+#include "sky_xml.h"
+
+#ifdef SKY_ZLIB
+#include <stdlib.h>
+#include <pthread.h>
+#include <zlib.h>
+
+// The streams are kept per thread and reset between calls, which avoids
+// allocating the zlib state (about 256 KB for deflate) for each request.
+// They are ended by the destructor of the key when the thread exits.
+struct sky_zstreams_t {
+    z_stream deflate;
+    bool deflate_init;
+    uint8_t deflate_encoding;
+    int32_t deflate_level;
+    z_stream inflate;
+    bool inflate_init;
+};
+
+static pthread_once_t sky_zstreams_once = PTHREAD_ONCE_INIT;
+static pthread_key_t sky_zstreams_key;
+static __thread struct sky_zstreams_t *sky_zstreams;
+
+static void sky_zstreams_thread_exit(void *arg) {
+    struct sky_zstreams_t *zss = arg;
+
+    if (zss->deflate_init)
+        deflateEnd(&zss->deflate);
+    if (zss->inflate_init)
+        inflateEnd(&zss->inflate);
+    free(zss);
+}
+
+static void sky_zstreams_init() {
+    if (pthread_key_create(&sky_zstreams_key, sky_zstreams_thread_exit) != 0)
+        perror("pthread_key_create failed");
+}
+
+static struct sky_zstreams_t * sky_thread_zstreams() {
+    struct sky_zstreams_t *zss = sky_zstreams;
+
+    if (zss != NULL)
+        return zss;
+    pthread_once(&sky_zstreams_once, sky_zstreams_init);
+    if ((zss = calloc(1, sizeof(struct sky_zstreams_t))) == NULL) {
+        perror("calloc failed");
+        return NULL;
+    }
+    pthread_setspecific(sky_zstreams_key, zss);
+    sky_zstreams = zss;
+    return zss;
+}
+
+// return the zlib window bits of the content encoding
+static int32_t sky_window_bits(uint8_t encoding) {
+    return (encoding == CONTENT_ENCODING_GZIP) ? 15 + 16 : 15;
+}
+
+static z_stream * sky_get_deflate_stream(uint8_t encoding, int32_t level) {
+    struct sky_zstreams_t *zss = sky_thread_zstreams();
+
+    if (zss == NULL)
+        return NULL;
+    z_stream * zs = &zss->deflate;
+    if (zss->deflate_init && zss->deflate_encoding == encoding && zss->deflate_level == level) {
+        if (deflateReset(zs) == Z_OK)
+            return zs;
+    }
+    if (zss->deflate_init) {
+        deflateEnd(zs);
+        zss->deflate_init = false;
+    }
+    memset(zs, 0, sizeof(*zs));
+    if (deflateInit2(zs, level, Z_DEFLATED, sky_window_bits(encoding), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        perror("deflateInit2 failed");
+        return NULL;
+    }
+    zss->deflate_init = true;
+    zss->deflate_encoding = encoding;
+    zss->deflate_level = level;
+    return zs;
+}
+
+static z_stream * sky_get_inflate_stream() {
+    struct sky_zstreams_t *zss = sky_thread_zstreams();
+
+    if (zss == NULL)
+        return NULL;
+    z_stream * zs = &zss->inflate;
+    if (zss->inflate_init) {
+        if (inflateReset(zs) == Z_OK)
+            return zs;
+        inflateEnd(zs);
+        zss->inflate_init = false;
+    }
+    memset(zs, 0, sizeof(*zs));
+    // automatic zlib or gzip header detection
+    if (inflateInit2(zs, 15 + 32) != Z_OK) {
+        perror("inflateInit2 failed");
+        return NULL;
+    }
+    zss->inflate_init = true;
+    return zs;
+}
+#endif
+
+const char * sky_content_encoding_name(uint8_t encoding) {
+    switch (encoding) {
+    case CONTENT_ENCODING_DEFLATE:
+        return "deflate";
+    case CONTENT_ENCODING_GZIP:
+        return "gzip";
+    default:
+        return NULL;
+    }
+}
+
+int32_t sky_get_content_encoding(const char *http_header, int32_t header_len) {
+    const char field[] = "Content-Encoding:";
+    const int32_t field_len = sizeof(field) - 1;
+    int32_t i;
+
+    // http header field names are case-insensitive
+    for (i = 0; i + field_len <= header_len; i++) {
+        if ((i == 0 || http_header[i - 1] == '\n')
+                && strncasecmp(http_header + i, field, field_len) == 0)
+            break;
+    }
+    if (i + field_len > header_len)
+        return CONTENT_ENCODING_IDENTITY; // no header field
+
+    const char *p = http_header + i + field_len;
+    const char *end = http_header + header_len;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    int32_t len = 0;
+    while (p + len < end && !isspace((int32_t) p[len]) && p[len] != ';' && p[len] != ',')
+        len++;
+
+    if (len == 8 && strncasecmp(p, "identity", len) == 0)
+        return CONTENT_ENCODING_IDENTITY;
+    if (len == 7 && strncasecmp(p, "deflate", len) == 0)
+        return CONTENT_ENCODING_DEFLATE;
+    if ((len == 4 && strncasecmp(p, "gzip", len) == 0)
+            || (len == 6 && strncasecmp(p, "x-gzip", len) == 0))
+        return CONTENT_ENCODING_GZIP;
+
+    fprintf(stderr, "unsupported content encoding %.*s\n", len, p);
+    return -1;
+}
+
+int32_t sky_compress(uint8_t *buff, int32_t buff_len, const uint8_t *data, int32_t data_len,
+        uint8_t encoding, int32_t level) {
+    if (encoding == CONTENT_ENCODING_IDENTITY) {
+        if (buff_len < data_len) {
+            perror("buffer too small");
+            return -1;
+        }
+        memcpy(buff, data, data_len);
+        return data_len;
+    }
+#ifdef SKY_ZLIB
+    if (encoding != CONTENT_ENCODING_DEFLATE && encoding != CONTENT_ENCODING_GZIP) {
+        fprintf(stderr, "sky_compress: unknown content encoding %d\n", encoding);
+        return -1;
+    }
+    if (level < SKY_COMPRESS_LEVEL_DEFAULT || level > 9) {
+        fprintf(stderr, "sky_compress: invalid compression level %d\n", level);
+        return -1;
+    }
+
+    z_stream * zs = sky_get_deflate_stream(encoding, level);
+    if (zs == NULL)
+        return -1;
+
+    zs->next_in = (Bytef *) data;
+    zs->avail_in = (uInt) data_len;
+    zs->next_out = buff;
+    zs->avail_out = (uInt) buff_len;
+
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        perror("buffer too small");
+        return -1;
+    }
+    return (int32_t) zs->total_out;
+#else
+    (void)level; // suppress warning [-Werror=unused-parameter]
+    perror("compression not supported, build with SKY_ZLIB");
+    return -1;
+#endif
+}
+
+int32_t sky_decompress(char *buff, int32_t buff_len, const uint8_t *data, int32_t data_len,
+        uint8_t encoding) {
+    if (buff_len < 1) {
+        perror("buffer too small");
+        return -1;
+    }
+    if (encoding == CONTENT_ENCODING_IDENTITY) {
+        if (buff_len < data_len + 1) {
+            perror("buffer too small");
+            return -1;
+        }
+        memmove(buff, data, data_len);
+        buff[data_len] = '\0';
+        return data_len;
+    }
+#ifdef SKY_ZLIB
+    if (encoding != CONTENT_ENCODING_DEFLATE && encoding != CONTENT_ENCODING_GZIP) {
+        fprintf(stderr, "sky_decompress: unknown content encoding %d\n", encoding);
+        return -1;
+    }
+
+    z_stream * zs = sky_get_inflate_stream();
+    if (zs == NULL)
+        return -1;
+
+    zs->next_in = (Bytef *) data;
+    zs->avail_in = (uInt) data_len;
+    zs->next_out = (Bytef *) buff;
+    zs->avail_out = (uInt) (buff_len - 1); // reserve \0
+
+    int32_t rc = inflate(zs, Z_FINISH);
+    if (rc != Z_STREAM_END) {
+        if (rc == Z_BUF_ERROR && zs->avail_out == 0)
+            perror("buffer too small");
+        else
+            perror("invalid compressed data");
+        return -1;
+    }
+    buff[zs->total_out] = '\0';
+    return (int32_t) zs->total_out;
+#else
+    perror("decompression not supported, build with SKY_ZLIB");
+    return -1;
+#endif
+}
+
+int32_t sky_encode_req_xml_compressed(uint8_t *buff, int32_t buff_len,
+        char *xml_buff, int32_t xml_buff_len, const struct location_rq_t *creq,
+        uint8_t encoding, int32_t level) {
+    int32_t xml_len = sky_encode_req_xml(xml_buff, xml_buff_len, creq);
+    if (xml_len < 0)
+        return -1;
+    return sky_compress(buff, buff_len, (uint8_t *) xml_buff, xml_len, encoding, level);
+}
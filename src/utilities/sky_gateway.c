@@ -0,0 +1,235 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sky_crypt.h"
+#include "sky_api.h"
+#include "sky_pool.h"
+#include "sky_session.h"
+#include "sky_gateway.h"
+
+struct sky_gateway_t {
+    struct location_rq_t creq;  // points into wire
+    struct location_rsp_t cresp; // address strings point into scratch
+    const struct sky_key_t *key;
+    struct sky_session_t *session; // NULL if none
+    uint8_t *wire;
+    char *scratch;
+    uint32_t wire_len;
+    uint32_t scratch_len;
+    uint8_t error;              // response type of a failed upstream, 0 if none
+    struct ap_t aps[MAX_APS];   // access points of a reconstructed delta scan
+};
+
+struct sky_gateway_t * sky_gateway_create(uint32_t scratch_len) {
+    struct sky_gateway_t *gw = sky_pool_alloc(sizeof(struct sky_gateway_t));
+
+    if (gw == NULL)
+        return NULL;
+    memset(gw, 0, sizeof(*gw));
+    gw->wire_len = SKY_PROT_COMPACT_BUFF_LEN;
+    gw->scratch_len = (scratch_len > 0) ? scratch_len : SKY_GATEWAY_SCRATCH_LEN;
+    gw->wire = sky_pool_alloc(gw->wire_len);
+    gw->scratch = sky_pool_alloc(gw->scratch_len);
+    if (gw->wire == NULL || gw->scratch == NULL) {
+        sky_gateway_destroy(gw);
+        return NULL;
+    }
+    return gw;
+}
+
+void sky_gateway_destroy(struct sky_gateway_t *gw) {
+    if (gw == NULL)
+        return;
+    sky_pool_free(gw->wire);
+    sky_pool_free(gw->scratch);
+    sky_pool_free(gw);
+}
+
+void sky_gateway_set_session(struct sky_gateway_t *gw, struct sky_session_t *session) {
+    gw->session = session;
+}
+
+uint8_t * sky_gateway_rx(struct sky_gateway_t *gw, uint32_t *buff_len) {
+    *buff_len = gw->wire_len;
+    return gw->wire;
+}
+
+char * sky_gateway_upstream_rx(struct sky_gateway_t *gw, uint32_t *buff_len) {
+    *buff_len = gw->scratch_len;
+    return gw->scratch;
+}
+
+const struct location_rq_t * sky_gateway_request(const struct sky_gateway_t *gw) {
+    return &gw->creq;
+}
+
+const struct location_rsp_t * sky_gateway_response(const struct sky_gateway_t *gw) {
+    return &gw->cresp;
+}
+
+// decrypts the device packet in place
+static bool sky_gateway_open(struct sky_gateway_t *gw, uint32_t data_len, const struct sky_key_t *key) {
+    sky_rq_header_t header;
+
+    if (data_len < sizeof(header) || data_len > gw->wire_len) {
+        perror("invalid packet length");
+        return false;
+    }
+    memcpy(&header, gw->wire, sizeof(header));
+    if (header.version == SKY_PROTOCOL_VERSION_AEAD) {
+        if (sky_open_packet(gw->wire, data_len, sizeof(header), key->aes_key) < 0)
+            return false;
+    } else {
+        if (data_len < sizeof(header) + header.payload_length + sizeof(sky_checksum_t)) {
+            perror("invalid packet length");
+            return false;
+        }
+        if (sky_aes_decrypt(gw->wire + sizeof(header), header.payload_length,
+                (uint8_t *)key->aes_key, header.iv) < 0)
+            return false;
+    }
+    return true;
+}
+
+static void sky_gateway_set_key(struct location_rq_t *creq, const struct sky_key_t *key) {
+#ifdef SKY_KEY_BY_REF
+    creq->key = key;
+#else
+    creq->key = *key;
+#endif
+}
+
+// starts the transaction of the device packet, the error response of a packet
+// failing to decode is sealed with key and has the version of the packet
+static void sky_gateway_begin(struct sky_gateway_t *gw, uint32_t data_len, const struct sky_key_t *key) {
+    gw->key = key;
+    gw->error = 0;
+    memset(&gw->creq, 0, sizeof(gw->creq));
+    gw->creq.header.version = (data_len > 0) ? gw->wire[0] : 0;
+}
+
+char * sky_gateway_upstream(struct sky_gateway_t *gw, uint32_t data_len,
+        const struct sky_key_t *key, int32_t *len) {
+    struct location_rq_t *creq = &gw->creq;
+
+    sky_gateway_begin(gw, data_len, key);
+    if (!sky_gateway_open(gw, data_len, key))
+        return NULL;
+    if (sky_decode_req_bin(gw->wire, gw->wire_len, data_len, creq) < 0)
+        return NULL;
+    // answered by sky_gateway_probe
+    if (creq->payload_ext.payload.type == PROBE_REQUEST) {
+        perror("probe request");
+        return NULL;
+    }
+    sky_gateway_set_key(creq, key);
+
+    // a delta scan is reconstructed from the last scan of the device,
+    // and the scan is the base of the next one
+    if (gw->session != NULL && sky_session_apply(gw->session, creq, gw->aps, MAX_APS) >= 0)
+        sky_session_put(gw->session, creq);
+    if (creq->base_id != 0) {
+        gw->error = LOCATION_RQ_BASE_UNKNOWN;
+        return NULL;
+    }
+
+    if (key->max_aps > 0)
+        sky_select_aps(creq, key->max_aps);
+    if ((*len = sky_encode_req_api(gw->scratch, gw->scratch_len, creq)) < 0)
+        return NULL;
+    return gw->scratch;
+}
+
+// encrypts the response packet in place
+static uint8_t * sky_gateway_seal(struct sky_gateway_t *gw, int32_t len) {
+    sky_rsp_header_t header;
+
+    memcpy(&header, gw->wire, sizeof(header));
+    if (header.version == SKY_PROTOCOL_VERSION_AEAD) {
+        if (sky_seal_packet(gw->wire, len, sizeof(header), gw->key->aes_key) < 0)
+            return NULL;
+    } else {
+        if (sky_aes_encrypt(gw->wire + sizeof(header), header.payload_length,
+                (uint8_t *)gw->key->aes_key, header.iv) < 0)
+            return NULL;
+    }
+    return gw->wire;
+}
+
+uint8_t * sky_gateway_probe(struct sky_gateway_t *gw, uint32_t data_len,
+        const struct sky_key_t *key, int32_t *len) {
+    if (data_len > gw->wire_len || !sky_is_probe_rq(gw->wire, data_len, key->aes_key))
+        return NULL;
+    gw->key = key;
+    if ((*len = sky_encode_resp_status(gw->wire, gw->wire_len, gw->wire[0], PROBE_REQUEST_SUCCESS, 0)) < 0)
+        return NULL;
+    return sky_gateway_seal(gw, *len);
+}
+
+uint8_t * sky_gateway_downstream(struct sky_gateway_t *gw, int32_t data_len, int32_t *len) {
+    struct location_rsp_t *cresp = &gw->cresp;
+    uint8_t version = gw->creq.header.version;
+
+    // no device packet
+    if (gw->key == NULL)
+        return NULL;
+    memset(cresp, 0, sizeof(*cresp));
+    cresp->rq_id = gw->creq.rq_id;
+    if (data_len < 0)
+        cresp->payload_ext.payload.type = gw->error ? gw->error : LOCATION_GATEWAY_ERROR;
+    else
+        sky_decode_resp_api(gw->scratch, gw->scratch_len, data_len, &gw->creq, cresp);
+
+    // the response is written over the request in the wire buffer,
+    // the errors from their templates
+    uint8_t type = cresp->payload_ext.payload.type;
+    cresp->header.version = version;
+    if (type == LOCATION_RQ_SUCCESS || type == LOCATION_RQ_ADDR_SUCCESS)
+        *len = sky_encode_resp_bin(gw->wire, gw->wire_len, cresp);
+    else
+        *len = sky_encode_resp_status(gw->wire, gw->wire_len, version, type, cresp->rq_id);
+    if (*len < 0)
+        return NULL;
+    return sky_gateway_seal(gw, *len);
+}
+
+int32_t sky_gateway_batch(struct sky_gateway_t *gw, uint32_t data_len, const struct sky_key_t *key,
+        struct location_rq_t *scans, uint32_t max_scans) {
+    struct location_rq_t *creq = &gw->creq;
+    uint32_t i;
+
+    sky_gateway_begin(gw, data_len, key);
+    if (!sky_gateway_open(gw, data_len, key))
+        return -1;
+    int32_t n = sky_decode_req_batch(gw->wire, gw->wire_len, data_len, creq, scans, max_scans);
+    if (n < 0)
+        return -1;
+    sky_gateway_set_key(creq, key);
+    for (i = 0; i < (uint32_t)n; i++) {
+        sky_gateway_set_key(&scans[i], key);
+        if (key->max_aps > 0)
+            sky_select_aps(&scans[i], key->max_aps);
+    }
+    return n;
+}
+
+uint8_t * sky_gateway_batch_downstream(struct sky_gateway_t *gw, struct location_rsp_t *scans,
+        uint32_t count, int32_t *len) {
+    struct location_rsp_t *cresp = &gw->cresp;
+
+    if (gw->key == NULL)
+        return NULL;
+    // the batch response is written over the batch in the wire buffer
+    memset(cresp, 0, sizeof(*cresp));
+    cresp->header.version = gw->creq.header.version;
+    cresp->rq_id = gw->creq.rq_id;
+    if ((*len = sky_encode_resp_batch(gw->wire, gw->wire_len, cresp, scans, count)) < 0)
+        return NULL;
+    return sky_gateway_seal(gw, *len);
+}
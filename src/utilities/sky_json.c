@@ -0,0 +1,821 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include "sky_json.h"
+#include "sky_util.h"
+
+// Minimal json scanner for the request and response formats in sky_json.h.
+// Strings are unescaped in place, so the decoded strings can point into the buffer.
+
+typedef struct {
+    char *p;   // current position
+    char *end; // end of data
+} json_cursor_t;
+
+static void json_skip_ws(json_cursor_t *c) {
+    while (c->p < c->end && isspace((int32_t) *c->p))
+        c->p++;
+}
+
+static bool json_expect(json_cursor_t *c, char ch) {
+    json_skip_ws(c);
+    if (c->p < c->end && *c->p == ch) {
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+// compare the member key with a string literal
+#define json_key_is(key, key_len, name)                                       \
+                        ((key_len) == sizeof(name) - 1                        \
+                         && memcmp((key), (name), sizeof(name) - 1) == 0)
+
+static int32_t json_hex_val(char ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// parse a string and unescape it in place
+// result string is in s with length len (not \0 terminated)
+static bool json_string(json_cursor_t *c, char **s, int32_t *len) {
+    if (!json_expect(c, '"'))
+        return false;
+
+    char *r = c->p;
+    char *w = c->p;
+    *s = c->p;
+
+    while (r < c->end && *r != '"') {
+        if (*r != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+        if (++r >= c->end)
+            return false;
+        switch (*r) {
+        case 'b': *w++ = '\b'; break;
+        case 'f': *w++ = '\f'; break;
+        case 'n': *w++ = '\n'; break;
+        case 'r': *w++ = '\r'; break;
+        case 't': *w++ = '\t'; break;
+        case 'u': {
+            // basic multilingual plane only, encoded as utf-8 (never longer than \uXXXX)
+            int32_t i, cp = 0;
+            if (r + 4 >= c->end)
+                return false;
+            for (i = 1; i <= 4; i++) {
+                int32_t v = json_hex_val(r[i]);
+                if (v < 0)
+                    return false;
+                cp = (cp << 4) | v;
+            }
+            r += 4;
+            if (cp < 0x80) {
+                *w++ = (char) cp;
+            } else if (cp < 0x800) {
+                *w++ = (char) (0xC0 | (cp >> 6));
+                *w++ = (char) (0x80 | (cp & 0x3F));
+            } else {
+                *w++ = (char) (0xE0 | (cp >> 12));
+                *w++ = (char) (0x80 | ((cp >> 6) & 0x3F));
+                *w++ = (char) (0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default: // \" \\ \/
+            *w++ = *r;
+            break;
+        }
+        r++;
+    }
+    if (r >= c->end)
+        return false;
+
+    *len = (int32_t) (w - *s);
+    c->p = r + 1; // skip closing quote
+    return true;
+}
+
+static bool json_number(json_cursor_t *c, double *d) {
+    json_skip_ws(c);
+    char *e;
+    *d = strtod(c->p, &e);
+    if (e == c->p || e > c->end)
+        return false;
+    c->p = e;
+    return true;
+}
+
+static bool json_int(json_cursor_t *c, int64_t *v) {
+    json_skip_ws(c);
+    char *e;
+    *v = strtoll(c->p, &e, 10);
+    if (e == c->p || e > c->end)
+        return false;
+    if (*e == '.' || *e == 'e' || *e == 'E') {
+        // not an integer literal
+        double d;
+        if (!json_number(c, &d))
+            return false;
+        *v = (int64_t) d;
+        return true;
+    }
+    c->p = e;
+    return true;
+}
+
+// skip a string without unescaping it
+static bool json_skip_string(json_cursor_t *c) {
+    char *r = c->p + 1; // skip opening quote
+    while (r < c->end && *r != '"')
+        r += (*r == '\\') ? 2 : 1;
+    if (r >= c->end)
+        return false;
+    c->p = r + 1; // skip closing quote
+    return true;
+}
+
+static bool json_skip_value(json_cursor_t *c);
+
+// iterate the members of an object after its '{'
+// returns 1 with the member key, 0 at the end of the object, -1 if it fails
+static int32_t json_next_member(json_cursor_t *c, bool *first, char **key, int32_t *key_len) {
+    if (json_expect(c, '}'))
+        return 0;
+    if (!*first && !json_expect(c, ','))
+        return -1;
+    *first = false;
+    if (!json_string(c, key, key_len) || !json_expect(c, ':'))
+        return -1;
+    return 1;
+}
+
+// iterate the elements of an array after its '['
+// returns 1 for an element, 0 at the end of the array, -1 if it fails
+static int32_t json_next_element(json_cursor_t *c, bool *first) {
+    if (json_expect(c, ']'))
+        return 0;
+    if (!*first && !json_expect(c, ','))
+        return -1;
+    *first = false;
+    return 1;
+}
+
+static bool json_skip_value(json_cursor_t *c) {
+    json_skip_ws(c);
+    if (c->p >= c->end)
+        return false;
+
+    bool first = true;
+    int32_t rc;
+
+    switch (*c->p) {
+    case '"':
+        return json_skip_string(c);
+    case '{':
+        c->p++;
+        while (!json_expect(c, '}')) {
+            if (!first && !json_expect(c, ','))
+                return false;
+            first = false;
+            json_skip_ws(c);
+            if (c->p >= c->end || *c->p != '"' || !json_skip_string(c)
+                    || !json_expect(c, ':') || !json_skip_value(c))
+                return false;
+        }
+        return true;
+    case '[':
+        c->p++;
+        while ((rc = json_next_element(c, &first)) > 0)
+            if (!json_skip_value(c))
+                return false;
+        return rc == 0;
+    default: {
+        // number or literal (true, false, null)
+        char *start = c->p;
+        while (c->p < c->end && (isalnum((int32_t) *c->p) || *c->p == '-'
+                || *c->p == '+' || *c->p == '.'))
+            c->p++;
+        return c->p > start;
+    }
+    }
+}
+
+// count elements of the array at the cursor, without moving it
+static int32_t json_count_elements(json_cursor_t *c) {
+    json_cursor_t tmp = *c;
+    bool first = true;
+    int32_t rc, count = 0;
+
+    if (!json_expect(&tmp, '['))
+        return -1;
+    while ((rc = json_next_element(&tmp, &first)) > 0) {
+        if (!json_skip_value(&tmp))
+            return -1;
+        count++;
+    }
+    return (rc == 0) ? count : -1;
+}
+
+static int8_t json_rssi(int64_t v) {
+    if (v < -128)
+        return -128; // the min we can fit into int8_t
+    if (v > 127)
+        return 127;
+    return (int8_t) v;
+}
+
+// append formatted string at *p, but not beyond end
+static bool json_append(char **p, char *end, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int32_t n = vsnprintf(*p, end - *p, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= end - *p)
+        return false;
+    *p += n;
+    return true;
+}
+
+// append string s escaped at *p, but not beyond end
+static bool json_append_str(char **p, char *end, const char *s) {
+    for (; *s != '\0'; s++) {
+        unsigned char ch = (unsigned char)*s;
+        bool ok;
+        if (ch == '"' || ch == '\\')
+            ok = json_append(p, end, "\\%c", ch);
+        else if (ch < 0x20)
+            ok = json_append(p, end, "\\u%04x", ch);
+        else
+            ok = json_append(p, end, "%c", ch);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// encodes location_rq_t into json, result is in buff
+// returns str len or -1 if it fails
+int32_t sky_encode_req_json(char *buff, int32_t buff_len, const struct location_rq_t *creq) {
+    char *p = buff;
+    char *end = buff + buff_len;
+    char hexstr[33]; // max is ble uuid + 1
+    int32_t i;
+    bool ok = true;
+
+    if (bin2hex(hexstr, 32, creq->mac, 6) == -1) {
+        perror("target buffer too small");
+        return -1;
+    }
+    hexstr[12] = '\0';
+
+    // the version and the api key are escaped
+    ok = json_append(&p, end, "{\"version\":\"") && json_append_str(&p, end, creq->api_version)
+            && json_append(&p, end, "\",\"addr\":\"%s\",\"key\":\"",
+                    creq->payload_ext.payload.type == LOCATION_RQ_ADDR ? "full" : "none")
+            && json_append_str(&p, end, SKY_KEY(creq).keyid)
+            && json_append(&p, end, "\",\"user\":\"%s\"", hexstr);
+
+    for (i = 0; ok && i < creq->ap_count; i++) {
+        bin2hex(hexstr, 32, creq->aps[i].MAC, 6);
+        hexstr[12] = '\0';
+        ok = json_append(&p, end, "%s{\"mac\":\"%s\",\"rssi\":%d}", i == 0 ? ",\"aps\":[" : ",",
+                hexstr, creq->aps[i].rssi);
+    }
+    if (ok && creq->ap_count > 0)
+        ok = json_append(&p, end, "]");
+
+    for (i = 0; ok && i < creq->ble_count; i++) {
+        char uuid[33];
+        bin2hex(hexstr, 32, creq->bles[i].MAC, 6);
+        hexstr[12] = '\0';
+        bin2hex(uuid, 32, creq->bles[i].uuid, 16);
+        uuid[32] = '\0';
+        ok = json_append(&p, end, "%s{\"mac\":\"%s\",\"major\":%d,\"minor\":%d,\"uuid\":\"%s\",\"rssi\":%d}",
+                i == 0 ? ",\"bles\":[" : ",", hexstr, creq->bles[i].major, creq->bles[i].minor,
+                uuid, creq->bles[i].rssi);
+    }
+    if (ok && creq->ble_count > 0)
+        ok = json_append(&p, end, "]");
+
+    for (i = 0; ok && i < creq->gsm_count; i++) {
+        ok = json_append(&p, end, "%s{\"mcc\":%d,\"mnc\":%d,\"lac\":%d,\"ci\":%u,\"rssi\":%d,\"age\":%u}",
+                i == 0 ? ",\"gsms\":[" : ",", creq->gsms[i].mcc, creq->gsms[i].mnc, creq->gsms[i].lac,
+                creq->gsms[i].ci, creq->gsms[i].rssi, creq->gsms[i].age);
+    }
+    if (ok && creq->gsm_count > 0)
+        ok = json_append(&p, end, "]");
+
+    for (i = 0; ok && i < creq->cdma_count; i++) {
+        ok = json_append(&p, end, "%s{\"sid\":%d,\"nid\":%d,\"bsid\":%d,\"lat\":%f,\"lon\":%f,\"rssi\":%d,\"age\":%u}",
+                i == 0 ? ",\"cdmas\":[" : ",", creq->cdmas[i].sid, creq->cdmas[i].nid, creq->cdmas[i].bsid,
+                creq->cdmas[i].lat, creq->cdmas[i].lon, creq->cdmas[i].rssi, creq->cdmas[i].age);
+    }
+    if (ok && creq->cdma_count > 0)
+        ok = json_append(&p, end, "]");
+
+    for (i = 0; ok && i < creq->umts_count; i++) {
+        ok = json_append(&p, end, "%s{\"mcc\":%d,\"mnc\":%d,\"lac\":%d,\"ci\":%u,\"rssi\":%d,\"age\":%u}",
+                i == 0 ? ",\"umtss\":[" : ",", creq->umtss[i].mcc, creq->umtss[i].mnc, creq->umtss[i].lac,
+                creq->umtss[i].ci, creq->umtss[i].rssi, creq->umtss[i].age);
+    }
+    if (ok && creq->umts_count > 0)
+        ok = json_append(&p, end, "]");
+
+    for (i = 0; ok && i < creq->lte_count; i++) {
+        ok = json_append(&p, end, "%s{\"mcc\":%d,\"mnc\":%d,\"eucid\":%u,\"rssi\":%d,\"age\":%u}",
+                i == 0 ? ",\"ltes\":[" : ",", creq->ltes[i].mcc, creq->ltes[i].mnc, creq->ltes[i].eucid,
+                creq->ltes[i].rssi, creq->ltes[i].age);
+    }
+    if (ok && creq->lte_count > 0)
+        ok = json_append(&p, end, "]");
+
+    // if the value of an attribute is invalid, it will be silently ignored.
+    for (i = 0; ok && i < creq->gps_count; i++) {
+        const struct gps_t *gps = &creq->gps[i];
+        ok = json_append(&p, end, "%s{\"fix\":%d,\"nsat\":%d", i == 0 ? ",\"gps\":[" : ",", gps->fix, gps->nsat);
+        if (ok && gps->hdop != -1)
+            ok = json_append(&p, end, ",\"hdop\":%f", gps->hdop);
+        if (ok && gps->lat != DBL_MAX)
+            ok = json_append(&p, end, ",\"lat\":%f", gps->lat);
+        if (ok && gps->lon != DBL_MAX)
+            ok = json_append(&p, end, ",\"lon\":%f", gps->lon);
+        if (ok && gps->hpe != -1)
+            ok = json_append(&p, end, ",\"hpe\":%.0f", gps->hpe);
+        if (ok && gps->alt != FLT_MAX)
+            ok = json_append(&p, end, ",\"alt\":%f", gps->alt);
+        if (ok && gps->speed != -1)
+            ok = json_append(&p, end, ",\"speed\":%f", gps->speed);
+        if (ok && gps->age != UINT_MAX)
+            ok = json_append(&p, end, ",\"age\":%u", gps->age);
+        if (ok)
+            ok = json_append(&p, end, "}");
+    }
+    if (ok && creq->gps_count > 0)
+        ok = json_append(&p, end, "]");
+
+    if (ok)
+        ok = json_append(&p, end, "}\n");
+
+    if (!ok) {
+        perror("json buffer too small");
+        return -1;
+    }
+    return (int32_t) (p - buff);
+}
+
+// set an address string of the location_ext_t
+#define JSON_SET_ADDR(ext, field, s, len)                                     \
+                        do {                                                  \
+                            (ext)->field = (s);                               \
+                            (ext)->field##_len = (len);                       \
+                        } while (0)
+
+static bool json_decode_address(json_cursor_t *c, struct location_ext_t *ext) {
+    bool first = true;
+    int32_t rc, klen, slen;
+    char *key, *s;
+
+    if (!json_expect(c, '{'))
+        return false;
+    while ((rc = json_next_member(c, &first, &key, &klen)) > 0) {
+        json_skip_ws(c);
+        if (c->p >= c->end || *c->p != '"') {
+            if (!json_skip_value(c))
+                return false;
+            continue;
+        }
+        if (!json_string(c, &s, &slen))
+            return false;
+        if (slen > UINT16_MAX)
+            slen = UINT16_MAX;
+
+        if (json_key_is(key, klen, "street_num"))
+            JSON_SET_ADDR(ext, street_num, s, slen);
+        else if (json_key_is(key, klen, "address"))
+            JSON_SET_ADDR(ext, address, s, slen);
+        else if (json_key_is(key, klen, "city"))
+            JSON_SET_ADDR(ext, city, s, slen);
+        else if (json_key_is(key, klen, "state"))
+            JSON_SET_ADDR(ext, state, s, slen);
+        else if (json_key_is(key, klen, "state_code"))
+            JSON_SET_ADDR(ext, state_code, s, slen);
+        else if (json_key_is(key, klen, "metro1"))
+            JSON_SET_ADDR(ext, metro1, s, slen);
+        else if (json_key_is(key, klen, "metro2"))
+            JSON_SET_ADDR(ext, metro2, s, slen);
+        else if (json_key_is(key, klen, "postal_code"))
+            JSON_SET_ADDR(ext, postal_code, s, slen);
+        else if (json_key_is(key, klen, "county"))
+            JSON_SET_ADDR(ext, county, s, slen);
+        else if (json_key_is(key, klen, "country"))
+            JSON_SET_ADDR(ext, country, s, slen);
+        else if (json_key_is(key, klen, "country_code"))
+            JSON_SET_ADDR(ext, country_code, s, slen);
+    }
+    return rc == 0;
+}
+
+static bool json_decode_location(json_cursor_t *c, struct location_rsp_t *cresp, bool addr) {
+    bool first = true;
+    int32_t rc, klen;
+    char *key;
+    double d;
+
+    if (!json_expect(c, '{'))
+        return false;
+    while ((rc = json_next_member(c, &first, &key, &klen)) > 0) {
+        if (json_key_is(key, klen, "lat")) {
+            if (!json_number(c, &d))
+                return false;
+            cresp->location.lat = d;
+        } else if (json_key_is(key, klen, "lon")) {
+            if (!json_number(c, &d))
+                return false;
+            cresp->location.lon = d;
+        } else if (json_key_is(key, klen, "hpe")) {
+            if (!json_number(c, &d))
+                return false;
+            cresp->location.hpe = (float) d;
+        } else if (json_key_is(key, klen, "distance")) {
+            if (!json_number(c, &d))
+                return false;
+            cresp->location.distance_to_point = (float) d;
+        } else if (addr && json_key_is(key, klen, "address")) {
+            if (!json_decode_address(c, &cresp->location_ext))
+                return false;
+        } else if (!json_skip_value(c)) {
+            return false;
+        }
+    }
+    return rc == 0;
+}
+
+// decodes json into location_rsp_t
+// Return code:
+// < 0 : non-meaningful error code
+// = 0 : success
+// > 0 : meaningful error code (i.e. API returns meaningful error response)
+int32_t sky_decode_resp_json(char *buff, int32_t buff_len, int32_t data_len,
+        const struct location_rq_t *creq, struct location_rsp_t *cresp) {
+
+    buff[buff_len - 1] = 0; // make sure it ends with \0
+
+    memset(&cresp->payload_ext.payload.timestamp, 0, sizeof(cresp->payload_ext.payload.timestamp));
+    cresp->header.version = 0;
+    cresp->payload_ext.payload.type = LOCATION_UNKNOWN;
+
+    memset(&cresp->location_ext, 0, sizeof(cresp->location_ext)); // zero out the counts
+
+    const char nondeterministic[] = "Unable to determine location";
+
+    json_cursor_t c;
+    c.p = buff;
+    c.end = buff + ((data_len < buff_len) ? data_len : buff_len - 1);
+
+    bool first = true;
+    bool found = false;
+    int32_t rc, klen, slen;
+    char *key, *s;
+
+    if (!json_expect(&c, '{'))
+        return -1; // non-meaningful error
+
+    while ((rc = json_next_member(&c, &first, &key, &klen)) > 0) {
+        if (json_key_is(key, klen, "error")) {
+            if (!json_string(&c, &s, &slen))
+                return -1;
+            if (json_key_is(s, slen, nondeterministic))
+                // unable to determine client location
+                cresp->payload_ext.payload.type = LOCATION_UNABLE_TO_DETERMINE;
+            else
+                cresp->payload_ext.payload.type = LOCATION_API_ERROR;
+            return 1; // meaningful error
+        } else if (json_key_is(key, klen, "location")) {
+            if (!json_decode_location(&c, cresp, creq->payload_ext.payload.type == LOCATION_RQ_ADDR))
+                return -1;
+            found = true;
+        } else if (!json_skip_value(&c)) {
+            return -1;
+        }
+    }
+    if (rc < 0 || !found)
+        return -1; // non-meaningful error
+
+    switch (creq->payload_ext.payload.type) {
+    case LOCATION_RQ:
+        cresp->payload_ext.payload.type = LOCATION_RQ_SUCCESS;
+        break;
+    case LOCATION_RQ_ADDR:
+        cresp->payload_ext.payload.type = LOCATION_RQ_ADDR_SUCCESS;
+        break;
+    default:
+        cresp->payload_ext.payload.type = LOCATION_RQ_ERROR;
+    }
+    return 0; // success
+}
+
+// decodes a mac or uuid hex string into bin
+static bool json_hex(json_cursor_t *c, uint8_t *bin, uint32_t bin_len) {
+    char *s;
+    int32_t slen;
+    if (!json_string(c, &s, &slen))
+        return false;
+    return hex2bin(s, slen, bin, bin_len) == bin_len;
+}
+
+// attributes of any element of the request arrays
+struct json_rq_elem_t {
+    uint8_t mac[MAC_SIZE];
+    uint8_t uuid[16];
+    bool has_mac;
+    bool has_uuid;
+    int64_t rssi, age, mcc, mnc, lac, ci, eucid, sid, nid, bsid, major, minor, fix, nsat;
+    double lat, lon, hdop, alt, speed, hpe;
+};
+
+// decodes one element of the request arrays into e, returns count of errors
+static char json_decode_rq_elem(json_cursor_t *c, struct json_rq_elem_t *e) {
+    bool first = true;
+    int32_t rc, klen;
+    char *key;
+    char num_errors = 0;
+
+    // defaults, the gps attributes are invalid unless present
+    memset(e, 0, sizeof(*e));
+    e->age = -1;
+    e->fix = 1;
+    e->lat = e->lon = DBL_MAX;
+    e->alt = FLT_MAX;
+    e->hdop = e->speed = e->hpe = -1;
+
+    if (!json_expect(c, '{'))
+        return 1;
+    while ((rc = json_next_member(c, &first, &key, &klen)) > 0) {
+        bool ok;
+        if (json_key_is(key, klen, "mac"))
+            ok = e->has_mac = json_hex(c, e->mac, sizeof(e->mac));
+        else if (json_key_is(key, klen, "uuid"))
+            ok = e->has_uuid = json_hex(c, e->uuid, sizeof(e->uuid));
+        else if (json_key_is(key, klen, "rssi"))
+            ok = json_int(c, &e->rssi);
+        else if (json_key_is(key, klen, "age"))
+            ok = json_int(c, &e->age);
+        else if (json_key_is(key, klen, "mcc"))
+            ok = json_int(c, &e->mcc);
+        else if (json_key_is(key, klen, "mnc"))
+            ok = json_int(c, &e->mnc);
+        else if (json_key_is(key, klen, "lac"))
+            ok = json_int(c, &e->lac);
+        else if (json_key_is(key, klen, "ci"))
+            ok = json_int(c, &e->ci);
+        else if (json_key_is(key, klen, "eucid"))
+            ok = json_int(c, &e->eucid);
+        else if (json_key_is(key, klen, "sid"))
+            ok = json_int(c, &e->sid);
+        else if (json_key_is(key, klen, "nid"))
+            ok = json_int(c, &e->nid);
+        else if (json_key_is(key, klen, "bsid"))
+            ok = json_int(c, &e->bsid);
+        else if (json_key_is(key, klen, "major"))
+            ok = json_int(c, &e->major);
+        else if (json_key_is(key, klen, "minor"))
+            ok = json_int(c, &e->minor);
+        else if (json_key_is(key, klen, "fix"))
+            ok = json_int(c, &e->fix);
+        else if (json_key_is(key, klen, "nsat"))
+            ok = json_int(c, &e->nsat);
+        else if (json_key_is(key, klen, "lat"))
+            ok = json_number(c, &e->lat);
+        else if (json_key_is(key, klen, "lon"))
+            ok = json_number(c, &e->lon);
+        else if (json_key_is(key, klen, "hdop"))
+            ok = json_number(c, &e->hdop);
+        else if (json_key_is(key, klen, "alt"))
+            ok = json_number(c, &e->alt);
+        else if (json_key_is(key, klen, "speed"))
+            ok = json_number(c, &e->speed);
+        else if (json_key_is(key, klen, "hpe"))
+            ok = json_number(c, &e->hpe);
+        else
+            ok = json_skip_value(c);
+        if (!ok) {
+            num_errors++;
+            if (!json_skip_value(c))
+                return num_errors + 1;
+        }
+    }
+    return (rc == 0) ? num_errors : num_errors + 1;
+}
+
+// decodes one of the request arrays, returns count of errors
+static char json_decode_rq_array(json_cursor_t *c, uint8_t type, struct location_rq_t *req) {
+    int32_t count = json_count_elements(c);
+    if (count < 0)
+        return 1;
+    if (count == 0)
+        return json_skip_value(c) ? 0 : 1;
+    if (count > UINT8_MAX)
+        return 1;
+
+    // a second array of a type is an error, its elements would not fit the first one
+    bool dup = false;
+    void *data = NULL;
+    switch (type) {
+    case DATA_TYPE_AP:
+        if (!(dup = req->aps != NULL))
+            data = req->aps = (struct ap_t *) calloc(count, sizeof(struct ap_t));
+        break;
+    case DATA_TYPE_BLE:
+        if (!(dup = req->bles != NULL))
+            data = req->bles = (struct ble_t *) calloc(count, sizeof(struct ble_t));
+        break;
+    case DATA_TYPE_GSM:
+        if (!(dup = req->gsms != NULL))
+            data = req->gsms = (struct gsm_t *) calloc(count, sizeof(struct gsm_t));
+        break;
+    case DATA_TYPE_CDMA:
+        if (!(dup = req->cdmas != NULL))
+            data = req->cdmas = (struct cdma_t *) calloc(count, sizeof(struct cdma_t));
+        break;
+    case DATA_TYPE_UMTS:
+        if (!(dup = req->umtss != NULL))
+            data = req->umtss = (struct umts_t *) calloc(count, sizeof(struct umts_t));
+        break;
+    case DATA_TYPE_LTE:
+        if (!(dup = req->ltes != NULL))
+            data = req->ltes = (struct lte_t *) calloc(count, sizeof(struct lte_t));
+        break;
+    case DATA_TYPE_GPS:
+        if (!(dup = req->gps != NULL))
+            data = req->gps = (struct gps_t *) calloc(count, sizeof(struct gps_t));
+        break;
+    default:
+        return 1;
+    }
+    if (dup) {
+        perror("duplicate array");
+        return json_skip_value(c) ? 1 : 2;
+    }
+    if (data == NULL) {
+        perror("calloc failed");
+        return json_skip_value(c) ? 1 : 2;
+    }
+
+    bool first = true;
+    int32_t i, rc;
+    char num_errors = 0;
+    struct json_rq_elem_t e;
+
+    json_expect(c, '[');
+    for (i = 0; i < count && (rc = json_next_element(c, &first)) > 0; i++) {
+        num_errors += json_decode_rq_elem(c, &e);
+
+        switch (type) {
+        case DATA_TYPE_AP: {
+            struct ap_t *ap = &req->aps[req->ap_count++];
+            if (!e.has_mac)
+                num_errors++;
+            memcpy(ap->MAC, e.mac, sizeof(ap->MAC));
+            ap->rssi = json_rssi(e.rssi);
+            break;
+        }
+        case DATA_TYPE_BLE: {
+            struct ble_t *ble = &req->bles[req->ble_count++];
+            if (!e.has_mac || !e.has_uuid)
+                num_errors++;
+            memcpy(ble->MAC, e.mac, sizeof(ble->MAC));
+            memcpy(ble->uuid, e.uuid, sizeof(ble->uuid));
+            ble->major = (uint16_t) e.major;
+            ble->minor = (uint16_t) e.minor;
+            ble->rssi = json_rssi(e.rssi);
+            break;
+        }
+        case DATA_TYPE_GSM: {
+            struct gsm_t *gsm = &req->gsms[req->gsm_count++];
+            gsm->mcc = (uint16_t) e.mcc;
+            gsm->mnc = (uint16_t) e.mnc;
+            gsm->lac = (uint16_t) e.lac;
+            gsm->ci = (uint32_t) e.ci;
+            gsm->rssi = json_rssi(e.rssi);
+            gsm->age = (e.age < 0) ? 0 : (uint32_t) e.age;
+            break;
+        }
+        case DATA_TYPE_CDMA: {
+            struct cdma_t *cdma = &req->cdmas[req->cdma_count++];
+            cdma->sid = (uint16_t) e.sid;
+            cdma->nid = (uint16_t) e.nid;
+            cdma->bsid = (uint16_t) e.bsid;
+            cdma->lat = e.lat;
+            cdma->lon = e.lon;
+            cdma->rssi = json_rssi(e.rssi);
+            cdma->age = (e.age < 0) ? 0 : (uint32_t) e.age;
+            break;
+        }
+        case DATA_TYPE_UMTS: {
+            struct umts_t *umts = &req->umtss[req->umts_count++];
+            umts->mcc = (uint16_t) e.mcc;
+            umts->mnc = (uint16_t) e.mnc;
+            umts->lac = (uint16_t) e.lac;
+            umts->ci = (uint32_t) e.ci;
+            umts->rssi = json_rssi(e.rssi);
+            umts->age = (e.age < 0) ? 0 : (uint32_t) e.age;
+            break;
+        }
+        case DATA_TYPE_LTE: {
+            struct lte_t *lte = &req->ltes[req->lte_count++];
+            lte->mcc = (uint16_t) e.mcc;
+            lte->mnc = (uint16_t) e.mnc;
+            lte->eucid = (uint32_t) e.eucid;
+            lte->rssi = json_rssi(e.rssi);
+            lte->age = (e.age < 0) ? 0 : (uint32_t) e.age;
+            break;
+        }
+        case DATA_TYPE_GPS: {
+            struct gps_t *gps = &req->gps[req->gps_count++];
+            gps->fix = (uint8_t) e.fix;
+            gps->nsat = (uint8_t) e.nsat;
+            gps->lat = e.lat;
+            gps->lon = e.lon;
+            gps->hdop = (float) e.hdop;
+            gps->alt = (e.alt == FLT_MAX) ? FLT_MAX : (float) e.alt;
+            gps->speed = (float) e.speed;
+            gps->hpe = (float) e.hpe;
+            gps->age = (e.age < 0) ? UINT_MAX : (uint32_t) e.age;
+            break;
+        }
+        }
+    }
+    return json_expect(c, ']') ? num_errors : num_errors + 1;
+}
+
+/* make sure after use free resources as after sky_decode_req_xml
+
+ sets payload_type, aps, ap_count, bles, ble_count, cells, cell_count, gps, gps_count
+ */
+int32_t sky_decode_req_json(char *buff, int32_t buff_len, int32_t data_len,
+        struct location_rq_t *req) {
+    buff[buff_len - 1] = 0; // make sure it ends with 0
+
+    memset(req, 0, sizeof(*req)); // zero out the counts
+
+    json_cursor_t c;
+    c.p = buff;
+    c.end = buff + ((data_len < buff_len) ? data_len : buff_len - 1);
+
+    bool first = true;
+    int32_t rc, klen, slen;
+    char *key, *s;
+    int32_t num_errors = 0;
+
+    req->payload_ext.payload.type = LOCATION_RQ;
+
+    if (!json_expect(&c, '{'))
+        return -1;
+
+    while ((rc = json_next_member(&c, &first, &key, &klen)) > 0) {
+        if (json_key_is(key, klen, "addr")) {
+            if (!json_string(&c, &s, &slen))
+                return -1 - num_errors;
+            if (slen == 4 && strncmp(s, "full", 4) == 0)
+                req->payload_ext.payload.type = LOCATION_RQ_ADDR;
+        } else if (json_key_is(key, klen, "aps")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_AP, req);
+        } else if (json_key_is(key, klen, "bles")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_BLE, req);
+        } else if (json_key_is(key, klen, "gsms")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_GSM, req);
+        } else if (json_key_is(key, klen, "cdmas")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_CDMA, req);
+        } else if (json_key_is(key, klen, "umtss")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_UMTS, req);
+        } else if (json_key_is(key, klen, "ltes")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_LTE, req);
+        } else if (json_key_is(key, klen, "gps")) {
+            num_errors += json_decode_rq_array(&c, DATA_TYPE_GPS, req);
+        } else if (!json_skip_value(&c)) {
+            return -1 - num_errors;
+        }
+    }
+    if (rc < 0)
+        num_errors++;
+
+    return 0 - num_errors;
+}
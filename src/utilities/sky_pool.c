@@ -0,0 +1,280 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "sky_protocol.h"
+#include "sky_pool.h"
+
+#define SKY_POOL_MAGIC          0x504B5953 // "SYKP"
+#define SKY_POOL_OVERSIZE       SKY_POOL_CLASSES // class of the malloc'd buffers
+#define SKY_POOL_HUGE_PAGE      (2 * 1024 * 1024)
+
+// header before each buffer, the buffer is 64 byte aligned
+struct sky_pool_buff_t {
+    struct sky_pool_buff_t *next;
+    struct sky_pool_cache_t *owner; // thread cache of the last allocation
+    uint32_t size_class;
+    uint32_t magic;
+} __attribute__((aligned(64)));
+
+// free lists of a thread
+struct sky_pool_cache_t {
+    struct sky_pool_buff_t *free[SKY_POOL_CLASSES];
+    uint32_t count[SKY_POOL_CLASSES];
+    struct sky_pool_buff_t *remote; // pushed by the other threads
+    struct sky_pool_cache_t *next;  // list of the caches of exited threads
+    uint8_t *slab;                  // unused part of the current slab
+    uint8_t *slab_end;
+} __attribute__((aligned(64)));
+
+static struct sky_pool_config_t sky_pool_config = { SKY_POOL_SLAB_SIZE, SKY_POOL_CACHE_MAX, 0 };
+
+// shared depot and the caches of exited threads
+static pthread_mutex_t sky_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sky_pool_buff_t *sky_pool_depot[SKY_POOL_CLASSES];
+static struct sky_pool_cache_t *sky_pool_orphans;
+
+static pthread_once_t sky_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t sky_pool_key;
+static __thread struct sky_pool_cache_t *sky_pool_cache;
+
+static struct sky_pool_stats_t sky_pool_stats;
+
+static void sky_pool_count(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint32_t sky_pool_class_size(uint32_t size_class) {
+    return SKY_BUFF_CLASS_MIN << size_class;
+}
+
+// moves the free buffers of the class to the depot
+static void sky_pool_to_depot(struct sky_pool_cache_t *cache, uint32_t size_class, uint32_t n) {
+    struct sky_pool_buff_t *first = cache->free[size_class], *last = first;
+    uint32_t i;
+
+    if (first == NULL || n == 0)
+        return;
+    for (i = 1; i < n && last->next != NULL; i++)
+        last = last->next;
+    cache->free[size_class] = last->next;
+    cache->count[size_class] -= i;
+
+    pthread_mutex_lock(&sky_pool_lock);
+    last->next = sky_pool_depot[size_class];
+    sky_pool_depot[size_class] = first;
+    pthread_mutex_unlock(&sky_pool_lock);
+}
+
+// maps a new slab, faulted in by this thread
+static bool sky_pool_new_slab(struct sky_pool_cache_t *cache) {
+    size_t size = sky_pool_config.slab_size;
+    void *slab = MAP_FAILED;
+
+    if (sky_pool_config.huge_pages) {
+        size = (size + SKY_POOL_HUGE_PAGE - 1) & ~((size_t)SKY_POOL_HUGE_PAGE - 1);
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    }
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            perror("mmap failed");
+            return false;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(slab, size, MADV_HUGEPAGE);
+#endif
+        // first touch by this thread
+        memset(slab, 0, size);
+    }
+    cache->slab = slab;
+    cache->slab_end = (uint8_t *)slab + size;
+    sky_pool_count(&sky_pool_stats.slabs, 1);
+    sky_pool_count(&sky_pool_stats.slab_bytes, size);
+    return true;
+}
+
+// takes the buffers freed by the other threads
+static void sky_pool_drain(struct sky_pool_cache_t *cache) {
+    struct sky_pool_buff_t *b = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+    while (b != NULL) {
+        struct sky_pool_buff_t *next = b->next;
+        b->next = cache->free[b->size_class];
+        cache->free[b->size_class] = b;
+        cache->count[b->size_class]++;
+        b = next;
+    }
+}
+
+// the thread exited, its buffers go to the depot and the cache is reused by a new thread
+static void sky_pool_thread_exit(void *arg) {
+    struct sky_pool_cache_t *cache = arg;
+    uint32_t i;
+
+    sky_pool_drain(cache);
+    for (i = 0; i < SKY_POOL_CLASSES; i++)
+        sky_pool_to_depot(cache, i, cache->count[i]);
+    pthread_mutex_lock(&sky_pool_lock);
+    cache->next = sky_pool_orphans;
+    sky_pool_orphans = cache;
+    pthread_mutex_unlock(&sky_pool_lock);
+}
+
+static void sky_pool_init() {
+    if (pthread_key_create(&sky_pool_key, sky_pool_thread_exit) != 0)
+        perror("pthread_key_create failed");
+}
+
+static struct sky_pool_cache_t * sky_pool_thread_cache() {
+    struct sky_pool_cache_t *cache = sky_pool_cache;
+
+    if (cache != NULL)
+        return cache;
+    pthread_once(&sky_pool_once, sky_pool_init);
+
+    pthread_mutex_lock(&sky_pool_lock);
+    if ((cache = sky_pool_orphans) != NULL)
+        sky_pool_orphans = cache->next;
+    pthread_mutex_unlock(&sky_pool_lock);
+    if (cache == NULL) {
+        if (posix_memalign((void **)&cache, 64, sizeof(struct sky_pool_cache_t)) != 0) {
+            perror("posix_memalign failed");
+            return NULL;
+        }
+        memset(cache, 0, sizeof(*cache));
+    }
+    cache->next = NULL;
+    pthread_setspecific(sky_pool_key, cache);
+    sky_pool_cache = cache;
+    return cache;
+}
+
+static struct sky_pool_buff_t * sky_pool_refill(struct sky_pool_cache_t *cache, uint32_t size_class) {
+    struct sky_pool_buff_t *b;
+    uint32_t need = sizeof(struct sky_pool_buff_t) + sky_pool_class_size(size_class);
+
+    sky_pool_drain(cache);
+    if ((b = cache->free[size_class]) != NULL)
+        return b;
+
+    pthread_mutex_lock(&sky_pool_lock);
+    if ((b = sky_pool_depot[size_class]) != NULL)
+        sky_pool_depot[size_class] = b->next;
+    pthread_mutex_unlock(&sky_pool_lock);
+    if (b != NULL) {
+        b->next = NULL;
+        cache->free[size_class] = b;
+        cache->count[size_class]++;
+        return b;
+    }
+
+    if ((cache->slab == NULL || cache->slab + need > cache->slab_end) && !sky_pool_new_slab(cache))
+        return NULL;
+    b = (struct sky_pool_buff_t *)cache->slab;
+    cache->slab += need;
+    b->next = NULL;
+    b->size_class = size_class;
+    b->magic = SKY_POOL_MAGIC;
+    cache->free[size_class] = b;
+    cache->count[size_class]++;
+    return b;
+}
+
+void sky_pool_configure(const struct sky_pool_config_t *config) {
+    sky_pool_config = *config;
+    if (sky_pool_config.slab_size < sizeof(struct sky_pool_buff_t) + sky_pool_class_size(SKY_POOL_CLASSES - 1))
+        sky_pool_config.slab_size = SKY_POOL_SLAB_SIZE;
+    if (sky_pool_config.cache_max == 0)
+        sky_pool_config.cache_max = SKY_POOL_CACHE_MAX;
+}
+
+void * sky_pool_alloc(uint32_t len) {
+    struct sky_pool_cache_t *cache;
+    struct sky_pool_buff_t *b;
+    uint32_t size_class = 0;
+
+    while (size_class < SKY_POOL_CLASSES && sky_pool_class_size(size_class) < len)
+        size_class++;
+    if (size_class == SKY_POOL_CLASSES) {
+        if (posix_memalign((void **)&b, 64, sizeof(struct sky_pool_buff_t) + len) != 0) {
+            perror("posix_memalign failed");
+            return NULL;
+        }
+        b->owner = NULL;
+        b->size_class = SKY_POOL_OVERSIZE;
+        b->magic = SKY_POOL_MAGIC;
+        b->next = (struct sky_pool_buff_t *)(uintptr_t)len; // size of the oversize buffer
+        sky_pool_count(&sky_pool_stats.oversize, 1);
+        sky_pool_count(&sky_pool_stats.allocs, 1);
+        return b + 1;
+    }
+
+    if ((cache = sky_pool_thread_cache()) == NULL)
+        return NULL;
+    if ((b = cache->free[size_class]) == NULL && (b = sky_pool_refill(cache, size_class)) == NULL)
+        return NULL;
+    cache->free[size_class] = b->next;
+    cache->count[size_class]--;
+    b->next = NULL;
+    b->owner = cache;
+    sky_pool_count(&sky_pool_stats.allocs, 1);
+    return b + 1;
+}
+
+void sky_pool_free(void *buff) {
+    struct sky_pool_buff_t *b;
+
+    if (buff == NULL)
+        return;
+    b = (struct sky_pool_buff_t *)buff - 1;
+    if (b->magic != SKY_POOL_MAGIC) {
+        fprintf(stderr, "sky_pool_free: not a pool buffer\n");
+        return;
+    }
+    sky_pool_count(&sky_pool_stats.frees, 1);
+    if (b->size_class == SKY_POOL_OVERSIZE) {
+        free(b);
+        return;
+    }
+
+    struct sky_pool_cache_t *cache = sky_pool_cache;
+    if (b->owner == cache) {
+        b->next = cache->free[b->size_class];
+        cache->free[b->size_class] = b;
+        if (++cache->count[b->size_class] > sky_pool_config.cache_max)
+            sky_pool_to_depot(cache, b->size_class, sky_pool_config.cache_max / 2);
+        return;
+    }
+
+    // lock free push to the remote queue of the owner
+    struct sky_pool_cache_t *owner = b->owner;
+    b->next = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote, &b->next, b, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    sky_pool_count(&sky_pool_stats.remote_frees, 1);
+}
+
+uint32_t sky_pool_size(const void *buff) {
+    const struct sky_pool_buff_t *b = (const struct sky_pool_buff_t *)buff - 1;
+    if (b->size_class == SKY_POOL_OVERSIZE)
+        return (uint32_t)(uintptr_t)b->next;
+    return sky_pool_class_size(b->size_class);
+}
+
+void sky_pool_get_stats(struct sky_pool_stats_t *stats) {
+    stats->allocs = __atomic_load_n(&sky_pool_stats.allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&sky_pool_stats.frees, __ATOMIC_RELAXED);
+    stats->remote_frees = __atomic_load_n(&sky_pool_stats.remote_frees, __ATOMIC_RELAXED);
+    stats->oversize = __atomic_load_n(&sky_pool_stats.oversize, __ATOMIC_RELAXED);
+    stats->slabs = __atomic_load_n(&sky_pool_stats.slabs, __ATOMIC_RELAXED);
+    stats->slab_bytes = __atomic_load_n(&sky_pool_stats.slab_bytes, __ATOMIC_RELAXED);
+}
@@ -96,6 +96,9 @@ void print_location_resp(struct location_rsp_t *cr) {
     case LOCATION_UNABLE_TO_DETERMINE:
         puts("LOCATION_UNABLE_TO_DETERMINE");
         break;
+    case LOCATION_RQ_BASE_UNKNOWN:
+        puts("LOCATION_RQ_BASE_UNKNOWN");
+        break;
     case LOCATION_UNKNOWN:
         puts("LOCATION_UNKNOWN");
         break;
@@ -109,7 +112,11 @@ void print_location_req(struct location_rq_t *cr) {
     printf("payload type: %d\n", cr->payload_ext.payload.type);
     printf("firmware version: %d\n", cr->payload_ext.payload.sw_version);
 
-    printf("partner_id: %d\n", cr->key.partner_id);
+    printf("partner_id: %d\n", SKY_KEY(cr).partner_id);
+
+    printf("request id: %u\n", cr->rq_id);
+    if (cr->base_id != 0)
+        printf("base request id: %u, removed access points %d\n", cr->base_id, cr->removed_count);
 
     printf("Device MAC: ");
     if (cr->mac_count > 0) {
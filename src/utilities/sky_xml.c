@@ -30,22 +30,68 @@ uint32_t countTag(const char * buff, const char * tag) {
     return count;
 }
 
+// leading part of the xml location request, which only depends on the key,
+// api version and payload type (see struct sky_rq_prefix_t).
+static const char xml_decl[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+static const char xml_locrq[] =
+        "<LocationRQ xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+                "xsi:schemaLocation=\"http://skyhookwireless.com/wps/2005 ../../src/xsd/location.xsd\"\n"
+                "xmlns=\"http://skyhookwireless.com/wps/2005\"\n"
+                "version=\"%s\"\n"
+                "street-address-lookup=\"%s\">\n";
+static const char xml_auth[] = "<authentication version=\"2.2\">\n"
+        "<key key=\"%s\" "
+        "username=\"";
+
+// renders the request prefix up to the username into buff
+// returns str len or -1 if it fails
+static int32_t sky_render_rq_prefix(char *buff, int32_t bufflen, const char *keyid,
+        const char *api_version, bool full) {
+    int32_t len = snprintf(buff, bufflen, "%s", xml_decl);
+    if (len < 0 || len >= bufflen)
+        return -1;
+
+    int32_t n = snprintf(buff + len, bufflen - len, xml_locrq, api_version, full ? "full" : "none");
+    if (n < 0 || (len += n) >= bufflen)
+        return -1;
+
+    n = snprintf(buff + len, bufflen - len, xml_auth, keyid);
+    if (n < 0 || (len += n) >= bufflen)
+        return -1;
+    return len;
+}
+
+// pre-render the request prefixes of a key for the api version
+// returns 0 or -1 if it fails
+int32_t sky_init_rq_prefix(struct sky_rq_prefix_t *prefix, const struct sky_key_t *key,
+        const char *api_version) {
+    memset(prefix, 0, sizeof(*prefix));
+    if (api_version == NULL || strlen(api_version) >= sizeof(prefix->api_version)) {
+        perror("invalid api version");
+        return -1;
+    }
+    strcpy(prefix->api_version, api_version);
+
+    int32_t i;
+    for (i = 0; i < 2; i++) {
+        int32_t len = sky_render_rq_prefix(prefix->data[i], sizeof(prefix->data[i]),
+                key->keyid, api_version, i == 1);
+        if (len < 0) {
+            perror("prefix buffer too small");
+            memset(prefix, 0, sizeof(*prefix));
+            return -1;
+        }
+        prefix->len[i] = (uint16_t) len;
+    }
+    return 0;
+}
+
 // encodes location_req_t into xml result is in buff
 // returns str len or -1 if it fails
 int32_t sky_encode_req_xml(char *buff, int32_t bufflen, const struct location_rq_t *creq) {
-    const char xml[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-    const char locrq[] =
-            "<LocationRQ xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
-                    "xsi:schemaLocation=\"http://skyhookwireless.com/wps/2005 ../../src/xsd/location.xsd\"\n"
-                    "xmlns=\"http://skyhookwireless.com/wps/2005\"\n"
-                    "version=\"%s\"\n"
-                    "street-address-lookup=\"%s\">\n";
-
     const char locrq_eof[] = "</LocationRQ>\n";
 
-    const char auth[] = "<authentication version=\"2.2\">\n"
-            "<key key=\"%s\" "
-            "username=\"%s\"/>\n"
+    const char auth_eof[] = "%s\"/>\n"
             "</authentication>\n";
 
     const char ap[] = "<access-point>\n";
@@ -115,14 +161,22 @@ int32_t sky_encode_req_xml(char *buff, int32_t bufflen, const struct location_rq
     size_t sz;
 
     char *p = buff;
-    sz = strlen(xml);
-    strncpy(p, xml, sz);
-    p += sz;
-
-    if (creq->payload_ext.payload.type == LOCATION_RQ_ADDR)
-        p += sprintf(p, locrq, creq->api_version, "full");
-    else
-        p += sprintf(p, locrq, creq->api_version, "none");
+    bool full = creq->payload_ext.payload.type == LOCATION_RQ_ADDR;
+    const struct sky_rq_prefix_t *prefix = SKY_KEY(creq).rq_prefix;
+
+    // copy the pre-rendered prefix of the key if there is one for this api version
+    if (prefix != NULL && prefix->len[full] > 0 && creq->api_version != NULL
+            && strcmp(prefix->api_version, creq->api_version) == 0) {
+        memcpy(p, prefix->data[full], prefix->len[full]);
+        p += prefix->len[full];
+    } else {
+        int32_t len = sky_render_rq_prefix(p, bufflen, SKY_KEY(creq).keyid, creq->api_version, full);
+        if (len < 0) {
+            perror("xml buffer too small");
+            return -1;
+        }
+        p += len;
+    }
 
     char hexstr[33]; // max is ble uuid + 1
 
@@ -132,7 +186,7 @@ int32_t sky_encode_req_xml(char *buff, int32_t bufflen, const struct location_rq
     }
 
     hexstr[12] = '\0'; // end the string
-    p += sprintf(p, auth, creq->key.keyid, hexstr); // using software version as username
+    p += sprintf(p, auth_eof, hexstr); // using software version as username
 
     // set ap attributes
     for (i = 0; i < creq->ap_count; i++) {
@@ -284,6 +338,15 @@ int32_t sky_encode_req_xml(char *buff, int32_t bufflen, const struct location_rq
 // > 0 : meaningful error code (i.e. API returns meaningful error response)
 int32_t sky_decode_resp_xml(char *buff, int32_t buff_len, int32_t data_len,
         const struct location_rq_t * creq, struct location_rsp_t *cresp) {
+    return sky_decode_resp_xml_fields(buff, buff_len, data_len, creq, cresp, ADDR_FIELD_ALL);
+}
+
+// decodes xml into location_resp_t, only the address fields in "fields" are decoded.
+// Note: the address fields are only searched for in the scope of the street-address
+//       element, and not at all if fields is ADDR_FIELD_NONE.
+// Return code: same as sky_decode_resp_xml
+int32_t sky_decode_resp_xml_fields(char *buff, int32_t buff_len, int32_t data_len,
+        const struct location_rq_t * creq, struct location_rsp_t *cresp, uint32_t fields) {
 
     buff[buff_len - 1] = 0; // make sure it ends with \0
 
@@ -297,7 +360,9 @@ int32_t sky_decode_resp_xml(char *buff, int32_t buff_len, int32_t data_len,
     float fval;
     int32_t slen;
     char *p = NULL;
+    char *paddr = NULL; // start of the street-address element
 
+    const char streetaddr[] = "<street-address";
     const char distpoint[] = "<street-address distanceToPoint=\"";
     const char distpoints[] = "<street-address distanceToPoint=\"%f\">";
     const char lat[] = "<latitude>";
@@ -372,66 +437,76 @@ int32_t sky_decode_resp_xml(char *buff, int32_t buff_len, int32_t data_len,
     if (p != NULL && sscanf(p, hpes, &fval) == 1)
         cresp->location.hpe = fval;
 
-    p = strstr(buff, distpoint);
+    paddr = strstr(buff, streetaddr);
+    if (paddr == NULL)
+        return 0; // success, no address in response
 
-    if (p != NULL && sscanf(p, distpoints, &fval) == 1)
+    if (strncmp(paddr, distpoint, sizeof(distpoint) - 1) == 0 && sscanf(paddr, distpoints, &fval) == 1)
         cresp->location.distance_to_point = fval;
 
-    if ((slen = get_xval(buff, street, streetf, &p)) > 0) {
+    if ((fields & ADDR_FIELD_STREET_NUM) && (slen = get_xval(paddr, street, streetf, &p)) > 0) {
         cresp->location_ext.street_num_len = slen;
         cresp->location_ext.street_num = p;
     }
 
-    if ((slen = get_xval(buff, addr, addrf, &p)) > 0) {
+    if ((fields & ADDR_FIELD_ADDRESS) && (slen = get_xval(paddr, addr, addrf, &p)) > 0) {
         cresp->location_ext.address_len = slen;
         cresp->location_ext.address = p;
     }
 
-    if ((slen = get_xval(buff, city, cityf, &p)) > 0) {
+    if ((fields & ADDR_FIELD_CITY) && (slen = get_xval(paddr, city, cityf, &p)) > 0) {
         cresp->location_ext.city_len = slen;
         cresp->location_ext.city = p;
     }
 
-    if ((slen = get_xval(buff, metro1, metro1f, &p)) > 0) {
+    if ((fields & ADDR_FIELD_METRO1) && (slen = get_xval(paddr, metro1, metro1f, &p)) > 0) {
         cresp->location_ext.metro1_len = slen;
         cresp->location_ext.metro1 = p;
     }
 
-    if ((slen = get_xval(buff, metro2, metro2f, &p)) > 0) {
+    if ((fields & ADDR_FIELD_METRO2) && (slen = get_xval(paddr, metro2, metro2f, &p)) > 0) {
         cresp->location_ext.metro2_len = slen;
         cresp->location_ext.metro2 = p;
     }
 
-    if ((slen = get_xval(buff, postcode, postcodef, &p)) > 0) {
+    if ((fields & ADDR_FIELD_POSTAL_CODE) && (slen = get_xval(paddr, postcode, postcodef, &p)) > 0) {
         cresp->location_ext.postal_code_len = slen;
         cresp->location_ext.postal_code = p;
     }
 
-    if ((slen = get_xval(buff, county, countyf, &p)) > 0) {
+    if ((fields & ADDR_FIELD_COUNTY) && (slen = get_xval(paddr, county, countyf, &p)) > 0) {
         cresp->location_ext.county_len = slen;
         cresp->location_ext.county = p;
     }
 
-    if ((slen = get_xval(buff, statec, closebr, &p)) > 0) {
-        cresp->location_ext.state_code_len = slen;
-        cresp->location_ext.state_code = p;
-    }
+    // the state name has to be searched for right after the state code
+    if ((fields & (ADDR_FIELD_STATE_CODE | ADDR_FIELD_STATE))
+            && (slen = get_xval(paddr, statec, closebr, &p)) > 0) {
+        if (fields & ADDR_FIELD_STATE_CODE) {
+            cresp->location_ext.state_code_len = slen;
+            cresp->location_ext.state_code = p;
+        }
 
-    // has to be right after the statec, reusing the pointer
-    if ((slen = get_xval(p, closebr, statef, &p)) > 0) {
-        cresp->location_ext.state_len = slen;
-        cresp->location_ext.state = p;
+        // reusing the pointer
+        if ((fields & ADDR_FIELD_STATE) && (slen = get_xval(p, closebr, statef, &p)) > 0) {
+            cresp->location_ext.state_len = slen;
+            cresp->location_ext.state = p;
+        }
     }
 
-    if ((slen = get_xval(buff, countryc, closebr, &p)) > 0) {
-        cresp->location_ext.country_code_len = slen;
-        cresp->location_ext.country_code = p;
-    }
+    // the country name has to be searched for right after the country code
+    if ((fields & (ADDR_FIELD_COUNTRY_CODE | ADDR_FIELD_COUNTRY))
+            && (slen = get_xval(paddr, countryc, closebr, &p)) > 0) {
+        if (fields & ADDR_FIELD_COUNTRY_CODE) {
+            cresp->location_ext.country_code_len = slen;
+            cresp->location_ext.country_code = p;
+        }
 
-    // has to be right after the countryf, reusing the pointer
-    if ((slen = get_xval(p, closebr, countryf, &p)) > 0) {
-        cresp->location_ext.country_len = slen;
-        cresp->location_ext.country = p;
+        // reusing the pointer
+        if ((fields & ADDR_FIELD_COUNTRY) && (slen = get_xval(p, closebr, countryf, &p)) > 0) {
+            cresp->location_ext.country_len = slen;
+            cresp->location_ext.country = p;
+        }
     }
 
     return 0; // success
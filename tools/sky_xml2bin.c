@@ -0,0 +1,217 @@
+/************************************************
+ * Authors: Istvan Sleder and Marwan Kallal
+ *
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+/* Bulk converter of logged xml location requests into binary protocol records.
+ *
+ * usage: sky_xml2bin [-t threads] [-p partner_id] <input.xml> <output prefix>
+ *
+ * The input file is mapped into memory and split on </LocationRQ> boundaries
+ * into one range per thread. Each thread decodes its requests by
+ * sky_decode_req_xml, encodes them by sky_encode_req_bin (not encrypted) and
+ * appends the packets back to back to its own output file
+ * "<output prefix>.<thread no>", so the files can be concatenated in order.
+ *
+ * build: gcc -std=gnu99 -O2 -pthread -I../inc sky_xml2bin.c <library sources> -o sky_xml2bin
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sky_protocol.h"
+#include "sky_xml.h"
+#include "sky_util.h"
+
+#define MAX_THREADS 256
+
+static const char rq_end[] = "</LocationRQ>";
+static const char username[] = "username=\"";
+
+struct range_t {
+    const char *start;    // first byte of the range
+    const char *end;      // one past the last byte of the range
+    uint32_t partner_id;
+    const char *out_path;
+    uint64_t count;       // converted requests
+    uint64_t errors;      // requests failed to be converted
+};
+
+// return the position right after the next </LocationRQ> at or after p, or end
+static const char * next_boundary(const char *p, const char *end) {
+    const char *q = memmem(p, end - p, rq_end, sizeof(rq_end) - 1);
+    return (q == NULL) ? end : q + sizeof(rq_end) - 1;
+}
+
+// the device mac is the username of the authentication element
+static void decode_username(char *xml, struct location_rq_t *req, uint8_t *mac) {
+    char *p = strstr(xml, username);
+    if (p != NULL && hex2bin(p + sizeof(username) - 1, 12, mac, MAC_SIZE) == MAC_SIZE) {
+        req->mac = mac;
+        req->mac_count = 1;
+    }
+}
+
+static void free_req(struct location_rq_t *req) {
+    free(req->aps);
+    free(req->bles);
+    free(req->gsms);
+    free(req->cdmas);
+    free(req->umtss);
+    free(req->ltes);
+    free(req->gps);
+}
+
+static void * convert_range(void *arg) {
+    struct range_t *r = (struct range_t *) arg;
+
+    FILE *out = fopen(r->out_path, "wb");
+    if (out == NULL) {
+        perror(r->out_path);
+        return NULL;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    uint32_t xml_len = 64 * 1024;
+    char *xml = malloc(xml_len);
+    uint8_t bin[SKY_PROT_RQ_BUFF_LEN];
+    uint8_t mac[MAC_SIZE];
+    struct location_rq_t req;
+    struct sky_key_t key; // only the partner id is encoded
+    const char *p = r->start;
+
+    memset(&key, 0, sizeof(key));
+    key.partner_id = r->partner_id;
+
+    while (p < r->end && xml != NULL) {
+        const char *q = next_boundary(p, r->end);
+        uint32_t len = (uint32_t) (q - p);
+        if (memmem(p, len, rq_end, sizeof(rq_end) - 1) == NULL)
+            break; // trailing bytes without a request
+
+        // copy the request, since the xml decoder needs a \0 terminated, writable buffer
+        if (len + 1 > xml_len) {
+            xml_len = len + 1;
+            free(xml);
+            if ((xml = malloc(xml_len)) == NULL)
+                break;
+        }
+        memcpy(xml, p, len);
+        xml[len] = '\0';
+        p = q;
+
+        if (sky_decode_req_xml(xml, len + 1, len, &req) < 0) {
+            r->errors++;
+            free_req(&req);
+            continue;
+        }
+        decode_username(xml, &req, mac);
+        req.header.version = SKY_PROTOCOL_VERSION;
+#ifdef SKY_KEY_BY_REF
+        req.key = &key;
+#else
+        SKY_KEY(&req).partner_id = key.partner_id;
+#endif
+
+        int32_t n = sky_encode_req_bin(bin, sizeof(bin), &req);
+        if (n > 0 && fwrite(bin, 1, n, out) == (size_t) n)
+            r->count++;
+        else
+            r->errors++;
+        free_req(&req);
+    }
+
+    free(xml);
+    fclose(out);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t partner_id = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        case 'p':
+            partner_id = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-p partner_id] <input.xml> <output prefix>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-t threads] [-p partner_id] <input.xml> <output prefix>\n", argv[0]);
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (st.st_size == 0)
+        return 0;
+
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    const char *end = data + st.st_size;
+
+    // split into ranges at request boundaries
+    static struct range_t ranges[MAX_THREADS];
+    static pthread_t tids[MAX_THREADS];
+    static char paths[MAX_THREADS][4096];
+    const char *p = data;
+    long i;
+
+    for (i = 0; i < threads; i++) {
+        const char *nominal = data + (st.st_size / threads) * (i + 1);
+        ranges[i].start = p;
+        ranges[i].end = (i == threads - 1 || nominal <= p) ? end : next_boundary(nominal, end);
+        if (ranges[i].end < p)
+            ranges[i].end = p;
+        ranges[i].partner_id = partner_id;
+        snprintf(paths[i], sizeof(paths[i]), "%s.%03ld", argv[optind + 1], i);
+        ranges[i].out_path = paths[i];
+        p = ranges[i].end;
+
+        if (pthread_create(&tids[i], NULL, convert_range, &ranges[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    uint64_t count = 0, errors = 0;
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        count += ranges[i].count;
+        errors += ranges[i].errors;
+    }
+
+    munmap((void *) data, st.st_size);
+    close(fd);
+
+    printf("%lu requests converted, %lu errors\n", count, errors);
+    return errors > 0 ? 2 : 0;
+}